@@ -148,16 +148,16 @@ class QuantumCircuitInterface {
         }
 
         // Rerun quantum system
-        system_solution = QubitSystem(min_qubit_count);
-
-        for(int i = 0; i < circuit.get_operations_count(); i++) {
-            int result = circuit.run_operation(system_solution, i);
-            if(result != 0) {
-                // Something went wrong!
-                output_window.log("Something went wrong in operation: " + std::to_string(i + 1));
-                return;
-            }
+        system_solution.reset(min_qubit_count);
+
+        CompiledCircuit compiled_circuit;
+        int failed_operation_num = 0;
+        if(circuit.compile(&compiled_circuit, &failed_operation_num) != 0) {
+            // Something went wrong!
+            output_window.log("Something went wrong in operation: " + std::to_string(failed_operation_num + 1));
+            return;
         }
+        compiled_circuit.run(system_solution);
 
         output_window.log("Program successfully ran!\n");
         output_window.log("State vector:");
@@ -167,6 +167,7 @@ class QuantumCircuitInterface {
         // Perform the measurement
         output_window.log("\nMeasurement:");
         std::string measurement_str = "";
+        int outcome = system_solution.measure_qubits((1 << min_qubit_count) - 1);
         for(int i = 0; i < min_qubit_count; i++) {
             if(i != 0) {
                 measurement_str += ",  ";
@@ -174,7 +175,7 @@ class QuantumCircuitInterface {
             if(i != 0 && i%5 == 0) {
                 measurement_str += "\n";
             }
-            bool measurement = system_solution.measure(i);
+            bool measurement = (outcome >> i) & 1;
             measurement_str += "q"  + std::to_string(i) + ": " + std::to_string((int)measurement);
         }
         output_window.log(measurement_str);
@@ -244,8 +245,13 @@ void render() {
     info_console.log("..: Empty position");
     info_console.log("H_: Hadamar");
     info_console.log("T_: Phase shift");
+    info_console.log("M_: Measure, R_: Reset to 0");
     info_console.log("CC: Control bit of CNOT");
     info_console.log("CT: Target bit of CNOT");
+    info_console.log("CZ: Target bit of controlled Z");
+    info_console.log("CM: Classical control, the last measurement of the qubit");
+    info_console.log("More CC in the same column adds controls, e.g. CC CC CT is a Toffoli");
+    info_console.log("DC/DT/DZ, EC/ET/EZ: More controlled gates in the same column, paired by letter");
     info_console.draw();
 }
 
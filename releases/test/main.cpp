@@ -1,7 +1,7 @@
 #define USE_DEBUG
 #define DEBUG_KEYWORDS ".,!vicmil_std_lib" 
 #define TEST_KEYWORDS  ".,!vicmil_std_lib"
-#include "../../source/cubecollision_include.h"
+#include "../../source/quantum_computer_include.h"
 
 int main() {
     std::cout << "Starting!" << std::endl;
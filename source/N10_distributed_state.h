@@ -0,0 +1,328 @@
+#pragma once
+#include "N9_schrodinger_feynman.h"
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+namespace qubit_circuit {
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+
+/**
+ * A state vector split between worker processes, each process owns a slice of 2^(N-p) states
+ *
+ * With P = 2^p workers the top p qubits are "global": their values are the number of the worker(rank),
+ *   and the N-p "local" qubits index the states in the slice. Each worker simulates its slice as its own
+ *   QubitSystem, so gates on local qubits run independently without any communication, and a control on a
+ *   global qubit only decides if the worker applies the gate at all
+ *
+ * Diagonal gates on a global qubit are a phase on the whole slice. Only gates like hadamar, X and x/y rotations
+ *   on a global qubit mix two slices, then the two workers whose ranks differ in that qubit exchange their slices
+ *   through POSIX shared memory, synchronized with a barrier that is shared between the processes
+ *
+ * The workers are forked from the calling process, so it can all be run and tested on one machine
+*/
+
+struct _SharedBarrier {
+    pthread_barrier_t barrier;
+};
+
+class DistributedStateVector {
+public:
+    int qubit_count = 0;
+    int global_qubit_count = 0;
+    int local_qubit_count = 0;
+    int worker_count = 1;
+    // Statistics from the last run
+    int exchange_count = 0; // Gates that needed the slices to be exchanged between workers
+
+    DistributedStateVector(int qubit_count_, int global_qubit_count_) {
+        qubit_count = qubit_count_;
+        global_qubit_count = global_qubit_count_;
+        local_qubit_count = qubit_count - global_qubit_count;
+        worker_count = 1 << global_qubit_count;
+        Assert(global_qubit_count >= 0 && local_qubit_count >= 1 && local_qubit_count < 24 && qubit_count < 31);
+    }
+    DistributedStateVector(const DistributedStateVector&) = delete;
+    DistributedStateVector& operator=(const DistributedStateVector&) = delete;
+    ~DistributedStateVector() {
+        _unmap();
+    }
+
+    /**
+     * Run the circuit on |0> with one forked process per slice, the final state is left in the shared slices
+     * Returns -1 if the circuit has measurements, if the processes or shared memory could not be created, or if a worker failed
+    */
+    int run(const CompiledCircuit& circuit) {
+        if(circuit.qubit_count > qubit_count || circuit.find_invalid_instruction() != -1) {
+            return -1;
+        }
+        exchange_count = 0;
+        for(int i = 0; i < circuit.instructions.size(); i++) {
+            const GateInstruction& instruction = circuit.instructions[i];
+            if(is_measurement_op(instruction.op) || instruction.condition_mask != 0) {
+                return -1; // The workers would have to agree on the outcome
+            }
+            if(instruction.target >= local_qubit_count && !is_diagonal_gate(instruction)) {
+                exchange_count++;
+            }
+        }
+        if(_map() != 0) {
+            return -1;
+        }
+        pthread_barrierattr_t barrier_attributes;
+        pthread_barrierattr_init(&barrier_attributes);
+        pthread_barrierattr_setpshared(&barrier_attributes, PTHREAD_PROCESS_SHARED);
+        pthread_barrier_init(&_shared_barrier->barrier, &barrier_attributes, worker_count);
+        pthread_barrierattr_destroy(&barrier_attributes);
+
+        std::vector<pid_t> worker_pids = {};
+        for(int rank = 0; rank < worker_count; rank++) {
+            pid_t pid = fork();
+            if(pid == 0) {
+                _run_worker(circuit, rank);
+                _exit(0); // Skip the destructors and exit handlers of the parent
+            }
+            if(pid < 0) {
+                // The workers that were started would wait forever at the barrier
+                for(int i = 0; i < worker_pids.size(); i++) {
+                    kill(worker_pids[i], SIGKILL);
+                    waitpid(worker_pids[i], nullptr, 0);
+                }
+                pthread_barrier_destroy(&_shared_barrier->barrier);
+                return -1;
+            }
+            worker_pids.push_back(pid);
+        }
+        // Polled, so a worker that dies(assert, out of memory, signal) is seen while the others wait at the barrier for it
+        //   Only the workers are waited for, other children of the process are left alone
+        int result = 0;
+        while(worker_pids.size() > 0) {
+            bool worker_exited = false;
+            for(int i = 0; i < worker_pids.size(); i++) {
+                int status = 0;
+                pid_t waited_pid = waitpid(worker_pids[i], &status, WNOHANG);
+                if(waited_pid == 0) {
+                    continue;
+                }
+                worker_exited = true;
+                worker_pids.erase(worker_pids.begin() + i);
+                i--;
+                if(waited_pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    if(result == 0) {
+                        for(int j = 0; j < worker_pids.size(); j++) {
+                            kill(worker_pids[j], SIGKILL);
+                        }
+                    }
+                    result = -1;
+                }
+            }
+            if(!worker_exited) {
+                usleep(1000);
+            }
+        }
+        if(result == 0) {
+            // Not after a failure, destroy waits for killed workers to leave the barrier. It is initialized again on the next run
+            pthread_barrier_destroy(&_shared_barrier->barrier);
+        }
+        return result;
+    }
+    /**
+     * Get the amplitude of a state(bit i is qubit i) after the last run
+    */
+    std::complex<double> get_amplitude(int state_index) {
+        if(_slices.size() == 0) {
+            return state_index == 0 ? 1 : 0;
+        }
+        return _slices[state_index >> local_qubit_count][state_index & _get_local_mask()];
+    }
+    /**
+     * Get the probability that the qubit is measured as 1 after the last run
+    */
+    double get_qubit_probability(int qubit_num) {
+        double total_probability = 0;
+        double probability = 0;
+        for(int rank = 0; rank < _slices.size(); rank++) {
+            for(int i = 0; i < (1 << local_qubit_count); i++) {
+                double state_probability = std::norm(_slices[rank][i]);
+                total_probability += state_probability;
+                if((((rank << local_qubit_count) | i) >> qubit_num) & 1) {
+                    probability += state_probability;
+                }
+            }
+        }
+        return total_probability > 0 ? probability / total_probability : 0;
+    }
+
+private:
+    _SharedBarrier* _shared_barrier = nullptr;
+    std::vector<std::complex<double>*> _slices = {};
+
+    int _get_local_mask() {
+        return (1 << local_qubit_count) - 1;
+    }
+    int64_t _get_slice_size() {
+        return ((int64_t)1 << local_qubit_count) * sizeof(std::complex<double>);
+    }
+    /**
+     * Map a new shared memory segment, the name is removed directly so nothing is left behind
+     *   if a process crashes, the mapping is inherited by the forked workers
+    */
+    static void* _map_shared_memory(int64_t size) {
+        static int segment_count = 0;
+        std::string name = "/qubit_circuit_" + std::to_string(getpid()) + "_" + std::to_string(segment_count++);
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if(fd == -1) {
+            return nullptr;
+        }
+        shm_unlink(name.c_str());
+        void* memory = nullptr;
+        if(ftruncate(fd, size) == 0) {
+            memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        return memory == MAP_FAILED ? nullptr : memory;
+    }
+    int _map() {
+        if(_shared_barrier != nullptr) {
+            return 0;
+        }
+        _shared_barrier = (_SharedBarrier*)_map_shared_memory(sizeof(_SharedBarrier));
+        if(_shared_barrier == nullptr) {
+            return -1;
+        }
+        for(int rank = 0; rank < worker_count; rank++) {
+            std::complex<double>* slice = (std::complex<double>*)_map_shared_memory(_get_slice_size());
+            if(slice == nullptr) {
+                _unmap();
+                return -1;
+            }
+            _slices.push_back(slice);
+        }
+        return 0;
+    }
+    void _unmap() {
+        for(int i = 0; i < _slices.size(); i++) {
+            munmap(_slices[i], _get_slice_size());
+        }
+        _slices = {};
+        if(_shared_barrier != nullptr) {
+            munmap(_shared_barrier, sizeof(_SharedBarrier));
+            _shared_barrier = nullptr;
+        }
+    }
+    void _run_worker(const CompiledCircuit& circuit, int rank) {
+        vicmil::ThreadPool::run_serially_on_this_thread(); // The threads of the pool are not copied by fork
+        QubitSystem local_system = QubitSystem(local_qubit_count);
+        if(rank != 0) {
+            local_system._qubit_states[0].v = 0;
+        }
+        // Consecutive local gates are collected and run together, so they are applied in layers
+        CompiledCircuit local_circuit;
+        local_circuit.qubit_count = local_qubit_count;
+        for(int i = 0; i < circuit.instructions.size(); i++) {
+            GateInstruction instruction = circuit.instructions[i];
+            uint64_t controls = instruction.control_mask;
+            if(instruction.control != -1) {
+                controls |= (uint64_t)1 << instruction.control;
+            }
+            int global_controls = (int)(controls >> local_qubit_count);
+            int local_controls = (int)(controls & _get_local_mask());
+            bool controls_met = (rank & global_controls) == global_controls;
+            if(instruction.op == op_cnot) {
+                instruction.op = op_multi_controlled_x;
+                instruction.control = -1;
+            }
+            instruction.control_mask = local_controls;
+            if(instruction.target < local_qubit_count) {
+                if(controls_met) {
+                    local_circuit.instructions.push_back(instruction);
+                }
+                continue;
+            }
+            local_circuit.run(local_system);
+            local_circuit.instructions.clear();
+            int target_bit = 1 << (instruction.target - local_qubit_count);
+            bool target_set = (rank & target_bit) != 0;
+            std::complex<double> matrix[4];
+            get_single_qubit_matrix(instruction, matrix);
+            if(!is_diagonal_gate(instruction)) {
+                _exchange(local_system, instruction, matrix, rank ^ target_bit, target_set, controls_met);
+            }
+            else if(controls_met && matrix[target_set ? 3 : 0] != 1.0) {
+                local_system._multiply_subspace(local_controls, local_controls, matrix[target_set ? 3 : 0]);
+            }
+        }
+        local_circuit.run(local_system);
+        std::complex<double>* slice = _slices[rank];
+        for(int i = 0; i < local_system._qubit_states.size(); i++) {
+            slice[i] = local_system._qubit_states[i].v;
+        }
+    }
+    /**
+     * Apply the matrix of a gate on a global qubit, together with the partner worker that differs in that qubit
+     *   All workers take part in the barriers, also those where the controls are not met
+    */
+    void _exchange(QubitSystem& local_system, const GateInstruction& instruction, const std::complex<double>* matrix, int partner_rank, bool target_set, bool controls_met) {
+        int rank = partner_rank ^ (1 << (instruction.target - local_qubit_count));
+        std::complex<double>* own_slice = _slices[rank];
+        const std::complex<double>* partner_slice = _slices[partner_rank];
+        QubitsState* states = local_system._qubit_states.data();
+        for(int i = 0; i < local_system._qubit_states.size(); i++) {
+            own_slice[i] = states[i].v;
+        }
+        pthread_barrier_wait(&_shared_barrier->barrier);
+        if(controls_met) {
+            int local_controls = (int)instruction.control_mask;
+            // The new amplitude is row target_set of the matrix times the amplitudes of |0> and |1>
+            std::complex<double> own_factor = target_set ? matrix[3] : matrix[0];
+            std::complex<double> partner_factor = target_set ? matrix[2] : matrix[1];
+            for(int i = 0; i < local_system._qubit_states.size(); i++) {
+                if((i & local_controls) == local_controls) {
+                    states[i].v = own_factor * own_slice[i] + partner_factor * partner_slice[i];
+                }
+            }
+        }
+        // The partner may not overwrite its slice before this worker has read it
+        pthread_barrier_wait(&_shared_barrier->barrier);
+    }
+};
+
+void TEST_DistributedStateVector() {
+    CompiledCircuit circuit;
+    circuit.qubit_count = 8;
+    vicmil::RandomNumberGenerator rand_gen;
+    rand_gen.set_seed(11);
+    for(int i = 0; i < 80; i++) {
+        int qubit = rand_gen.rand() % 8;
+        int other_qubit = (qubit + 1 + rand_gen.rand() % 7) % 8;
+        switch(rand_gen.rand() % 8) {
+            case 0: circuit.add_hadamar(qubit); break;
+            case 1: circuit.add_phase_shift(qubit); break;
+            case 2: circuit.add_cnot(qubit, other_qubit); break;
+            case 3: circuit.add_phase(qubit, 0.3 * i); break;
+            case 4: circuit.add_multi_controlled_z({other_qubit}, qubit); break;
+            case 5: circuit.add_toffoli(qubit, (qubit + 1) % 8, (qubit + 4) % 8); break;
+            case 6: circuit.add_ry(qubit, 0.2 * i); break;
+            case 7: circuit.add_rz(qubit, 0.1 * i); break;
+        }
+    }
+    QubitSystem system = QubitSystem(8);
+    assert(circuit.run(system) == 0);
+    DistributedStateVector state_vector = DistributedStateVector(8, 2); // 4 workers with 64 states each
+    assert(state_vector.run(circuit) == 0);
+    assert(state_vector.exchange_count > 0);
+    for(int i = 0; i < system._qubit_states.size(); i++) {
+        assert(std::abs(state_vector.get_amplitude(i) - system._qubit_states[i].v) < 0.000001);
+    }
+    assert(std::abs(state_vector.get_qubit_probability(7) - system.get_qubit_probability(7)) < 0.000001);
+}
+AddTest(TEST_DistributedStateVector);
+
+#endif
+}
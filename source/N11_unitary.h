@@ -0,0 +1,141 @@
+#pragma once
+#include "N10_distributed_state.h"
+
+namespace qubit_circuit {
+
+/**
+ * Building the full 2^N x 2^N unitary matrix of a circuit, e.g. to check that a rewrite of a circuit does the same thing
+ *
+ * Column j of the unitary is the circuit applied to the basis state |j>. A block of 2^b columns is stored as one state of
+ *   N + b qubits, where the extra high qubits are the column in the block, so running the circuit on it with the normal
+ *   state vector kernels applies every gate to all columns of the block at once. The blocks are kept small enough
+ *   to stay in the cache while all gates are applied, and different blocks are run on different threads
+*/
+
+const int unitary_block_qubit_count = 14; // 2^14 amplitudes(256 KB) in each block
+const int max_unitary_qubit_count = 14; // The matrix of 14 qubits is already 4 GB
+
+/**
+ * Get the unitary of the circuit, row major: (*unitary)[row * 2^N + column] = <row|C|column>
+ * Returns -1 if the circuit has measurements or is too large
+*/
+int get_unitary(const CompiledCircuit& circuit, std::vector<std::complex<double>>* unitary) {
+    int qubit_count = std::max(circuit.qubit_count, 1);
+    if(qubit_count > max_unitary_qubit_count || circuit.find_invalid_instruction() != -1) {
+        return -1;
+    }
+    for(int i = 0; i < circuit.instructions.size(); i++) {
+        if(is_measurement_op(circuit.instructions[i].op) || circuit.instructions[i].condition_mask != 0) {
+            return -1; // Not a unitary
+        }
+    }
+    int64_t dimension = (int64_t)1 << qubit_count;
+    int column_qubit_count = std::max(0, std::min(qubit_count, unitary_block_qubit_count - qubit_count));
+    int64_t block_column_count = (int64_t)1 << column_qubit_count;
+    unitary->assign(dimension * dimension, 0);
+    std::complex<double>* matrix = unitary->data();
+
+    vicmil::parallel_for(0, dimension / block_column_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+        QubitSystem block = QubitSystem(qubit_count + column_qubit_count);
+        for(int64_t block_num = chunk_begin; block_num < chunk_end; block_num++) {
+            int64_t first_column = block_num * block_column_count;
+            block.reset(qubit_count + column_qubit_count);
+            block._qubit_states[0].v = 0;
+            for(int64_t k = 0; k < block_column_count; k++) {
+                block._qubit_states[(k << qubit_count) | (first_column + k)].v = 1;
+            }
+            // The block is in the cache, so the gates are applied one by one instead of in fused layers,
+            //   the fused pass saves memory traffic but costs more arithmetic per state
+            for(int i = 0; i < circuit.instructions.size(); i++) {
+                CompiledCircuit::run_instruction(block, circuit.instructions[i]);
+            }
+            for(int64_t k = 0; k < block_column_count; k++) {
+                const QubitsState* column = block._qubit_states.data() + (k << qubit_count);
+                for(int64_t row = 0; row < dimension; row++) {
+                    matrix[row * dimension + first_column + k] = column[row].v;
+                }
+            }
+        }
+    }, 1);
+    return 0;
+}
+
+int get_unitary(QuantumCircuit& circuit, std::vector<std::complex<double>>* unitary) {
+    CompiledCircuit compiled_circuit;
+    if(circuit.compile(&compiled_circuit) != 0) {
+        return -1;
+    }
+    return get_unitary(compiled_circuit, unitary);
+}
+
+/**
+ * Returns true if the unitaries are the same up to a global phase, a = e^(i*phase) * b,
+ *   with no element differing by more than tolerance
+*/
+bool unitaries_equal_up_to_global_phase(const std::vector<std::complex<double>>& a, const std::vector<std::complex<double>>& b, double tolerance = 0.000001) {
+    if(a.size() != b.size()) {
+        return false;
+    }
+    // The phase is taken from the largest element, where it is the least sensitive to rounding errors
+    int64_t largest_index = 0;
+    for(int64_t i = 0; i < a.size(); i++) {
+        if(std::norm(a[i]) > std::norm(a[largest_index])) {
+            largest_index = i;
+        }
+    }
+    if(a.size() == 0 || std::abs(b[largest_index]) < tolerance) {
+        return a.size() == 0;
+    }
+    std::complex<double> phase_factor = a[largest_index] / b[largest_index];
+    phase_factor /= std::abs(phase_factor);
+    for(int64_t i = 0; i < a.size(); i++) {
+        if(std::abs(a[i] - phase_factor * b[i]) > tolerance) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TEST_get_unitary() {
+    CompiledCircuit circuit;
+    circuit.qubit_count = 3;
+    circuit.add_hadamar(0);
+    circuit.add_cnot(0, 2);
+    circuit.add_phase_shift(2);
+    circuit.add_toffoli(2, 0, 1);
+    circuit.add_phase(1, 0.7);
+    std::vector<std::complex<double>> unitary;
+    assert(get_unitary(circuit, &unitary) == 0);
+    // Each column is the circuit run on a basis state
+    for(int column = 0; column < 8; column++) {
+        QubitSystem system = QubitSystem(3);
+        for(int i = 0; i < 3; i++) {
+            if((column >> i) & 1) {
+                system.multi_controlled_x(0, i);
+            }
+        }
+        assert(circuit.run(system) == 0);
+        for(int row = 0; row < 8; row++) {
+            assert(std::abs(unitary[row * 8 + column] - system._qubit_states[row].v) < 0.000001);
+        }
+    }
+
+    // Z X Z X = -I, the same as doing nothing up to a global phase
+    CompiledCircuit minus_identity;
+    minus_identity.qubit_count = 3;
+    for(int i = 0; i < 2; i++) {
+        minus_identity.add_multi_controlled_z({}, 1);
+        minus_identity.add_multi_controlled_x({}, 1);
+    }
+    CompiledCircuit identity;
+    identity.qubit_count = 3;
+    std::vector<std::complex<double>> unitary1;
+    std::vector<std::complex<double>> unitary2;
+    assert(get_unitary(minus_identity, &unitary1) == 0);
+    assert(get_unitary(identity, &unitary2) == 0);
+    assert(std::abs(unitary1[0] + 1.0) < 0.000001);
+    assert(unitaries_equal_up_to_global_phase(unitary1, unitary2));
+    assert(!unitaries_equal_up_to_global_phase(unitary, unitary2));
+}
+AddTest(TEST_get_unitary);
+}
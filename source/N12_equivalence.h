@@ -0,0 +1,177 @@
+#pragma once
+#include "N11_unitary.h"
+
+namespace qubit_circuit {
+
+/**
+ * Checking that two circuits do the same thing, without building their unitaries
+ *
+ * Both circuits are run on the same random input states, and the output states are compared with their overlap <a|b>.
+ *   Equivalent circuits give |<a|b>| = 1 with the same global phase for every input, while circuits that differ
+ *   almost never do that for a random input. Random product states and random stabilizer states are used,
+ *   the stabilizer states are entangled and find differences that only show up with entangled inputs
+ *
+ * The inputs are run in parallel, and the check stops at the first input that gives a mismatch
+*/
+
+class EquivalenceChecker {
+public:
+    int product_state_count = 4;
+    int stabilizer_state_count = 4;
+    double tolerance = 0.000001; // Largest allowed 1 - |<a|b>|, and difference in global phase between inputs
+    uint64_t seed = 1;
+    // Statistics from the last check
+    int checked_state_count = 0;
+
+    /**
+     * Set equivalent to if the circuits are the same up to a global phase, equivalent circuits always pass
+     * Returns -1 if a circuit has measurements or is too large
+    */
+    int check(const CompiledCircuit& a, const CompiledCircuit& b, bool* equivalent) {
+        int qubit_count = std::max(std::max(a.qubit_count, b.qubit_count), 1);
+        if(qubit_count >= 24 || a.find_invalid_instruction() != -1 || b.find_invalid_instruction() != -1) {
+            return -1;
+        }
+        for(int i = 0; i < a.instructions.size() + b.instructions.size(); i++) {
+            const GateInstruction& instruction = i < a.instructions.size() ? a.instructions[i] : b.instructions[i - a.instructions.size()];
+            if(is_measurement_op(instruction.op) || instruction.condition_mask != 0) {
+                return -1; // Not a unitary
+            }
+        }
+        int input_count = product_state_count + stabilizer_state_count;
+        std::vector<std::complex<double>> overlaps = std::vector<std::complex<double>>(input_count, 0);
+        std::vector<int> checked_counts = std::vector<int>(vicmil::get_thread_pool().get_thread_count(), 0);
+        std::atomic<bool> mismatch_found(false);
+        vicmil::parallel_for(0, input_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            for(int input_num = chunk_begin; input_num < chunk_end && !mismatch_found; input_num++) {
+                QubitSystem system_a = QubitSystem(qubit_count);
+                _prepare_input(input_num, system_a);
+                QubitSystem system_b = system_a;
+                a.run(system_a);
+                b.run(system_b);
+                std::complex<double> overlap = 0;
+                for(int i = 0; i < system_a._qubit_states.size(); i++) {
+                    overlap += std::conj(system_a._qubit_states[i].v) * system_b._qubit_states[i].v;
+                }
+                overlaps[input_num] = overlap;
+                checked_counts[chunk_num]++;
+                if(1 - std::abs(overlap) > tolerance) {
+                    mismatch_found = true;
+                }
+            }
+        }, 1);
+
+        checked_state_count = 0;
+        for(int i = 0; i < checked_counts.size(); i++) {
+            checked_state_count += checked_counts[i];
+        }
+        *equivalent = !mismatch_found;
+        // The global phase has to be the same for all inputs, otherwise the circuits differ by a relative phase
+        for(int i = 1; i < input_count && *equivalent; i++) {
+            if(std::abs(overlaps[i] - overlaps[0]) > tolerance) {
+                *equivalent = false;
+            }
+        }
+        return 0;
+    }
+    int check(QuantumCircuit& a, QuantumCircuit& b, bool* equivalent) {
+        CompiledCircuit compiled_a;
+        CompiledCircuit compiled_b;
+        if(a.compile(&compiled_a) != 0 || b.compile(&compiled_b) != 0) {
+            return -1;
+        }
+        return check(compiled_a, compiled_b, equivalent);
+    }
+
+private:
+    /**
+     * Set the system to input number input_num, the first ones are product states and the rest stabilizer states
+    */
+    void _prepare_input(int input_num, QubitSystem& system) {
+        vicmil::RandomNumberGenerator rand_gen;
+        rand_gen.set_seed(seed + input_num);
+        int qubit_count = system._qubit_count;
+        std::vector<std::complex<double>> qubit_amplitudes;
+        for(int i = 0; i < qubit_count; i++) {
+            if(input_num < product_state_count) {
+                // cos(a)|0> + e^(i*b) * sin(a)|1> reaches any single qubit state up to a global phase
+                double angle = rand_gen.rand_between_0_and_1() * vicmil::PI / 2;
+                qubit_amplitudes.push_back(std::cos(angle));
+                qubit_amplitudes.push_back(std::polar(std::sin(angle), rand_gen.rand_between_0_and_1() * 2 * vicmil::PI));
+            }
+            else {
+                qubit_amplitudes.push_back(1); // |+>
+                qubit_amplitudes.push_back(1);
+            }
+        }
+        system.set_product_state(qubit_amplitudes);
+        if(input_num < product_state_count) {
+            return;
+        }
+        // Then a random Clifford circuit of H, S and cnot gates
+        CompiledCircuit preparation;
+        preparation.qubit_count = qubit_count;
+        for(int i = 0; i < qubit_count * 4; i++) {
+            int qubit = rand_gen.rand() % qubit_count;
+            int gate_type = rand_gen.rand() % 3;
+            if(gate_type == 0) {
+                preparation.add_hadamar(qubit);
+            }
+            else if(gate_type == 1 || qubit_count == 1) {
+                preparation.add_phase(qubit, vicmil::PI / 2);
+            }
+            else {
+                preparation.add_cnot(qubit, (qubit + 1 + rand_gen.rand() % (qubit_count - 1)) % qubit_count);
+            }
+        }
+        preparation.run(system);
+    }
+};
+
+void TEST_EquivalenceChecker() {
+    CompiledCircuit circuit;
+    circuit.qubit_count = 6;
+    vicmil::RandomNumberGenerator rand_gen;
+    rand_gen.set_seed(5);
+    for(int i = 0; i < 60; i++) {
+        int qubit = rand_gen.rand() % 6;
+        int other_qubit = (qubit + 1 + rand_gen.rand() % 5) % 6;
+        switch(rand_gen.rand() % 4) {
+            case 0: circuit.add_hadamar(qubit); circuit.add_hadamar(qubit); break;
+            case 1: circuit.add_phase_shift(qubit); break;
+            case 2: circuit.add_cnot(qubit, other_qubit); break;
+            case 3: circuit.add_toffoli(qubit, (qubit + 1) % 6, (qubit + 3) % 6); break;
+        }
+    }
+    CompiledCircuit optimized_circuit = circuit;
+    CircuitOptimizer optimizer;
+    assert(optimizer.optimize(optimized_circuit) > 0);
+    EquivalenceChecker checker;
+    bool equivalent = false;
+    assert(checker.check(circuit, optimized_circuit, &equivalent) == 0);
+    assert(equivalent);
+    assert(checker.checked_state_count == checker.product_state_count + checker.stabilizer_state_count);
+
+    // A single extra controlled z is found
+    CompiledCircuit changed_circuit = optimized_circuit;
+    changed_circuit.add_multi_controlled_z({2}, 4);
+    assert(checker.check(circuit, changed_circuit, &equivalent) == 0);
+    assert(!equivalent);
+
+    // A global phase is allowed, a relative phase is not
+    CompiledCircuit phase_circuit;
+    phase_circuit.qubit_count = 2;
+    phase_circuit.add_phase(0, 0.5);
+    CompiledCircuit global_phase_circuit = phase_circuit;
+    global_phase_circuit.add_multi_controlled_x({}, 1);
+    global_phase_circuit.add_multi_controlled_z({}, 1);
+    global_phase_circuit.add_multi_controlled_x({}, 1);
+    global_phase_circuit.add_multi_controlled_z({}, 1); // Z X Z X = -I
+    assert(checker.check(phase_circuit, global_phase_circuit, &equivalent) == 0);
+    assert(equivalent);
+    global_phase_circuit.add_phase(1, 0.01);
+    assert(checker.check(phase_circuit, global_phase_circuit, &equivalent) == 0);
+    assert(!equivalent);
+}
+AddTest(TEST_EquivalenceChecker);
+}
@@ -0,0 +1,246 @@
+#pragma once
+#include "N12_equivalence.h"
+
+namespace qubit_circuit {
+
+/**
+ * Expectation values of observables, and their gradients with respect to the rotation parameters of a circuit
+ *
+ * The gradient is computed with the adjoint method: the circuit is run forward once to get |psi>, and then the gates
+ *   are undone one by one from the end, keeping both the state and H|psi> moved back to the same point in the circuit.
+ *   At each rotation the derivative of that gate is found from the two states, so all P parameters take one
+ *   forward and one backward pass, instead of 2P runs of the whole circuit with the parameter shift rule
+*/
+
+/**
+ * A product of pauli matrices times a coefficient, P|j> = i^|x&z| * (-1)^|j&z| * |j^x>
+*/
+struct PauliTerm {
+    double coefficient = 0;
+    int x_mask = 0; // Qubits with X or Y
+    int z_mask = 0; // Qubits with Z or Y
+};
+
+/**
+ * An observable that is a sum of pauli terms, e.g. 0.5*ZZ + 0.2*XI
+*/
+class PauliObservable {
+public:
+    std::vector<PauliTerm> terms = {};
+
+    /**
+     * Add a term, character i of paulis is the pauli matrix on qubit i(I, X, Y or Z), e.g. add_term(0.5, "ZIZ")
+     * Returns -1 if paulis has any other characters
+    */
+    int add_term(double coefficient, const std::string& paulis) {
+        PauliTerm term;
+        term.coefficient = coefficient;
+        for(int i = 0; i < paulis.size(); i++) {
+            if(paulis[i] == 'X' || paulis[i] == 'Y') {
+                term.x_mask |= 1 << i;
+            }
+            if(paulis[i] == 'Z' || paulis[i] == 'Y') {
+                term.z_mask |= 1 << i;
+            }
+            if(paulis[i] != 'I' && paulis[i] != 'X' && paulis[i] != 'Y' && paulis[i] != 'Z') {
+                return -1;
+            }
+        }
+        terms.push_back(term);
+        return 0;
+    }
+    int get_qubit_count() const {
+        int qubit_count = 0;
+        for(int i = 0; i < terms.size(); i++) {
+            while(((terms[i].x_mask | terms[i].z_mask) >> qubit_count) != 0) {
+                qubit_count++;
+            }
+        }
+        return qubit_count;
+    }
+    /**
+     * Get the factor that P|j> is multiplied with
+    */
+    static std::complex<double> get_term_factor(const PauliTerm& term, int state_index) {
+        const std::complex<double> i_powers[4] = {1, std::complex<double>(0, 1), -1, std::complex<double>(0, -1)};
+        int power = vicmil::count_bits(term.x_mask & term.z_mask) + 2 * vicmil::count_bits(state_index & term.z_mask);
+        return term.coefficient * i_powers[power % 4];
+    }
+    /**
+     * Set output to the observable applied to the state, output must have the same number of qubits
+    */
+    void apply(const QubitSystem& state, QubitSystem& output) const {
+        const QubitsState* input_states = state._qubit_states.data();
+        QubitsState* output_states = output._qubit_states.data();
+        double norm_scale = state._norm_scale;
+        // Gathered per output state, so each state is written once and the threads never write to the same state
+        vicmil::parallel_for(0, state._qubit_states.size(), [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            for(int k = chunk_begin; k < chunk_end; k++) {
+                std::complex<double> value = 0;
+                for(int t = 0; t < terms.size(); t++) {
+                    int j = k ^ terms[t].x_mask;
+                    value += get_term_factor(terms[t], j) * input_states[j].v;
+                }
+                output_states[k].v = value * norm_scale;
+            }
+        });
+        output._norm_scale = 1;
+    }
+    /**
+     * Get <state|observable|state>
+    */
+    double get_expectation_value(const QubitSystem& state) const {
+        const QubitsState* states = state._qubit_states.data();
+        std::vector<double> partial_sums = std::vector<double>(vicmil::get_thread_pool().get_thread_count(), 0);
+        vicmil::parallel_for(0, state._qubit_states.size(), [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            double sum = 0;
+            for(int t = 0; t < terms.size(); t++) {
+                for(int j = chunk_begin; j < chunk_end; j++) {
+                    sum += (std::conj(states[j ^ terms[t].x_mask].v) * get_term_factor(terms[t], j) * states[j].v).real();
+                }
+            }
+            partial_sums[chunk_num] = sum;
+        });
+        double expectation_value = 0;
+        for(int i = 0; i < partial_sums.size(); i++) {
+            expectation_value += partial_sums[i];
+        }
+        return expectation_value * state._norm_scale * state._norm_scale;
+    }
+};
+
+// Get <a|b>
+std::complex<double> get_inner_product(const QubitSystem& a, const QubitSystem& b) {
+    const QubitsState* a_states = a._qubit_states.data();
+    const QubitsState* b_states = b._qubit_states.data();
+    std::vector<std::complex<double>> partial_sums = std::vector<std::complex<double>>(vicmil::get_thread_pool().get_thread_count(), 0);
+    vicmil::parallel_for(0, a._qubit_states.size(), [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+        std::complex<double> sum = 0;
+        for(int64_t i = chunk_begin; i < chunk_end; i++) {
+            sum += std::conj(a_states[i].v) * b_states[i].v;
+        }
+        partial_sums[chunk_num] = sum;
+    });
+    std::complex<double> inner_product = 0;
+    for(int i = 0; i < partial_sums.size(); i++) {
+        inner_product += partial_sums[i];
+    }
+    return inner_product * a._norm_scale * b._norm_scale;
+}
+
+/**
+ * Get the expectation value of the observable after running the circuit on |0>, and the gradient with respect to
+ *   every parameter of the circuit, gradient[i] is the derivative by parameter_values[i]
+ * Returns -1 if the circuit has measurements or there are too few parameter values
+*/
+int get_adjoint_gradient(const CompiledCircuit& circuit, const std::vector<double>& parameter_values, const PauliObservable& observable,
+    double* expectation_value, std::vector<double>* gradient) {
+    CompiledCircuit bound_circuit;
+    if(circuit.find_invalid_instruction() != -1 || circuit.bind_parameters(parameter_values, &bound_circuit) != 0) {
+        return -1;
+    }
+    for(int i = 0; i < circuit.instructions.size(); i++) {
+        if(is_measurement_op(circuit.instructions[i].op) || circuit.instructions[i].condition_mask != 0) {
+            return -1; // The gates can not be undone
+        }
+    }
+    int qubit_count = std::max(std::max(circuit.qubit_count, observable.get_qubit_count()), 1);
+    QubitSystem state = QubitSystem(qubit_count);
+    bound_circuit.run(state);
+    QubitSystem observable_state = QubitSystem(qubit_count); // H|psi>, moved back through the circuit with the state
+    observable.apply(state, observable_state);
+    *expectation_value = get_inner_product(state, observable_state).real();
+
+    gradient->assign(circuit.parameter_names.size(), 0);
+    QubitSystem derivative_state = QubitSystem(qubit_count);
+    for(int i = bound_circuit.instructions.size() - 1; i >= 0; i--) {
+        const GateInstruction& instruction = bound_circuit.instructions[i];
+        CompiledCircuit::run_instruction(state, get_inverse_instruction(instruction));
+        int parameter_num = circuit.instructions[i].parameter_num;
+        if(parameter_num != -1) {
+            // The derivative of exp(-i * angle/2 * P) is exp(-i * (angle + pi)/2 * P) / 2,
+            //   and d<psi|H|psi> = 2 * Re(<psi|H ... d(gate) ...|0>)
+            derivative_state = state;
+            GateInstruction shifted_instruction = instruction;
+            shifted_instruction.param += vicmil::PI;
+            CompiledCircuit::run_instruction(derivative_state, shifted_instruction);
+            (*gradient)[parameter_num] += get_inner_product(observable_state, derivative_state).real();
+        }
+        CompiledCircuit::run_instruction(observable_state, get_inverse_instruction(instruction));
+    }
+    return 0;
+}
+
+/**
+ * The same with the parameters by name, gradient is set to the derivative by each parameter of the circuit
+*/
+int get_adjoint_gradient(const CompiledCircuit& circuit, const std::map<std::string, double>& parameters, const PauliObservable& observable,
+    double* expectation_value, std::map<std::string, double>* gradient) {
+    std::vector<double> parameter_values;
+    std::vector<double> gradient_values;
+    if(circuit.get_parameter_values(parameters, &parameter_values) != 0 ||
+        get_adjoint_gradient(circuit, parameter_values, observable, expectation_value, &gradient_values) != 0) {
+        return -1;
+    }
+    gradient->clear();
+    for(int i = 0; i < circuit.parameter_names.size(); i++) {
+        (*gradient)[circuit.parameter_names[i]] = gradient_values[i];
+    }
+    return 0;
+}
+
+void TEST_get_adjoint_gradient() {
+    CompiledCircuit circuit;
+    circuit.qubit_count = 4;
+    vicmil::RandomNumberGenerator rand_gen;
+    rand_gen.set_seed(9);
+    std::vector<std::string> names = {"a", "b", "c", "d", "e"};
+    for(int i = 0; i < 40; i++) {
+        int qubit = rand_gen.rand() % 4;
+        int other_qubit = (qubit + 1 + rand_gen.rand() % 3) % 4;
+        switch(rand_gen.rand() % 6) {
+            case 0: circuit.add_hadamar(qubit); break;
+            case 1: circuit.add_phase_shift(qubit); break;
+            case 2: circuit.add_cnot(qubit, other_qubit); break;
+            case 3: circuit.add_rx(qubit, names[rand_gen.rand() % 5]); break; // The parameters are used by many gates
+            case 4: circuit.add_ry(qubit, names[rand_gen.rand() % 5]); break;
+            case 5: circuit.add_rz(qubit, names[rand_gen.rand() % 5]); break;
+        }
+    }
+    PauliObservable observable;
+    assert(observable.add_term(0.5, "ZZII") == 0);
+    assert(observable.add_term(-0.3, "XIYI") == 0);
+    assert(observable.add_term(0.2, "IYIZ") == 0);
+    assert(observable.add_term(1, "IXQ") == -1);
+
+    std::vector<double> parameter_values = std::vector<double>(circuit.parameter_names.size());
+    for(int i = 0; i < parameter_values.size(); i++) {
+        parameter_values[i] = 0.4 + 0.7 * i;
+    }
+    double expectation_value;
+    std::vector<double> gradient;
+    assert(get_adjoint_gradient(circuit, parameter_values, observable, &expectation_value, &gradient) == 0);
+    assert(gradient.size() == circuit.parameter_names.size());
+
+    // Compare with the expectation value and finite differences from running the circuit
+    CompiledCircuit bound_circuit;
+    assert(circuit.bind_parameters(parameter_values, &bound_circuit) == 0);
+    QubitSystem system = QubitSystem(4);
+    assert(bound_circuit.run(system) == 0);
+    assert(std::abs(observable.get_expectation_value(system) - expectation_value) < 0.000001);
+    double step = 0.00001;
+    for(int i = 0; i < parameter_values.size(); i++) {
+        double values[2];
+        for(int j = 0; j < 2; j++) {
+            std::vector<double> shifted_values = parameter_values;
+            shifted_values[i] += j == 0 ? step : -step;
+            assert(circuit.bind_parameters(shifted_values, &bound_circuit) == 0);
+            QubitSystem shifted_system = QubitSystem(4);
+            assert(bound_circuit.run(shifted_system) == 0);
+            values[j] = observable.get_expectation_value(shifted_system);
+        }
+        assert(std::abs((values[0] - values[1]) / (2 * step) - gradient[i]) < 0.00001);
+    }
+}
+AddTest(TEST_get_adjoint_gradient);
+}
@@ -0,0 +1,343 @@
+#pragma once
+#include "N13_gradients.h"
+
+namespace qubit_circuit {
+
+/**
+ * Running variational loops(VQE/QAOA style): the energy <psi(parameters)|H|psi(parameters)> of a parameterized ansatz
+ *   circuit is minimized over the parameters, where H is a weighted sum of pauli terms
+ *
+ * Terms that commute qubit-wise(the same pauli, or I, on every qubit) are grouped. A group shares one basis rotation:
+ *   after H on its X qubits and S^-1 H on its Y qubits every term in the group is a product of Z, so the whole group
+ *   is one pass over the probabilities of the rotated state
+ *
+ * Optimizers ask for many energies at once(the two SPSA points, the candidate points of Nelder-Mead), these are
+ *   evaluated in parallel with one state per thread. The states are kept between iterations so nothing is reallocated
+*/
+
+struct PauliGroup {
+    int x_basis_mask = 0; // Qubits that are rotated to the X basis
+    int y_basis_mask = 0; // Qubits that are rotated to the Y basis
+    int used_mask = 0; // Qubits that are not I in some term
+    std::vector<PauliTerm> terms = {};
+};
+
+/**
+ * Split the terms in groups that commute qubit-wise, greedily in the order of the terms
+*/
+std::vector<PauliGroup> group_qubit_wise_commuting(const PauliObservable& observable) {
+    std::vector<PauliGroup> groups = {};
+    for(int i = 0; i < observable.terms.size(); i++) {
+        const PauliTerm& term = observable.terms[i];
+        int term_used_mask = term.x_mask | term.z_mask;
+        int term_x_basis_mask = term.x_mask & ~term.z_mask;
+        int term_y_basis_mask = term.x_mask & term.z_mask;
+        int group_num = 0;
+        for(; group_num < groups.size(); group_num++) {
+            const PauliGroup& group = groups[group_num];
+            int shared_mask = group.used_mask & term_used_mask;
+            if(((group.x_basis_mask ^ term_x_basis_mask) & shared_mask) == 0 && ((group.y_basis_mask ^ term_y_basis_mask) & shared_mask) == 0) {
+                break;
+            }
+        }
+        if(group_num == groups.size()) {
+            groups.push_back(PauliGroup());
+        }
+        PauliGroup& group = groups[group_num];
+        group.x_basis_mask |= term_x_basis_mask;
+        group.y_basis_mask |= term_y_basis_mask;
+        group.used_mask |= term_used_mask;
+        group.terms.push_back(term);
+    }
+    return groups;
+}
+
+class VariationalDriver {
+public:
+    CompiledCircuit ansatz;
+    PauliObservable observable;
+    vicmil::RandomNumberGenerator rand_gen;
+    // SPSA settings, the step is spsa_step_size / (k + 1 + iterations/10)^0.602 and the perturbation spsa_perturbation / (k + 1)^0.101
+    double spsa_step_size = 0.5;
+    double spsa_perturbation = 0.1;
+    double nelder_mead_initial_step = 0.5; // Size of the first simplex
+    // Statistics from the last minimization
+    int64_t evaluation_count = 0;
+    std::vector<double> iteration_energies = {}; // The best energy after each iteration
+    std::vector<double> iteration_times_ms = {};
+
+    VariationalDriver(const CompiledCircuit& ansatz_, const PauliObservable& observable_) {
+        ansatz = ansatz_;
+        observable = observable_;
+        _groups = group_qubit_wise_commuting(observable);
+        _qubit_count = std::max(std::max(ansatz.qubit_count, observable.get_qubit_count()), 1);
+    }
+    int get_group_count() {
+        return _groups.size();
+    }
+
+    /**
+     * Get the energy for each set of parameter values, the sets are evaluated in parallel
+     * Returns -1 if the ansatz has measurements or a set has too few values
+    */
+    int evaluate(const std::vector<std::vector<double>>& parameter_sets, std::vector<double>* energies) {
+        if(ansatz.find_invalid_instruction() != -1) {
+            return -1;
+        }
+        for(int i = 0; i < ansatz.instructions.size(); i++) {
+            if(is_measurement_op(ansatz.instructions[i].op) || ansatz.instructions[i].condition_mask != 0) {
+                return -1;
+            }
+        }
+        for(int i = 0; i < parameter_sets.size(); i++) {
+            if(parameter_sets[i].size() < ansatz.parameter_names.size()) {
+                return -1;
+            }
+        }
+        energies->assign(parameter_sets.size(), 0);
+        // A single set uses all threads inside the gate kernels instead
+        int chunk_count = vicmil::parallel_chunk_count(parameter_sets.size(), 1);
+        while(_states.size() < 2 * chunk_count) {
+            _states.push_back(QubitSystem(_qubit_count));
+        }
+        vicmil::parallel_for(0, parameter_sets.size(), [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            QubitSystem& state = _states[2 * chunk_num];
+            QubitSystem& rotated_state = _states[2 * chunk_num + 1];
+            CompiledCircuit bound_circuit;
+            for(int64_t i = chunk_begin; i < chunk_end; i++) {
+                state.reset(_qubit_count);
+                ansatz.bind_parameters(parameter_sets[i], &bound_circuit);
+                bound_circuit.run(state);
+                (*energies)[i] = _get_energy(state, rotated_state);
+            }
+        }, 1);
+        evaluation_count += parameter_sets.size();
+        return 0;
+    }
+    /**
+     * Minimize the energy with SPSA, that estimates the gradient from two energies with all parameters perturbed at once
+     *   The unperturbed parameters are evaluated in the same batch, and parameters is set to the best of them in the end
+     * Returns -1 in case of error
+    */
+    int minimize_spsa(std::vector<double>* parameters, int iteration_count) {
+        _start_minimization();
+        std::vector<double>& theta = *parameters;
+        std::vector<double> delta = std::vector<double>(theta.size());
+        std::vector<std::vector<double>> points = {theta, theta, theta};
+        std::vector<double> energies;
+        std::vector<double> best_theta = theta;
+        double best_energy = std::numeric_limits<double>::infinity();
+        for(int k = 0; k < iteration_count; k++) {
+            vicmil::Timer timer;
+            double step = spsa_step_size / std::pow(k + 1 + iteration_count / 10, 0.602);
+            double perturbation = spsa_perturbation / std::pow(k + 1, 0.101);
+            for(int i = 0; i < theta.size(); i++) {
+                delta[i] = rand_gen.rand() % 2 ? 1 : -1;
+                points[0][i] = theta[i] + perturbation * delta[i];
+                points[1][i] = theta[i] - perturbation * delta[i];
+            }
+            points[2] = theta;
+            if(evaluate(points, &energies) != 0) {
+                return -1;
+            }
+            if(energies[2] < best_energy) {
+                best_energy = energies[2];
+                best_theta = theta;
+            }
+            for(int i = 0; i < theta.size(); i++) {
+                theta[i] -= step * (energies[0] - energies[1]) / (2 * perturbation * delta[i]);
+            }
+            iteration_energies.push_back(best_energy);
+            iteration_times_ms.push_back(timer.get_time_ms());
+        }
+        theta = best_theta;
+        return 0;
+    }
+    /**
+     * Minimize the energy with Nelder-Mead, the reflected, expanded and contracted points of an iteration
+     *   are evaluated together in one batch
+     * Returns -1 in case of error
+    */
+    int minimize_nelder_mead(std::vector<double>* parameters, int iteration_count) {
+        _start_minimization();
+        int n = parameters->size();
+        std::vector<std::vector<double>> simplex = std::vector<std::vector<double>>(n + 1, *parameters);
+        for(int i = 0; i < n; i++) {
+            simplex[i + 1][i] += nelder_mead_initial_step;
+        }
+        std::vector<double> values;
+        if(evaluate(simplex, &values) != 0) {
+            return -1;
+        }
+        std::vector<double> energies;
+        for(int k = 0; k < iteration_count && n > 0; k++) {
+            vicmil::Timer timer;
+            // Sort from best to worst
+            std::vector<int> order = std::vector<int>(n + 1);
+            for(int i = 0; i <= n; i++) {
+                order[i] = i;
+            }
+            std::sort(order.begin(), order.end(), [&](int a, int b) { return values[a] < values[b]; });
+            int best = order[0];
+            int worst = order[n];
+            double second_worst_value = values[order[n - 1]];
+            std::vector<double> centroid = std::vector<double>(n, 0);
+            for(int i = 0; i < n; i++) {
+                for(int j = 0; j < n; j++) {
+                    centroid[j] += simplex[order[i]][j] / n;
+                }
+            }
+            // Reflection, expansion, outside and inside contraction
+            const double factors[4] = {1, 2, 0.5, -0.5};
+            std::vector<std::vector<double>> candidates = std::vector<std::vector<double>>(4, centroid);
+            for(int c = 0; c < 4; c++) {
+                for(int j = 0; j < n; j++) {
+                    candidates[c][j] += factors[c] * (centroid[j] - simplex[worst][j]);
+                }
+            }
+            if(evaluate(candidates, &energies) != 0) {
+                return -1;
+            }
+            int replacement = -1;
+            if(energies[0] < values[best]) {
+                replacement = energies[1] < energies[0] ? 1 : 0;
+            }
+            else if(energies[0] < second_worst_value) {
+                replacement = 0;
+            }
+            else if(energies[0] < values[worst]) {
+                replacement = energies[2] <= energies[0] ? 2 : -1;
+            }
+            else {
+                replacement = energies[3] < values[worst] ? 3 : -1;
+            }
+            if(replacement != -1) {
+                simplex[worst] = candidates[replacement];
+                values[worst] = energies[replacement];
+            }
+            else if(_shrink_simplex(simplex, values, best) != 0) {
+                return -1;
+            }
+            iteration_energies.push_back(*std::min_element(values.begin(), values.end()));
+            iteration_times_ms.push_back(timer.get_time_ms());
+        }
+        *parameters = simplex[std::min_element(values.begin(), values.end()) - values.begin()];
+        return 0;
+    }
+    std::string report_to_str() {
+        std::string return_str = "";
+        for(int i = 0; i < iteration_energies.size(); i++) {
+            return_str += "iteration " + std::to_string(i) + ": energy " + std::to_string(iteration_energies[i]) +
+                ", " + std::to_string(iteration_times_ms[i]) + " ms\n";
+        }
+        return return_str;
+    }
+
+private:
+    std::vector<PauliGroup> _groups = {};
+    int _qubit_count = 1;
+    std::vector<QubitSystem> _states = {}; // Two states per thread, the state and its rotation to the basis of a group
+
+    void _start_minimization() {
+        evaluation_count = 0;
+        iteration_energies = {};
+        iteration_times_ms = {};
+    }
+    double _get_energy(const QubitSystem& state, QubitSystem& rotated_state) {
+        double energy = 0;
+        for(int g = 0; g < _groups.size(); g++) {
+            const PauliGroup& group = _groups[g];
+            const QubitSystem* measured_state = &state;
+            if((group.x_basis_mask | group.y_basis_mask) != 0) {
+                rotated_state = state;
+                for(int i = 0; i < _qubit_count; i++) {
+                    if((group.y_basis_mask >> i) & 1) {
+                        rotated_state.phase_shift(i, -vicmil::PI / 2);
+                    }
+                    if(((group.x_basis_mask | group.y_basis_mask) >> i) & 1) {
+                        rotated_state.hadamar(i);
+                    }
+                }
+                measured_state = &rotated_state;
+            }
+            const QubitsState* states = measured_state->_qubit_states.data();
+            double norm_factor = measured_state->_norm_scale * measured_state->_norm_scale;
+            for(int j = 0; j < measured_state->_qubit_states.size(); j++) {
+                double probability = std::norm(states[j].v) * norm_factor;
+                for(int t = 0; t < group.terms.size(); t++) {
+                    bool odd = vicmil::count_bits(j & (group.terms[t].x_mask | group.terms[t].z_mask)) & 1;
+                    energy += odd ? -group.terms[t].coefficient * probability : group.terms[t].coefficient * probability;
+                }
+            }
+        }
+        return energy;
+    }
+    int _shrink_simplex(std::vector<std::vector<double>>& simplex, std::vector<double>& values, int best) {
+        std::vector<std::vector<double>> points = {};
+        std::vector<int> point_nums = {};
+        for(int i = 0; i < simplex.size(); i++) {
+            if(i == best) {
+                continue;
+            }
+            for(int j = 0; j < simplex[i].size(); j++) {
+                simplex[i][j] = simplex[best][j] + 0.5 * (simplex[i][j] - simplex[best][j]);
+            }
+            points.push_back(simplex[i]);
+            point_nums.push_back(i);
+        }
+        std::vector<double> energies;
+        if(evaluate(points, &energies) != 0) {
+            return -1;
+        }
+        for(int i = 0; i < point_nums.size(); i++) {
+            values[point_nums[i]] = energies[i];
+        }
+        return 0;
+    }
+};
+
+void TEST_VariationalDriver() {
+    // Two site transverse field Ising model, the ground state energy is -sqrt(2)
+    PauliObservable observable;
+    observable.add_term(1, "ZZ");
+    observable.add_term(0.5, "XI");
+    observable.add_term(0.5, "IX");
+    CompiledCircuit ansatz;
+    ansatz.add_ry(0, "a");
+    ansatz.add_ry(1, "b");
+    ansatz.add_cnot(0, 1);
+    ansatz.add_ry(0, "c");
+    ansatz.add_ry(1, "d");
+    VariationalDriver driver = VariationalDriver(ansatz, observable);
+    assert(driver.get_group_count() == 2); // ZZ, and XI with IX
+
+    // The grouped energies should be the same as the expectation values
+    std::vector<std::vector<double>> parameter_sets = {{0.1, 0.2, 0.3, 0.4}, {1, -2, 0.5, 3}, {0, 0, 0, 0}};
+    std::vector<double> energies;
+    assert(driver.evaluate(parameter_sets, &energies) == 0);
+    for(int i = 0; i < parameter_sets.size(); i++) {
+        CompiledCircuit bound_circuit;
+        assert(ansatz.bind_parameters(parameter_sets[i], &bound_circuit) == 0);
+        QubitSystem system = QubitSystem(2);
+        bound_circuit.run(system);
+        assert(std::abs(observable.get_expectation_value(system) - energies[i]) < 0.000001);
+    }
+
+    std::vector<double> parameters = {0.1, 0.2, 0.3, 0.4};
+    assert(driver.minimize_nelder_mead(&parameters, 300) == 0);
+    assert(driver.iteration_energies.back() < -1.41);
+    assert(driver.iteration_times_ms.size() == 300);
+
+    driver.rand_gen.set_seed(2);
+    parameters = {0.1, 0.2, 0.3, 0.4};
+    assert(driver.minimize_spsa(&parameters, 300) == 0);
+    assert(driver.evaluate({parameters}, &energies) == 0);
+    assert(energies[0] < -1.2);
+    // The best energy so far at the unperturbed parameters, the best parameters are returned
+    assert(std::abs(energies[0] - driver.iteration_energies.back()) < 0.000001);
+    for(int i = 1; i < driver.iteration_energies.size(); i++) {
+        assert(driver.iteration_energies[i] <= driver.iteration_energies[i - 1]);
+    }
+}
+AddTest(TEST_VariationalDriver);
+}
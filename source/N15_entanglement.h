@@ -0,0 +1,408 @@
+#pragma once
+#include "N14_variational.h"
+
+namespace qubit_circuit {
+
+/**
+ * Entanglement between two parts of a system, e.g. to see if a state has low enough entanglement across its cuts
+ *   to be simulated as a tensor network
+ *
+ * Seen as a 2^a x 2^b matrix M, with the qubits of one part as rows and the other part as columns, the squares of the
+ *   singular values of M(the Schmidt coefficients) are the eigenvalues of M * M^dagger, which is the reduced density matrix
+ *   of the smaller part. So instead of an SVD of the large matrix, the reduced density matrix is built in one parallel pass
+ *   (the qubits are picked out by their index offsets, the state is never reordered or copied), and then the eigenvalues
+ *   of the small hermitian matrix are found
+*/
+
+const int householder_panel_size = 32; // Reflections that are collected before they are applied to the rest of the matrix
+
+/**
+ * Get the eigenvalues of a hermitian matrix, row major with dimension rows, sorted from largest to smallest
+ *   The matrix is reduced to tridiagonal form with complex householder reflections, and then solved with implicit QL iterations.
+ *   The reflections are applied in panels: the columns of a panel are read with the updates of the panel so far added on the fly,
+ *   and the rest of the matrix gets all of them in one pass, A = A - V*W^H - W*V^H, instead of one pass per reflection
+ *   The tridiagonal matrix has complex off diagonals, their absolute values give the same eigenvalues
+ * Returns -1 if the iterations do not converge
+*/
+int get_hermitian_eigenvalues(const std::vector<std::complex<double>>& matrix, int dimension, std::vector<double>* eigenvalues) {
+    int n = dimension;
+    std::vector<std::complex<double>> a = matrix;
+    std::vector<double> diagonal = std::vector<double>(n, 0);
+    std::vector<double> off_diagonal = std::vector<double>(n, 0); // off_diagonal[i] is between i and i + 1
+    int panel_size = householder_panel_size;
+    // Reflection i of the panel is H = I - tau*v*v^H, with w = p - (tau/2 * v^H*p)*v and p = tau*A*v. Row major, v[j] is vs[j * panel_size + i]
+    std::vector<std::complex<double>> vs = std::vector<std::complex<double>>((int64_t)n * panel_size);
+    std::vector<std::complex<double>> ws = std::vector<std::complex<double>>((int64_t)n * panel_size);
+    std::vector<std::complex<double>> row = std::vector<std::complex<double>>(n);
+    std::vector<std::complex<double>> v = std::vector<std::complex<double>>(n);
+    std::vector<std::complex<double>> p = std::vector<std::complex<double>>(n);
+    std::vector<std::complex<double>> w_dot_v = std::vector<std::complex<double>>(panel_size);
+    std::vector<std::complex<double>> v_dot_v = std::vector<std::complex<double>>(panel_size);
+    for(int panel_begin = 0; panel_begin < n - 1; panel_begin += panel_size) {
+        int panel_end = std::min(n - 1, panel_begin + panel_size);
+        for(int k = panel_begin; k < panel_end; k++) {
+            int count = k - panel_begin;
+            // Row k with the reflections of the panel so far, column k is its conjugate
+            for(int j = k; j < n; j++) {
+                std::complex<double> value = a[(int64_t)k * n + j];
+                for(int i = 0; i < count; i++) {
+                    value -= multiply_complex(vs[k * panel_size + i], std::conj(ws[j * panel_size + i])) +
+                        multiply_complex(ws[k * panel_size + i], std::conj(vs[j * panel_size + i]));
+                }
+                row[j] = value;
+            }
+            diagonal[k] = row[k].real();
+            double x_norm = 0;
+            for(int j = k + 1; j < n; j++) {
+                v[j] = std::conj(row[j]);
+                x_norm += std::norm(v[j]);
+            }
+            x_norm = std::sqrt(x_norm);
+            off_diagonal[k] = x_norm;
+            for(int j = 0; j < n; j++) {
+                vs[j * panel_size + count] = 0;
+                ws[j * panel_size + count] = 0;
+            }
+            if(x_norm == 0) {
+                continue; // Already tridiagonal in this column, H = I
+            }
+            // H*x = alpha*e1, alpha has the opposite phase of x[0] so v = x - alpha*e1 does not cancel
+            std::complex<double> alpha = std::abs(v[k + 1]) > 0 ? -v[k + 1] / std::abs(v[k + 1]) * x_norm : -x_norm;
+            v[k + 1] -= alpha;
+            double v_norm = 0;
+            for(int j = k + 1; j < n; j++) {
+                v_norm += std::norm(v[j]);
+            }
+            double tau = 2 / v_norm;
+            // p = tau * (A - V*W^H - W*V^H) * v
+            for(int i = 0; i < count; i++) {
+                w_dot_v[i] = 0;
+                v_dot_v[i] = 0;
+                for(int j = k + 1; j < n; j++) {
+                    w_dot_v[i] += multiply_complex(std::conj(ws[j * panel_size + i]), v[j]);
+                    v_dot_v[i] += multiply_complex(std::conj(vs[j * panel_size + i]), v[j]);
+                }
+            }
+            vicmil::parallel_for(k + 1, n, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+                for(int64_t j = chunk_begin; j < chunk_end; j++) {
+                    const std::complex<double>* row_j = a.data() + j * n;
+                    double sum_real = 0;
+                    double sum_imag = 0;
+                    for(int l = k + 1; l < n; l++) {
+                        sum_real += row_j[l].real() * v[l].real() - row_j[l].imag() * v[l].imag();
+                        sum_imag += row_j[l].real() * v[l].imag() + row_j[l].imag() * v[l].real();
+                    }
+                    std::complex<double> sum = std::complex<double>(sum_real, sum_imag);
+                    for(int i = 0; i < count; i++) {
+                        sum -= multiply_complex(vs[j * panel_size + i], w_dot_v[i]) + multiply_complex(ws[j * panel_size + i], v_dot_v[i]);
+                    }
+                    p[j] = tau * sum;
+                }
+            }, 16);
+            double v_dot_p = 0; // Real, A is hermitian
+            for(int j = k + 1; j < n; j++) {
+                v_dot_p += multiply_complex(std::conj(v[j]), p[j]).real();
+            }
+            double half_factor = tau * v_dot_p / 2;
+            for(int j = k + 1; j < n; j++) {
+                vs[j * panel_size + count] = v[j];
+                ws[j * panel_size + count] = p[j] - half_factor * v[j];
+            }
+        }
+        // The rest of the matrix gets all reflections of the panel in one pass
+        int count = panel_end - panel_begin;
+        vicmil::parallel_for(panel_end, n, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            for(int64_t j = chunk_begin; j < chunk_end; j++) {
+                std::complex<double>* row_j = a.data() + j * n;
+                const std::complex<double>* v_j = vs.data() + j * panel_size;
+                const std::complex<double>* w_j = ws.data() + j * panel_size;
+                for(int l = panel_end; l < n; l++) {
+                    const std::complex<double>* v_l = vs.data() + (int64_t)l * panel_size;
+                    const std::complex<double>* w_l = ws.data() + (int64_t)l * panel_size;
+                    double update_real = 0;
+                    double update_imag = 0;
+                    for(int i = 0; i < count; i++) {
+                        // v_j * conj(w_l) + w_j * conj(v_l)
+                        update_real += v_j[i].real() * w_l[i].real() + v_j[i].imag() * w_l[i].imag() +
+                            w_j[i].real() * v_l[i].real() + w_j[i].imag() * v_l[i].imag();
+                        update_imag += v_j[i].imag() * w_l[i].real() - v_j[i].real() * w_l[i].imag() +
+                            w_j[i].imag() * v_l[i].real() - w_j[i].real() * v_l[i].imag();
+                    }
+                    row_j[l] -= std::complex<double>(update_real, update_imag);
+                }
+            }
+        }, 16);
+    }
+    if(n > 0) {
+        diagonal[n - 1] = a[(int64_t)(n - 1) * n + n - 1].real();
+    }
+
+    // Implicit QL with Wilkinson shifts on the tridiagonal matrix
+    for(int l = 0; l < n; l++) {
+        int iteration_count = 0;
+        int m;
+        do {
+            for(m = l; m < n - 1; m++) {
+                double size = std::abs(diagonal[m]) + std::abs(diagonal[m + 1]);
+                if(std::abs(off_diagonal[m]) <= std::numeric_limits<double>::epsilon() * size) {
+                    break;
+                }
+            }
+            if(m == l) {
+                break;
+            }
+            if(iteration_count++ == 60) {
+                return -1;
+            }
+            double g = (diagonal[l + 1] - diagonal[l]) / (2 * off_diagonal[l]);
+            double r = std::hypot(g, 1.0);
+            g = diagonal[m] - diagonal[l] + off_diagonal[l] / (g + (g >= 0 ? r : -r));
+            double s = 1;
+            double c = 1;
+            double shift = 0;
+            int i = m - 1;
+            for(; i >= l; i--) {
+                double f = s * off_diagonal[i];
+                double b = c * off_diagonal[i];
+                r = std::hypot(f, g);
+                off_diagonal[i + 1] = r;
+                if(r == 0) {
+                    // Split into two smaller problems
+                    diagonal[i + 1] -= shift;
+                    off_diagonal[m] = 0;
+                    break;
+                }
+                s = f / r;
+                c = g / r;
+                g = diagonal[i + 1] - shift;
+                r = (diagonal[i] - g) * s + 2 * c * b;
+                shift = s * r;
+                diagonal[i + 1] = g + shift;
+                g = c * r - b;
+            }
+            if(r == 0 && i >= l) {
+                continue;
+            }
+            diagonal[l] -= shift;
+            off_diagonal[l] = g;
+            off_diagonal[m] = 0;
+        } while(m != l);
+    }
+    std::sort(diagonal.begin(), diagonal.end(), std::greater<double>());
+    *eigenvalues = diagonal;
+    return 0;
+}
+
+/**
+ * Get the von Neumann entropy -sum p*log2(p) in bits, from the Schmidt coefficients p
+*/
+double get_entropy(const std::vector<double>& schmidt_coefficients) {
+    double entropy = 0;
+    for(int i = 0; i < schmidt_coefficients.size(); i++) {
+        if(schmidt_coefficients[i] > 1e-15) {
+            entropy -= schmidt_coefficients[i] * std::log2(schmidt_coefficients[i]);
+        }
+    }
+    return entropy;
+}
+
+/**
+ * Get the Schmidt coefficients(squared singular values, largest first) of the cut between the qubits and the rest of the system
+ *   The smaller part is used for the reduced density matrix
+ * Returns -1 if a qubit is repeated or out of range, or both parts have more than max_reduced_qubit_count qubits
+*/
+int get_schmidt_coefficients(QubitSystem& system, const std::vector<int>& qubits, std::vector<double>* schmidt_coefficients) {
+    // Checked here, the complement of the qubits would hide the repeated or out of range ones
+    for(int i = 0; i < qubits.size(); i++) {
+        if(qubits[i] < 0 || qubits[i] >= system._qubit_count || std::count(qubits.begin(), qubits.begin() + i, qubits[i]) != 0) {
+            return -1;
+        }
+    }
+    std::vector<int> smaller_part = qubits;
+    if(qubits.size() > system._qubit_count - qubits.size()) {
+        smaller_part = {};
+        for(int q = 0; q < system._qubit_count; q++) {
+            if(std::find(qubits.begin(), qubits.end(), q) == qubits.end()) {
+                smaller_part.push_back(q);
+            }
+        }
+    }
+    std::vector<std::complex<double>> matrix;
+    if(system.get_reduced_density_matrix(smaller_part, &matrix) != 0) {
+        return -1;
+    }
+    return get_hermitian_eigenvalues(matrix, 1 << smaller_part.size(), schmidt_coefficients);
+}
+
+/**
+ * Get the entanglement entropy in bits between the qubits and the rest of the system
+ * Returns -1 in the same cases as get_schmidt_coefficients
+*/
+int get_entanglement_entropy(QubitSystem& system, const std::vector<int>& qubits, double* entropy) {
+    std::vector<double> schmidt_coefficients;
+    if(get_schmidt_coefficients(system, qubits, &schmidt_coefficients) != 0) {
+        return -1;
+    }
+    *entropy = get_entropy(schmidt_coefficients);
+    return 0;
+}
+
+/**
+ * Trace out qubit number traced_bit of a density matrix with 2^qubit_count rows, the result has 2^(qubit_count-1) rows
+*/
+std::vector<std::complex<double>> trace_out_qubit(const std::vector<std::complex<double>>& matrix, int qubit_count, int traced_bit) {
+    int dimension = 1 << (qubit_count - 1);
+    int low_mask = (1 << traced_bit) - 1;
+    std::vector<std::complex<double>> result = std::vector<std::complex<double>>((int64_t)dimension * dimension);
+    for(int row = 0; row < dimension; row++) {
+        int full_row = ((row & ~low_mask) << 1) | (row & low_mask);
+        for(int column = 0; column < dimension; column++) {
+            int full_column = ((column & ~low_mask) << 1) | (column & low_mask);
+            int64_t position = ((int64_t)full_row << qubit_count) | full_column;
+            result[(int64_t)row * dimension + column] = matrix[position] + matrix[position + ((int64_t)(1 << traced_bit) << qubit_count) + (1 << traced_bit)];
+        }
+    }
+    return result;
+}
+
+/**
+ * Get the entanglement entropy of every contiguous cut, entropies[c - 1] is between qubits [0, c) and [c, N)
+ *   Optionally also the Schmidt rank of each cut(the coefficients above tolerance), the bond dimension a tensor network needs there
+ *   Every cut uses its smaller side. The reduced density matrices of the largest left part [0, K) and right part [N - K, N)
+ *   are built in one pass over the state each, and the smaller cuts are traced out from them one qubit at a time
+ * Cuts where both sides have more than max_reduced_qubit_count qubits get entropy -1 and Schmidt rank -1
+ * Returns -1 if the eigenvalues of a cut do not converge
+*/
+int get_entanglement_entropies(QubitSystem& system, std::vector<double>* entropies, std::vector<int>* schmidt_ranks = nullptr, double tolerance = 1e-12) {
+    int qubit_count = system._qubit_count;
+    int cut_count = std::max(qubit_count - 1, 0);
+    entropies->assign(cut_count, -1);
+    if(schmidt_ranks != nullptr) {
+        schmidt_ranks->assign(cut_count, -1);
+    }
+    // Cut c uses the left part if c <= N - c, otherwise the right part
+    int left_qubit_count = std::min(qubit_count / 2, max_reduced_qubit_count);
+    int right_qubit_count = std::min((qubit_count - 1) / 2, max_reduced_qubit_count);
+    std::vector<double> schmidt_coefficients;
+    for(int side = 0; side < 2; side++) {
+        int part_qubit_count = side == 0 ? left_qubit_count : right_qubit_count;
+        if(part_qubit_count == 0) {
+            continue;
+        }
+        std::vector<int> qubits = {};
+        for(int i = 0; i < part_qubit_count; i++) {
+            qubits.push_back(side == 0 ? i : qubit_count - part_qubit_count + i);
+        }
+        std::vector<std::complex<double>> matrix;
+        if(system.get_reduced_density_matrix(qubits, &matrix) != 0) {
+            return -1;
+        }
+        for(int size = part_qubit_count; size > 0; size--) {
+            if(size < part_qubit_count) {
+                // The left part drops its highest qubit, the right part its lowest
+                matrix = trace_out_qubit(matrix, size + 1, side == 0 ? size : 0);
+            }
+            if(get_hermitian_eigenvalues(matrix, 1 << size, &schmidt_coefficients) != 0) {
+                return -1;
+            }
+            int c = side == 0 ? size : qubit_count - size;
+            (*entropies)[c - 1] = get_entropy(schmidt_coefficients);
+            if(schmidt_ranks != nullptr) {
+                int rank = 0;
+                while(rank < schmidt_coefficients.size() && schmidt_coefficients[rank] > tolerance) {
+                    rank++;
+                }
+                (*schmidt_ranks)[c - 1] = rank;
+            }
+        }
+    }
+    return 0;
+}
+
+void TEST_get_entanglement_entropies() {
+    std::vector<double> eigenvalues;
+    // [[2, i], [-i, 2]] has eigenvalues 3 and 1
+    assert(get_hermitian_eigenvalues({2, std::complex<double>(0, 1), std::complex<double>(0, -1), 2}, 2, &eigenvalues) == 0);
+    assert(std::abs(eigenvalues[0] - 3) < 0.000001 && std::abs(eigenvalues[1] - 1) < 0.000001);
+
+    // GHZ state on qubits 0-3 and a product state on qubits 4 and 5
+    QubitSystem system = QubitSystem(6);
+    system.hadamar(0);
+    for(int i = 1; i < 4; i++) {
+        system.cnot(0, i);
+    }
+    system.hadamar(4);
+    system.rotation(1, 5, 0.3);
+    std::vector<double> entropies;
+    std::vector<int> schmidt_ranks;
+    assert(get_entanglement_entropies(system, &entropies, &schmidt_ranks) == 0);
+    assert(entropies.size() == 5);
+    for(int c = 0; c < 5; c++) {
+        assert(std::abs(entropies[c] - (c < 3 ? 1 : 0)) < 0.000001);
+        assert(schmidt_ranks[c] == (c < 3 ? 2 : 1));
+    }
+    double entropy = 0;
+    assert(get_entanglement_entropy(system, {2, 4}, &entropy) == 0 && std::abs(entropy - 1) < 0.000001);
+    assert(get_entanglement_entropy(system, {2, 2}, &entropy) == -1);
+    assert(get_entanglement_entropy(system, {0, 0, 1, 2, 3}, &entropy) == -1); // The larger part, where the complement is used
+    assert(get_entanglement_entropy(system, {0, 1, 2, 3, 9}, &entropy) == -1);
+
+    // A random state, where the Schmidt coefficients are the same from both sides and sum to 1
+    vicmil::RandomNumberGenerator rand_gen;
+    rand_gen.set_seed(8);
+    std::vector<std::complex<double>> amplitudes;
+    for(int i = 0; i < 64; i++) {
+        amplitudes.push_back(std::complex<double>(rand_gen.rand_between_0_and_1() - 0.5, rand_gen.rand_between_0_and_1() - 0.5));
+    }
+    assert(system.set_amplitudes(amplitudes) == 0);
+    std::vector<double> coefficients_a;
+    std::vector<std::complex<double>> matrix;
+    assert(system.get_reduced_density_matrix({1, 3, 5}, &matrix) == 0);
+    assert(get_hermitian_eigenvalues(matrix, 8, &coefficients_a) == 0);
+    std::vector<double> coefficients_b;
+    assert(system.get_reduced_density_matrix({0, 2, 4}, &matrix) == 0);
+    assert(get_hermitian_eigenvalues(matrix, 8, &coefficients_b) == 0);
+    double sum = 0;
+    double purity = 0;
+    assert(system.get_purity({1, 3, 5}, &purity) == 0);
+    for(int i = 0; i < 8; i++) {
+        assert(std::abs(coefficients_a[i] - coefficients_b[i]) < 0.000001);
+        assert(coefficients_a[i] > -0.000001 && (i == 0 || coefficients_a[i] <= coefficients_a[i - 1]));
+        sum += coefficients_a[i];
+        purity -= coefficients_a[i] * coefficients_a[i];
+    }
+    assert(std::abs(sum - 1) < 0.000001 && std::abs(purity) < 0.000001);
+    assert(get_entanglement_entropy(system, {1, 3, 5}, &entropy) == 0 && entropy > 0.5);
+
+    // Larger than a householder panel, both halves of a random state on 14 qubits have the same 128 coefficients
+    QubitSystem large_system = QubitSystem(14);
+    amplitudes.clear();
+    for(int i = 0; i < (1 << 14); i++) {
+        amplitudes.push_back(std::complex<double>(rand_gen.rand_between_0_and_1() - 0.5, rand_gen.rand_between_0_and_1() - 0.5));
+    }
+    assert(large_system.set_amplitudes(amplitudes) == 0);
+    assert(get_schmidt_coefficients(large_system, {0, 1, 2, 3, 4, 5, 6}, &coefficients_a) == 0);
+    assert(large_system.get_reduced_density_matrix({7, 8, 9, 10, 11, 12, 13}, &matrix) == 0);
+    assert(get_hermitian_eigenvalues(matrix, 128, &coefficients_b) == 0);
+    double trace_of_square = 0;
+    for(int i = 0; i < matrix.size(); i++) {
+        trace_of_square += std::norm(matrix[i]);
+    }
+    sum = 0;
+    for(int i = 0; i < 128; i++) {
+        assert(std::abs(coefficients_a[i] - coefficients_b[i]) < 0.000001);
+        sum += coefficients_b[i];
+        trace_of_square -= coefficients_b[i] * coefficients_b[i];
+    }
+    assert(std::abs(sum - 1) < 0.000001 && std::abs(trace_of_square) < 0.000001);
+    // The cuts traced out from the two shared passes are the same as each cut on its own
+    assert(get_entanglement_entropies(large_system, &entropies) == 0);
+    std::vector<int> left_qubits = {};
+    for(int c = 1; c < 14; c++) {
+        left_qubits.push_back(c - 1);
+        assert(get_entanglement_entropy(large_system, left_qubits, &entropy) == 0);
+        assert(std::abs(entropies[c - 1] - entropy) < 0.000001);
+    }
+}
+AddTest(TEST_get_entanglement_entropies);
+}
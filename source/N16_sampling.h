@@ -0,0 +1,295 @@
+#pragma once
+#include "N15_entanglement.h"
+
+namespace qubit_circuit {
+
+/**
+ * Sampling many shots from a fixed final state
+ *
+ * A Walker alias table turns sampling into O(1) per shot: every state index i has a threshold and an alias,
+ *   a uniform index is picked and kept with probability threshold[i], otherwise its alias is taken. Building one table
+ *   is a serial pass, so the states are split in chunks that each get their own table, built in parallel, and a small
+ *   top table picks the chunk by its total probability
+ *
+ * Shots are generated in parallel with one random stream per thread, written as qubit_count bits each into a packed
+ *   buffer, and counted in per thread open addressing hash tables that are merged in the end
+*/
+
+const int alias_chunk_qubit_count = 16; // Each chunk table covers 2^16 states
+
+/**
+ * Counts of measured states, in an open addressing hash table with linear probing
+*/
+class ShotHistogram {
+public:
+    void add(uint32_t state, uint64_t count = 1) {
+        if(2 * (_size + 1) > _keys.size()) {
+            _grow();
+        }
+        uint64_t slot = _find_slot(state);
+        if(_keys[slot] == _empty_key) {
+            _keys[slot] = state;
+            _size++;
+        }
+        _counts[slot] += count;
+    }
+    uint64_t get_count(uint32_t state) const {
+        if(_keys.size() == 0) {
+            return 0;
+        }
+        uint64_t slot = _find_slot(state);
+        return _keys[slot] == state ? _counts[slot] : 0;
+    }
+    // The number of different states
+    int64_t size() const {
+        return _size;
+    }
+    void add_all(const ShotHistogram& other) {
+        for(int64_t i = 0; i < other._keys.size(); i++) {
+            if(other._keys[i] != _empty_key) {
+                add(other._keys[i], other._counts[i]);
+            }
+        }
+    }
+    std::map<int, uint64_t> to_map() const {
+        std::map<int, uint64_t> counts;
+        for(int64_t i = 0; i < _keys.size(); i++) {
+            if(_keys[i] != _empty_key) {
+                counts[_keys[i]] = _counts[i];
+            }
+        }
+        return counts;
+    }
+    void clear() {
+        _keys.clear();
+        _counts.clear();
+        _size = 0;
+    }
+
+private:
+    static constexpr uint32_t _empty_key = 0xFFFFFFFF; // States have less than 32 qubits, so this is never a state
+    std::vector<uint32_t> _keys = {};
+    std::vector<uint64_t> _counts = {};
+    int64_t _size = 0;
+
+    uint64_t _find_slot(uint32_t state) const {
+        uint64_t mask = _keys.size() - 1;
+        uint64_t slot = (state * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+        while(_keys[slot] != _empty_key && _keys[slot] != state) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+    void _grow() {
+        std::vector<uint32_t> old_keys = std::move(_keys);
+        std::vector<uint64_t> old_counts = std::move(_counts);
+        _keys.assign(std::max((size_t)64, 2 * old_keys.size()), _empty_key);
+        _counts.assign(_keys.size(), 0);
+        for(int64_t i = 0; i < old_keys.size(); i++) {
+            if(old_keys[i] != _empty_key) {
+                uint64_t slot = _find_slot(old_keys[i]);
+                _keys[slot] = old_keys[i];
+                _counts[slot] = old_counts[i];
+            }
+        }
+    }
+};
+
+class AliasSampler {
+public:
+    // Each call uses new streams, thread t the stream seed + t + (thread count times the calls before), so the shots
+    //   only repeat for the same seed, thread count and number of calls before
+    uint64_t seed = 1;
+
+    /**
+     * Build the tables from the probabilities of the states of the system
+    */
+    AliasSampler(const QubitSystem& system) {
+        _qubit_count = system._qubit_count;
+        int64_t state_count = system._qubit_states.size();
+        _chunk_qubit_count = std::min(_qubit_count, alias_chunk_qubit_count);
+        int64_t chunk_size = (int64_t)1 << _chunk_qubit_count;
+        int64_t chunk_count = state_count / chunk_size;
+        _thresholds.resize(state_count);
+        _aliases.resize(state_count);
+        std::vector<double> chunk_weights = std::vector<double>(chunk_count);
+        const QubitsState* states = system._qubit_states.data();
+        vicmil::parallel_for(0, chunk_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            std::vector<double> weights = std::vector<double>(chunk_size);
+            for(int64_t c = chunk_begin; c < chunk_end; c++) {
+                for(int64_t i = 0; i < chunk_size; i++) {
+                    weights[i] = std::norm(states[c * chunk_size + i].v);
+                }
+                chunk_weights[c] = _build_table(weights, c * chunk_size, _thresholds.data() + c * chunk_size, _aliases.data() + c * chunk_size);
+            }
+        }, 1);
+        _chunk_thresholds.resize(chunk_count);
+        _chunk_aliases.resize(chunk_count);
+        _build_table(chunk_weights, 0, _chunk_thresholds.data(), _chunk_aliases.data());
+    }
+
+    /**
+     * Get one sampled state index
+    */
+    uint32_t sample(vicmil::FastRandomNumberGenerator& rand_gen) const {
+        if(_qubit_count == 0) {
+            return 0;
+        }
+        uint64_t r = rand_gen.rand();
+        uint32_t index = r >> (64 - _qubit_count);
+        uint32_t chunk_num = index >> _chunk_qubit_count;
+        if((r & 0xFFFFFFFF) * (1.0 / 4294967296.0) >= _chunk_thresholds[chunk_num]) {
+            chunk_num = _chunk_aliases[chunk_num];
+        }
+        index = (chunk_num << _chunk_qubit_count) | (index & ((1 << _chunk_qubit_count) - 1));
+        return rand_gen.rand_between_0_and_1() < _thresholds[index] ? index : _aliases[index];
+    }
+    /**
+     * Sample shot_count shots in parallel. If packed_shots is set, shot s is written to bits [s*N, (s+1)*N) of it,
+     *   see get_packed_shot. If histogram is set, it is set to the number of times each state was sampled
+     *   Not safe to call from several threads at once, each call moves on to new random streams
+    */
+    void sample(int64_t shot_count, std::vector<uint64_t>* packed_shots, ShotHistogram* histogram) const {
+        if(packed_shots != nullptr) {
+            packed_shots->assign((shot_count * _qubit_count + 63) / 64, 0);
+        }
+        int thread_count = vicmil::get_thread_pool().get_thread_count();
+        std::vector<ShotHistogram> histograms = std::vector<ShotHistogram>(histogram != nullptr ? thread_count : 0);
+        // Blocks of 64 shots start at a word boundary, so no two threads write to the same word
+        int64_t block_count = (shot_count + 63) / 64;
+        vicmil::parallel_for(0, block_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            vicmil::FastRandomNumberGenerator rand_gen = vicmil::FastRandomNumberGenerator(seed + _used_stream_count + chunk_num);
+            uint64_t* words = packed_shots != nullptr ? packed_shots->data() : nullptr;
+            ShotHistogram* thread_histogram = histogram != nullptr ? &histograms[chunk_num] : nullptr;
+            int64_t shot_end = std::min(shot_count, chunk_end * 64);
+            for(int64_t shot = chunk_begin * 64; shot < shot_end; shot++) {
+                uint32_t state = sample(rand_gen);
+                if(words != nullptr) {
+                    int64_t bit_num = shot * _qubit_count;
+                    words[bit_num / 64] |= (uint64_t)state << (bit_num % 64);
+                    if(bit_num % 64 + _qubit_count > 64) {
+                        words[bit_num / 64 + 1] |= (uint64_t)state >> (64 - bit_num % 64);
+                    }
+                }
+                if(thread_histogram != nullptr) {
+                    thread_histogram->add(state);
+                }
+            }
+        }, 256);
+        _used_stream_count += thread_count;
+        if(histogram != nullptr) {
+            histogram->clear();
+            for(int t = 0; t < histograms.size(); t++) {
+                histogram->add_all(histograms[t]);
+            }
+        }
+    }
+    /**
+     * Get shot number shot_num from a packed buffer of shots with qubit_count bits each
+    */
+    static uint32_t get_packed_shot(const std::vector<uint64_t>& packed_shots, int qubit_count, int64_t shot_num) {
+        int64_t bit_num = shot_num * qubit_count;
+        uint64_t value = packed_shots[bit_num / 64] >> (bit_num % 64);
+        if(bit_num % 64 + qubit_count > 64) {
+            value |= packed_shots[bit_num / 64 + 1] << (64 - bit_num % 64);
+        }
+        return value & ((1ULL << qubit_count) - 1);
+    }
+
+private:
+    int _qubit_count = 0;
+    int _chunk_qubit_count = 0;
+    mutable uint64_t _used_stream_count = 0; // Streams after seed that earlier calls have used
+    std::vector<double> _thresholds = {};
+    std::vector<uint32_t> _aliases = {}; // Global state indices
+    std::vector<double> _chunk_thresholds = {};
+    std::vector<uint32_t> _chunk_aliases = {};
+
+    /**
+     * Build an alias table for the weights with Vose's method, and return the total weight
+     *   The aliases are first_index + the index in weights
+    */
+    static double _build_table(const std::vector<double>& weights, uint32_t first_index, double* thresholds, uint32_t* aliases) {
+        int64_t size = weights.size();
+        double total_weight = 0;
+        for(int64_t i = 0; i < size; i++) {
+            total_weight += weights[i];
+        }
+        std::vector<double> scaled_weights = std::vector<double>(size);
+        std::vector<uint32_t> small = {};
+        std::vector<uint32_t> large = {};
+        for(int64_t i = 0; i < size; i++) {
+            thresholds[i] = 1;
+            aliases[i] = first_index + i;
+            scaled_weights[i] = total_weight > 0 ? weights[i] * size / total_weight : 1;
+            (scaled_weights[i] < 1 ? small : large).push_back(i);
+        }
+        while(small.size() > 0 && large.size() > 0) {
+            uint32_t small_index = small.back();
+            small.pop_back();
+            uint32_t large_index = large.back();
+            thresholds[small_index] = scaled_weights[small_index];
+            aliases[small_index] = first_index + large_index;
+            scaled_weights[large_index] -= 1 - scaled_weights[small_index];
+            if(scaled_weights[large_index] < 1) {
+                large.pop_back();
+                small.push_back(large_index);
+            }
+        }
+        // What is left is 1 up to rounding errors, and keeps threshold 1
+        return total_weight;
+    }
+};
+
+void TEST_AliasSampler() {
+    // Every state of a small system, against its probability
+    QubitSystem system = QubitSystem(4);
+    std::vector<std::complex<double>> amplitudes;
+    for(int i = 0; i < 16; i++) {
+        amplitudes.push_back(std::complex<double>(i % 5, i % 3 == 0 ? 1 : 0));
+    }
+    assert(system.set_amplitudes(amplitudes) == 0);
+    AliasSampler sampler = AliasSampler(system);
+    int64_t shot_count = 1000000;
+    std::vector<uint64_t> packed_shots;
+    ShotHistogram histogram;
+    sampler.sample(shot_count, &packed_shots, &histogram);
+    // Another call gives other shots
+    std::vector<uint64_t> next_packed_shots;
+    sampler.sample(shot_count, &next_packed_shots, nullptr);
+    assert(next_packed_shots != packed_shots);
+    for(int i = 0; i < 16; i++) {
+        double probability = std::norm(system._qubit_states[i].v);
+        assert(std::abs((double)histogram.get_count(i) / shot_count - probability) < 0.003);
+        assert(probability > 0 || histogram.get_count(i) == 0);
+    }
+    // The packed shots are the same shots as in the histogram
+    ShotHistogram unpacked_histogram;
+    for(int64_t shot = 0; shot < shot_count; shot++) {
+        unpacked_histogram.add(AliasSampler::get_packed_shot(packed_shots, 4, shot));
+    }
+    assert(unpacked_histogram.to_map() == histogram.to_map());
+
+    // More states than one chunk, and a qubit count that makes shots cross word boundaries
+    QubitSystem large_system = QubitSystem(19);
+    std::vector<std::complex<double>> qubit_amplitudes;
+    for(int i = 0; i < 19; i++) {
+        qubit_amplitudes.push_back(std::sqrt(1 - 0.05 * i));
+        qubit_amplitudes.push_back(std::sqrt(0.05 * i));
+    }
+    assert(large_system.set_product_state(qubit_amplitudes) == 0);
+    AliasSampler large_sampler = AliasSampler(large_system);
+    large_sampler.sample(shot_count, &packed_shots, nullptr);
+    std::vector<int64_t> one_counts = std::vector<int64_t>(19, 0);
+    for(int64_t shot = 0; shot < shot_count; shot++) {
+        uint32_t state = AliasSampler::get_packed_shot(packed_shots, 19, shot);
+        for(int i = 0; i < 19; i++) {
+            one_counts[i] += (state >> i) & 1;
+        }
+    }
+    for(int i = 0; i < 19; i++) {
+        assert(std::abs((double)one_counts[i] / shot_count - 0.05 * i) < 0.003);
+    }
+}
+AddTest(TEST_AliasSampler);
+}
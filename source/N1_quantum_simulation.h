@@ -4,6 +4,7 @@
 #else
 #include "../vicmil_lib/N3_vicmil_opengl/vicmil_opengl.h"
 #endif
+#include <memory>
 
 
 class QubitsState {
@@ -37,6 +38,191 @@ public:
 };
 
 
+/**
+ * A set of gates that act on different qubits, so they can all be applied in one pass over the state
+*/
+struct GateLayer {
+    std::vector<int> hadamar_qubits = {};
+    std::vector<int> phase_masks = {}; // Phase gates, the phase is applied when all qubits in the mask are 1
+    std::vector<double> phases = {}; // The phase shift of each of the phase_masks
+    std::vector<int> x_control_masks = {}; // Controlled x gates(cnot, toffoli...), the controls of each gate
+    std::vector<int> x_targets = {}; // x_targets[i] is the target of x_control_masks[i]
+    int used_qubits_mask = 0;
+
+    bool qubit_used(int qubit_num) const {
+        return (used_qubits_mask >> qubit_num) & 1;
+    }
+    bool qubits_used(int qubit_mask) const {
+        return (used_qubits_mask & qubit_mask) != 0;
+    }
+    int get_gate_count() const {
+        return hadamar_qubits.size() + phase_masks.size() + x_targets.size();
+    }
+    void add_hadamar(int qubit_num) {
+        hadamar_qubits.push_back(qubit_num);
+        used_qubits_mask |= 1 << qubit_num;
+    }
+    void add_phase_shift(int qubit_num, double phase) {
+        add_multi_controlled_phase_shift(0, qubit_num, phase);
+    }
+    void add_multi_controlled_phase_shift(int control_mask, int target_qubit_num, double phase) {
+        phase_masks.push_back(control_mask | (1 << target_qubit_num));
+        phases.push_back(phase);
+        used_qubits_mask |= phase_masks.back();
+    }
+    void add_cnot(int control_qubit_num, int target_qubit_num) {
+        add_multi_controlled_x(1 << control_qubit_num, target_qubit_num);
+    }
+    void add_multi_controlled_x(int control_mask, int target_qubit_num) {
+        x_control_masks.push_back(control_mask);
+        x_targets.push_back(target_qubit_num);
+        used_qubits_mask |= control_mask | (1 << target_qubit_num);
+    }
+    void clear() {
+        hadamar_qubits.clear();
+        phase_masks.clear();
+        phases.clear();
+        x_control_masks.clear();
+        x_targets.clear();
+        used_qubits_mask = 0;
+    }
+};
+
+// Max number of hadamar gates and phase gates handled in the combined pass, the rest get their own pass
+const int max_layer_hadamar_count = 5;
+const int max_layer_phase_count = 10;
+
+// Zero filled in parallel by the threads that later work on each part, and not zero filled again by resize
+namespace vicmil {
+template<>
+struct is_zero_initializable<QubitsState> : std::true_type {};
+}
+typedef std::vector<QubitsState, vicmil::ParallelAllocator<QubitsState>> StateBuffer;
+
+/**
+ * Keeps the state buffers of QubitSystems that are no longer used, bucketed by qubit count,
+ *   so repeated simulations of the same width reuse the memory instead of allocating and page faulting it again
+*/
+class StateBufferPool {
+    std::mutex _mutex;
+    std::vector<std::vector<StateBuffer>> _free_buffers = {}; // _free_buffers[qubit_count]
+public:
+    int max_buffers_per_size = 4; // Limits the memory that is kept around
+
+    static void zero_fill(StateBuffer& buffer) {
+        QubitsState* states = buffer.data();
+        vicmil::parallel_for(0, buffer.size(), [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            std::memset((void*)(states + chunk_begin), 0, (chunk_end - chunk_begin) * sizeof(QubitsState));
+        });
+    }
+    /**
+     * Get a buffer of 2^qubit_count states, all states are 0 if zero_fill is set
+    */
+    StateBuffer take(int qubit_count, bool zero_fill_ = true) {
+        StateBuffer buffer;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if(qubit_count < _free_buffers.size() && _free_buffers[qubit_count].size() > 0) {
+                buffer = std::move(_free_buffers[qubit_count].back());
+                _free_buffers[qubit_count].pop_back();
+            }
+        }
+        if(buffer.size() == 0) {
+            // A new allocation, already zero filled in parallel, only empty buffers are resized so there are no old values
+            buffer.resize((int64_t)1 << qubit_count);
+        }
+        else if(zero_fill_) {
+            zero_fill(buffer);
+        }
+        return buffer;
+    }
+    /**
+     * Keep the buffer for later, if there is room for it in its bucket
+    */
+    void give_back(StateBuffer&& buffer) {
+        if(buffer.size() == 0) {
+            return;
+        }
+        int qubit_count = 0;
+        while(((size_t)1 << qubit_count) < buffer.size()) {
+            qubit_count++;
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        if(qubit_count >= _free_buffers.size()) {
+            _free_buffers.resize(qubit_count + 1);
+        }
+        if(_free_buffers[qubit_count].size() < max_buffers_per_size) {
+            _free_buffers[qubit_count].push_back(std::move(buffer));
+        }
+    }
+    int get_free_buffer_count(int qubit_count) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return qubit_count < _free_buffers.size() ? _free_buffers[qubit_count].size() : 0;
+    }
+};
+
+inline StateBufferPool& get_state_buffer_pool() {
+    // Never deleted, QubitSystems in static variables may be destroyed after it
+    static StateBufferPool* state_buffer_pool = new StateBufferPool();
+    return *state_buffer_pool;
+}
+
+const int fft_block_qubit_count = 14; // The fourier transform finishes blocks of 2^14 amplitudes(256 KB) in the cache
+const int max_reduced_qubit_count = 10; // Each thread sums its own reduced density matrix, 16 MB for 10 qubits
+const double max_norm_scale = 1e16; // Above this the norm scale is multiplied into the amplitudes, before they get small enough to lose precision
+
+// The state of one qubit as a point in the unit ball, rho = (I + x*X + y*Y + z*Z) / 2
+struct BlochVector {
+    double x = 0;
+    double y = 0;
+    double z = 0;
+};
+
+// Written out by hand, std::complex multiplication has extra checks for infinities that make it much slower
+inline std::complex<double> multiply_complex(std::complex<double> a, std::complex<double> b) {
+    return std::complex<double>(a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real());
+}
+
+/**
+ * The factors e^(sign * pi*i * j/span) of an FFT of 2^qubit_count values. The spans within a cache block have a table per span,
+ *   the larger ones are the product of two small tables, instead of a table as large as the state
+*/
+class FourierTwiddles {
+public:
+    FourierTwiddles(int qubit_count, int sign) {
+        _transform_size = 1 << qubit_count;
+        _span_table = std::vector<std::complex<double>>(std::min(_transform_size, 1 << fft_block_qubit_count));
+        for(int span = 1; span < _span_table.size(); span *= 2) {
+            for(int j = 0; j < span; j++) {
+                _span_table[span + j] = std::polar(1.0, sign * vicmil::PI * j / span);
+            }
+        }
+        _fine_bit_count = qubit_count / 2;
+        _fine_table = std::vector<std::complex<double>>(1 << _fine_bit_count);
+        _coarse_table = std::vector<std::complex<double>>(_transform_size >> _fine_bit_count);
+        for(int k = 0; k < _fine_table.size(); k++) {
+            _fine_table[k] = std::polar(1.0, sign * 2 * vicmil::PI * k / _transform_size);
+        }
+        for(int k = 0; k < _coarse_table.size(); k++) {
+            _coarse_table[k] = std::polar(1.0, sign * 2 * vicmil::PI * ((int64_t)k << _fine_bit_count) / _transform_size);
+        }
+    }
+    std::complex<double> get(int span, int j) const {
+        if(span < _span_table.size()) {
+            return _span_table[span + j];
+        }
+        int k = j * (_transform_size / (2 * span));
+        return multiply_complex(_coarse_table[k >> _fine_bit_count], _fine_table[k & (_fine_table.size() - 1)]);
+    }
+
+private:
+    int _transform_size;
+    std::vector<std::complex<double>> _span_table; // [span + j]
+    int _fine_bit_count;
+    std::vector<std::complex<double>> _coarse_table; // e^(sign * 2*pi*i * k/2^qubit_count) = coarse[k >> fine_bit_count] * fine[k & fine_mask]
+    std::vector<std::complex<double>> _fine_table;
+};
+
 class QubitSystem {
     /*
         Each state index represents the prob and phase of each state
@@ -52,15 +238,194 @@ class QubitSystem {
     */
     public:
     int _qubit_count;
-    std::vector<QubitsState> _qubit_states = std::vector<QubitsState>();
-    vicmil::RandomNumberGenerator _rand_gen;
+    StateBuffer _qubit_states = {}; // From the state buffer pool, given back when the system is destroyed
+    // The state is _norm_scale * _qubit_states. Measurements only zero the other states and change the scale,
+    //   instead of also scaling up every amplitude that is kept. Read amplitudes with get_amplitude
+    double _norm_scale = 1;
+    // Behind a pointer so moving a system does not copy the 5 KB state of the generator
+    std::unique_ptr<vicmil::RandomNumberGenerator> _rand_gen = std::make_unique<vicmil::RandomNumberGenerator>();
+    int _classical_bits = 0; // Results of measurements in a circuit, bit i is classical bit i
 
     QubitSystem(int qubit_count) {
         _qubit_count = qubit_count;
         Assert(qubit_count < 24); // The system memory scales with 2^N, so 24 are many megabytes!
-        _qubit_states.resize(std::pow(2, qubit_count));
+        _qubit_states = get_state_buffer_pool().take(qubit_count);
         _qubit_states[0] = QubitsState::from_prob_and_phase(1, 0);
-        _rand_gen = vicmil::RandomNumberGenerator();
+    }
+    QubitSystem(const QubitSystem& other) : _qubit_count(other._qubit_count), _norm_scale(other._norm_scale), _classical_bits(other._classical_bits) {
+        _seed_from(other);
+        _qubit_states = get_state_buffer_pool().take(_qubit_count, false);
+        std::copy(other._qubit_states.begin(), other._qubit_states.end(), _qubit_states.begin());
+    }
+    QubitSystem(QubitSystem&& other) : _qubit_count(other._qubit_count), _qubit_states(std::move(other._qubit_states)),
+        _norm_scale(other._norm_scale), _rand_gen(std::move(other._rand_gen)), _classical_bits(other._classical_bits) {}
+    QubitSystem& operator=(const QubitSystem& other) {
+        if(this != &other) {
+            if(_qubit_states.size() != other._qubit_states.size()) {
+                get_state_buffer_pool().give_back(std::move(_qubit_states));
+                _qubit_states = get_state_buffer_pool().take(other._qubit_count, false);
+            }
+            std::copy(other._qubit_states.begin(), other._qubit_states.end(), _qubit_states.begin());
+            _qubit_count = other._qubit_count;
+            _norm_scale = other._norm_scale;
+            _seed_from(other);
+            _classical_bits = other._classical_bits;
+        }
+        return *this;
+    }
+    QubitSystem& operator=(QubitSystem&& other) {
+        if(this != &other) {
+            get_state_buffer_pool().give_back(std::move(_qubit_states));
+            _qubit_states = std::move(other._qubit_states);
+            _qubit_count = other._qubit_count;
+            _norm_scale = other._norm_scale;
+            _classical_bits = other._classical_bits;
+            std::swap(_rand_gen, other._rand_gen); // Both keep a generator, also if this one was moved from
+        }
+        return *this;
+    }
+    ~QubitSystem() {
+        get_state_buffer_pool().give_back(std::move(_qubit_states));
+    }
+    // A copy gets its own stream, seeded from the next number of the original, so the two do not measure the same outcomes
+    void _seed_from(const QubitSystem& other) {
+        if(_rand_gen == nullptr) {
+            _rand_gen = std::make_unique<vicmil::RandomNumberGenerator>();
+        }
+        _rand_gen->set_seed(other._rand_gen->rand());
+    }
+
+    /**
+     * Set the system to |0> with the specified number of qubits, in place
+     *   The state memory is reused if the qubit count is the same, and the random generator is not reseeded
+    */
+    void reset(int qubit_count) {
+        Assert(qubit_count < 24);
+        if(qubit_count != _qubit_count || _qubit_states.size() == 0) {
+            get_state_buffer_pool().give_back(std::move(_qubit_states));
+            _qubit_states = get_state_buffer_pool().take(qubit_count);
+            _qubit_count = qubit_count;
+        }
+        else {
+            StateBufferPool::zero_fill(_qubit_states);
+        }
+        _qubit_states[0] = QubitsState::from_prob_and_phase(1, 0);
+        _norm_scale = 1;
+        _classical_bits = 0;
+    }
+    // Get the amplitude of the state, with the norm scale
+    std::complex<double> get_amplitude(int64_t state_index) const {
+        return _qubit_states[state_index].v * _norm_scale;
+    }
+    /**
+     * Multiply the norm scale into the amplitudes, so _qubit_states is the state itself
+    */
+    void apply_norm_scale() {
+        if(_norm_scale == 1) {
+            return;
+        }
+        _multiply_subspace(0, 0, _norm_scale);
+        _norm_scale = 1;
+    }
+    void _set_norm_scale(double norm_scale) {
+        _norm_scale = norm_scale;
+        if(_norm_scale > max_norm_scale || _norm_scale < 1 / max_norm_scale) {
+            apply_norm_scale();
+        }
+    }
+
+    /**
+     * Set the system to the basis state |state_index>
+    */
+    void set_basis_state(int64_t state_index) {
+        Assert(state_index >= 0 && state_index < _qubit_states.size());
+        StateBufferPool::zero_fill(_qubit_states);
+        _qubit_states[state_index].v = 1;
+        _norm_scale = 1;
+        _classical_bits = 0;
+    }
+    /**
+     * Set the system to a product state, qubit i is qubit_amplitudes[2*i]|0> + qubit_amplitudes[2*i + 1]|1>
+     *   Each qubit is normalized. Returns -1 if there are not two amplitudes per qubit, or a qubit has only zeros
+    */
+    int set_product_state(const std::vector<std::complex<double>>& qubit_amplitudes) {
+        if(qubit_amplitudes.size() != 2 * _qubit_count) {
+            return -1;
+        }
+        std::vector<std::complex<double>> amplitudes = qubit_amplitudes;
+        for(int i = 0; i < _qubit_count; i++) {
+            double norm = std::sqrt(std::norm(amplitudes[2 * i]) + std::norm(amplitudes[2 * i + 1]));
+            if(norm == 0) {
+                return -1;
+            }
+            amplitudes[2 * i] /= norm;
+            amplitudes[2 * i + 1] /= norm;
+        }
+        // The low qubits are expanded once into a table, each run of the table size is then the table times the factor of the high qubits
+        int low_qubit_count = std::min(_qubit_count, 12);
+        std::vector<std::complex<double>> low_states = std::vector<std::complex<double>>((int64_t)1 << low_qubit_count);
+        low_states[0] = 1;
+        for(int i = 0; i < low_qubit_count; i++) {
+            int64_t size = (int64_t)1 << i;
+            for(int64_t j = 0; j < size; j++) {
+                low_states[j + size] = multiply_complex(low_states[j], amplitudes[2 * i + 1]);
+                low_states[j] = multiply_complex(low_states[j], amplitudes[2 * i]);
+            }
+        }
+        QubitsState* states = _qubit_states.data();
+        int64_t run_length = low_states.size();
+        vicmil::parallel_for(0, _qubit_states.size() / run_length, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            for(int64_t run_num = chunk_begin; run_num < chunk_end; run_num++) {
+                std::complex<double> factor = 1;
+                for(int i = low_qubit_count; i < _qubit_count; i++) {
+                    factor = multiply_complex(factor, amplitudes[2 * i + ((run_num >> (i - low_qubit_count)) & 1)]);
+                }
+                QubitsState* run_states = states + run_num * run_length;
+                for(int64_t j = 0; j < run_length; j++) {
+                    run_states[j].v = multiply_complex(factor, low_states[j]);
+                }
+            }
+        }, std::max((int64_t)1, vicmil::default_parallel_min_chunk_size / run_length));
+        _norm_scale = 1;
+        _classical_bits = 0;
+        return 0;
+    }
+    /**
+     * Set the state to the amplitudes, scaled so the total probability is 1
+     * Returns -1 if there are not 2^N amplitudes, or all of them are zero
+    */
+    int set_amplitudes(const std::complex<double>* amplitudes, int64_t amplitude_count) {
+        if(amplitude_count != _qubit_states.size()) {
+            return -1;
+        }
+        std::vector<double> partial_sums = std::vector<double>(vicmil::get_thread_pool().get_thread_count(), 0);
+        vicmil::parallel_for(0, amplitude_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            double sum = 0;
+            for(int64_t i = chunk_begin; i < chunk_end; i++) {
+                sum += std::norm(amplitudes[i]);
+            }
+            partial_sums[chunk_num] = sum;
+        });
+        double total_probability = 0;
+        for(int i = 0; i < partial_sums.size(); i++) {
+            total_probability += partial_sums[i];
+        }
+        if(total_probability == 0) {
+            return -1;
+        }
+        double scale = 1.0 / std::sqrt(total_probability);
+        QubitsState* states = _qubit_states.data();
+        vicmil::parallel_for(0, amplitude_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            for(int64_t i = chunk_begin; i < chunk_end; i++) {
+                states[i].v = amplitudes[i] * scale;
+            }
+        });
+        _norm_scale = 1;
+        _classical_bits = 0;
+        return 0;
+    }
+    int set_amplitudes(const std::vector<std::complex<double>>& amplitudes) {
+        return set_amplitudes(amplitudes.data(), amplitudes.size());
     }
 
     int get_qubit_mask(int qubit_index) {
@@ -73,38 +438,297 @@ class QubitSystem {
         return mask & state_index;
     }
 
-    bool measure(int qubit_num) {
-        double r = _rand_gen.rand_between_0_and_1(); // Pick where in the probability distr we can find our value
+    /**
+     * Get the probability that the qubit is measured as 1
+    */
+    double get_qubit_probability(int qubit_num) {
+        int mask = get_qubit_mask(qubit_num);
+        double prob_0 = _get_subspace_probability(mask, 0);
+        double prob_1 = _get_subspace_probability(mask, mask);
+        return prob_1 / (prob_0 + prob_1);
+    }
 
-        double sum = 0;
-        bool qubit_val = false;
-        for (int n=0; n<_qubit_states.size(); n++) {
-            sum += _qubit_states[n].get_prob(); // cumulative probability
-            if (sum >= r) {
-                // We have found our value
-                qubit_val = is_qubit_enabled_in_state(n, qubit_num);
-                break;
+    /**
+     * Get the density matrix of the qubits with the other qubits traced out, row major with 2^k rows and bit i of the row being qubits[i]
+     *   The state is read once, each thread sums |v><v| over its part of the other qubits' states where v are the 2^k amplitudes
+     *   with those qubits fixed, and the per thread matrices are added in the end
+     * Returns -1 if a qubit is repeated or out of range, or there are more than max_reduced_qubit_count qubits
+    */
+    int get_reduced_density_matrix(const std::vector<int>& qubits, std::vector<std::complex<double>>* matrix) {
+        int kept_mask = 0;
+        for(int i = 0; i < qubits.size(); i++) {
+            if(qubits[i] < 0 || qubits[i] >= _qubit_count || ((kept_mask >> qubits[i]) & 1)) {
+                return -1;
             }
+            kept_mask |= get_qubit_mask(qubits[i]);
         }
-
-        // Now we must collapse our vector to that value
-        for (int n=0; n<_qubit_states.size(); n++) {
-            // See if the value is the measured value
-            if (qubit_val != is_qubit_enabled_in_state(n, qubit_num)) {
-                _qubit_states[n] = QubitsState::from_prob_and_phase(0, 0); // Collapse the other values to 0
+        if(qubits.size() > max_reduced_qubit_count) {
+            return -1;
+        }
+        int dimension = 1 << qubits.size();
+        std::vector<int> offsets = std::vector<int>(dimension, 0); // The state index offset of each row
+        for(int row = 0; row < dimension; row++) {
+            for(int i = 0; i < qubits.size(); i++) {
+                if((row >> i) & 1) {
+                    offsets[row] |= get_qubit_mask(qubits[i]);
+                }
+            }
+        }
+        int thread_count = vicmil::get_thread_pool().get_thread_count();
+        std::vector<std::vector<std::complex<double>>> partial_matrices = std::vector<std::vector<std::complex<double>>>(thread_count);
+        std::vector<std::vector<std::complex<double>>> amplitudes = std::vector<std::vector<std::complex<double>>>(thread_count);
+        const QubitsState* states = _qubit_states.data();
+        _for_each_subspace_run(kept_mask, 0, [&](int first_state_index, int run_length, int stride, int chunk_num) {
+            std::vector<std::complex<double>>& partial_matrix = partial_matrices[chunk_num];
+            std::vector<std::complex<double>>& v = amplitudes[chunk_num];
+            if(partial_matrix.size() == 0) {
+                partial_matrix.assign(dimension * dimension, 0);
+                v.assign(dimension, 0);
+            }
+            for(int i = first_state_index; i < first_state_index + run_length * stride; i += stride) {
+                for(int row = 0; row < dimension; row++) {
+                    v[row] = states[i + offsets[row]].v;
+                }
+                // Only the upper triangle, the matrix is hermitian
+                for(int row = 0; row < dimension; row++) {
+                    for(int column = row; column < dimension; column++) {
+                        partial_matrix[row * dimension + column] += multiply_complex(v[row], std::conj(v[column]));
+                    }
+                }
+            }
+        });
+        matrix->assign(dimension * dimension, 0);
+        for(int t = 0; t < thread_count; t++) {
+            for(int i = 0; i < partial_matrices[t].size(); i++) {
+                (*matrix)[i] += partial_matrices[t][i];
+            }
+        }
+        for(int row = 0; row < dimension; row++) {
+            for(int column = row; column < dimension; column++) {
+                (*matrix)[row * dimension + column] *= _norm_scale * _norm_scale;
+            }
+            for(int column = 0; column < row; column++) {
+                (*matrix)[row * dimension + column] = std::conj((*matrix)[column * dimension + row]);
+            }
+        }
+        return 0;
+    }
+    /**
+     * Get the purity tr(rho^2) of the reduced density matrix of the qubits, 1 if they are not entangled with the rest
+     * Returns -1 in the same cases as get_reduced_density_matrix
+    */
+    int get_purity(const std::vector<int>& qubits, double* purity) {
+        std::vector<std::complex<double>> matrix;
+        if(get_reduced_density_matrix(qubits, &matrix) != 0) {
+            return -1;
+        }
+        *purity = 0;
+        for(int i = 0; i < matrix.size(); i++) {
+            *purity += std::norm(matrix[i]);
+        }
+        return 0;
+    }
+    /**
+     * Get the bloch vector of every qubit, from its reduced density matrix, in one pass over the state
+    */
+    std::vector<BlochVector> get_bloch_vectors() {
+        int thread_count = vicmil::get_thread_pool().get_thread_count();
+        // Per thread and qubit: rho_00 - rho_11, and rho_01 = sum of <j|psi> * conj(<j + 2^q|psi>) over the states j with qubit q 0
+        std::vector<std::vector<double>> z_sums = std::vector<std::vector<double>>(thread_count, std::vector<double>(_qubit_count, 0));
+        std::vector<std::vector<std::complex<double>>> off_diagonal_sums = std::vector<std::vector<std::complex<double>>>(thread_count,
+            std::vector<std::complex<double>>(_qubit_count, 0));
+        std::vector<double> total_probabilities = std::vector<double>(thread_count, 0);
+        const QubitsState* states = _qubit_states.data();
+        vicmil::parallel_for(0, _qubit_states.size(), [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            double* z_sum = z_sums[chunk_num].data();
+            std::complex<double>* off_diagonal_sum = off_diagonal_sums[chunk_num].data();
+            double total_probability = 0;
+            for(int64_t j = chunk_begin; j < chunk_end; j++) {
+                double probability = std::norm(states[j].v);
+                total_probability += probability;
+                for(int q = 0; q < _qubit_count; q++) {
+                    if((j >> q) & 1) {
+                        z_sum[q] -= probability;
+                    }
+                    else {
+                        z_sum[q] += probability;
+                        off_diagonal_sum[q] += multiply_complex(states[j].v, std::conj(states[j | ((int64_t)1 << q)].v));
+                    }
+                }
             }
+            total_probabilities[chunk_num] = total_probability;
+        });
+        double total_probability = 0;
+        for(int t = 0; t < thread_count; t++) {
+            total_probability += total_probabilities[t];
         }
+        std::vector<BlochVector> bloch_vectors = std::vector<BlochVector>(_qubit_count);
+        for(int q = 0; q < _qubit_count; q++) {
+            std::complex<double> off_diagonal = 0;
+            for(int t = 0; t < thread_count; t++) {
+                bloch_vectors[q].z += z_sums[t][q] / total_probability;
+                off_diagonal += off_diagonal_sums[t][q] / total_probability;
+            }
+            bloch_vectors[q].x = 2 * off_diagonal.real();
+            bloch_vectors[q].y = -2 * off_diagonal.imag();
+        }
+        return bloch_vectors;
+    }
+
+    /**
+     * Collapse the qubit to the value, probability is the probability of the value before the collapse
+     *   The other states are set to 0, and the norm scale is scaled up instead of the states that are kept
+    */
+    void collapse(int qubit_num, bool value, double probability) {
+        int mask = get_qubit_mask(qubit_num);
+        _multiply_subspace(mask, value ? 0 : mask, 0);
+        _set_norm_scale(_norm_scale / std::sqrt(probability));
+    }
 
-        // Normalize the vector again(so that the probabilities add up to 1)
-        normalize();
+    bool measure(int qubit_num) {
+        double prob_1 = get_qubit_probability(qubit_num);
+        bool qubit_val = _rand_gen->rand_between_0_and_1() < prob_1;
+        collapse(qubit_num, qubit_val, qubit_val ? prob_1 : 1 - prob_1);
         return qubit_val;
     }
 
+    // Measure the qubit and flip it to 0 if it was 1
+    void reset_qubit(int qubit_num) {
+        if(measure(qubit_num)) {
+            multi_controlled_x(0, qubit_num);
+        }
+    }
+
+    /**
+     * Measure the qubits in qubit_mask together, bit i of the returned outcome is the value of the i:th lowest qubit in the mask
+     *   One pass sums the probability of every outcome(each thread has its own sums), and a second pass sets
+     *   the states that do not match the sampled outcome to 0 and sums the rest, the norm scale is scaled up as in collapse
+     *   With more than 16 qubits there are too many outcomes, the first pass then sums each thread's chunk and a state
+     *   is sampled from them, only the chunk with the sampled state is scanned again
+    */
+    int measure_qubits(int qubit_mask) {
+        int measured_count = vicmil::count_bits(qubit_mask);
+        // Outcome of a state index, from the low and high 12 bits, in place of a bit extract instruction
+        std::vector<int> low_outcomes = std::vector<int>(1 << 12, 0);
+        std::vector<int> high_outcomes = std::vector<int>(1 << 12, 0);
+        for(int part = 0; part < 2; part++) {
+            std::vector<int>& outcomes = part == 0 ? low_outcomes : high_outcomes;
+            int part_mask = (qubit_mask >> (12 * part)) & 0xFFF;
+            int shift = part == 0 ? 0 : vicmil::count_bits(qubit_mask & 0xFFF);
+            for(int bits = 0; bits < (1 << 12); bits++) {
+                int outcome = 0;
+                int outcome_bit = 0;
+                for(int k = 0; k < 12; k++) {
+                    if((part_mask >> k) & 1) {
+                        outcome |= ((bits >> k) & 1) << outcome_bit;
+                        outcome_bit++;
+                    }
+                }
+                outcomes[bits] = outcome << shift;
+            }
+        }
+        QubitsState* states = _qubit_states.data();
+        int64_t state_count = _qubit_states.size();
+        int outcome = 0;
+        double total_probability = 0;
+        if(measured_count <= 16) {
+            int outcome_count = 1 << measured_count;
+            int thread_count = vicmil::get_thread_pool().get_thread_count();
+            std::vector<std::vector<double>> partial_sums = std::vector<std::vector<double>>(thread_count);
+            vicmil::parallel_for(0, state_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+                std::vector<double>& sums = partial_sums[chunk_num];
+                sums.assign(outcome_count, 0);
+                for(int64_t j = chunk_begin; j < chunk_end; j++) {
+                    sums[low_outcomes[j & 0xFFF] | high_outcomes[j >> 12]] += std::norm(states[j].v);
+                }
+            });
+            std::vector<double> probabilities = std::vector<double>(outcome_count, 0);
+            for(int t = 0; t < thread_count; t++) {
+                for(int i = 0; i < partial_sums[t].size(); i++) {
+                    probabilities[i] += partial_sums[t][i];
+                    total_probability += partial_sums[t][i];
+                }
+            }
+            double r = _rand_gen->rand_between_0_and_1() * total_probability;
+            outcome = outcome_count - 1;
+            for(int i = 0; i < outcome_count; i++) {
+                if(r < probabilities[i] && probabilities[i] > 0) {
+                    outcome = i;
+                    break;
+                }
+                r -= probabilities[i];
+            }
+            while(probabilities[outcome] == 0 && outcome > 0) {
+                outcome--; // Rounding at the end
+            }
+        }
+        else {
+            // Sample a whole state, the outcome is the measured qubits of it
+            int chunk_count = vicmil::parallel_chunk_count(state_count);
+            std::vector<double> chunk_sums = std::vector<double>(chunk_count, 0);
+            std::vector<int64_t> chunk_begins = std::vector<int64_t>(chunk_count + 1, state_count);
+            vicmil::parallel_for(0, state_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+                double sum = 0;
+                for(int64_t j = chunk_begin; j < chunk_end; j++) {
+                    sum += std::norm(states[j].v);
+                }
+                chunk_sums[chunk_num] = sum;
+                chunk_begins[chunk_num] = chunk_begin;
+            });
+            for(int c = 0; c < chunk_count; c++) {
+                total_probability += chunk_sums[c];
+            }
+            double r = _rand_gen->rand_between_0_and_1() * total_probability;
+            int chunk_num = chunk_count - 1;
+            for(int c = 0; c < chunk_count; c++) {
+                if(r < chunk_sums[c] && chunk_sums[c] > 0) {
+                    chunk_num = c;
+                    break;
+                }
+                r -= chunk_sums[c];
+            }
+            while(chunk_sums[chunk_num] == 0 && chunk_num > 0) {
+                chunk_num--; // Rounding at the end
+            }
+            int64_t state_index = chunk_begins[chunk_num];
+            for(int64_t j = chunk_begins[chunk_num]; j < chunk_begins[chunk_num + 1]; j++) {
+                double probability = std::norm(states[j].v);
+                if(probability > 0) {
+                    state_index = j; // The last state that can be measured, if rounding leaves r above 0
+                }
+                r -= probability;
+                if(r < 0 && probability > 0) {
+                    break;
+                }
+            }
+            outcome = low_outcomes[state_index & 0xFFF] | high_outcomes[state_index >> 12];
+        }
+        std::vector<double> kept_sums = std::vector<double>(vicmil::get_thread_pool().get_thread_count(), 0);
+        vicmil::parallel_for(0, state_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            double sum = 0;
+            for(int64_t j = chunk_begin; j < chunk_end; j++) {
+                if((low_outcomes[j & 0xFFF] | high_outcomes[j >> 12]) != outcome) {
+                    states[j].v = 0;
+                }
+                else {
+                    sum += std::norm(states[j].v);
+                }
+            }
+            kept_sums[chunk_num] = sum;
+        });
+        double kept_probability = 0;
+        for(int i = 0; i < kept_sums.size(); i++) {
+            kept_probability += kept_sums[i];
+        }
+        _set_norm_scale(_norm_scale * std::sqrt(total_probability / kept_probability));
+        return outcome;
+    }
+
     std::vector<bool> measure_all() {
+        int outcome = measure_qubits((1 << _qubit_count) - 1);
         std::vector<bool> measurements;
         for (int n = 0; n < _qubit_count; n++) {
-            bool measurement = measure(n);
-            measurements.push_back(measurement);
+            measurements.push_back((outcome >> n) & 1);
         }
         return measurements;
     }
@@ -112,25 +736,13 @@ class QubitSystem {
 
     // See what the total probability is(should always add up to 1)
     double get_total_probability() {
-        // Calculate the total probability
-        double prob_sum = 0;
-        for (int n = 0; n < _qubit_states.size(); n++) {
-            prob_sum += _qubit_states[n].get_prob(); // cumulative probability
-        }
-
-        return prob_sum;
+        return _get_subspace_probability(0, 0) * _norm_scale * _norm_scale;
     }
     
 
+    // Scale the state so the total probability is 1, only the norm scale is changed
     void normalize() {
-        double tot_prob = get_total_probability();
-
-        // Normalize all the values
-        for (int n = 0; n < _qubit_states.size(); n++) {
-           double p = _qubit_states[n].get_prob();
-           double new_prob = p / tot_prob;
-           _qubit_states[n] = _qubit_states[n].set_prob(new_prob);
-        }
+        _set_norm_scale(1.0 / std::sqrt(_get_subspace_probability(0, 0)));
     }
 
 
@@ -149,8 +761,8 @@ class QubitSystem {
     }
 
 
-    void phase_shift_pi_over_4(int qubit_num) {
-        QubitsState phase_shift = QubitsState::from_prob_and_phase(1, vicmil::PI / 4);
+    void phase_shift(int qubit_num, double phase) {
+        QubitsState phase_shift = QubitsState::from_prob_and_phase(1, phase);
         for (int n = 0; n < _qubit_states.size(); n++) {
             if (is_qubit_enabled_in_state(n, qubit_num)) {
                 // apply phase shift if state has qubit set to 1
@@ -160,16 +772,461 @@ class QubitSystem {
     }
 
 
+    void phase_shift_pi_over_4(int qubit_num) {
+        phase_shift(qubit_num, vicmil::PI / 4);
+    }
+
+
+    /**
+     * Call func(first_state_index, run_length, stride, chunk_num) for each run of states where the qubits in fixed_mask
+     *   have the values in fixed_value. A run is the run_length states first_state_index + i * stride, the stride is 1 unless
+     *   the lowest qubits are fixed, e.g. 2 with qubit 0 fixed. Only those states are visited, the indices are generated directly
+     *   by inserting the fixed bits(bit deposit), so there is no need to test each state
+     * The runs are split between threads, func must be safe to call in parallel for different runs
+     *   chunk_num is different for each thread and less than the thread count, e.g. for partial sums
+    */
+    template<class Func>
+    void _for_each_subspace_run(int fixed_mask, int fixed_value, Func func) {
+        int fixed_bits[32];
+        int fixed_count = 0;
+        for(int i = 0; i < _qubit_count; i++) {
+            if((fixed_mask >> i) & 1) {
+                fixed_bits[fixed_count] = i;
+                fixed_count++;
+            }
+        }
+        // The fixed qubits 0, 1, ... are stepped over inside the runs, the runs end at the next fixed qubit
+        int low_fixed_count = 0;
+        while(low_fixed_count < fixed_count && fixed_bits[low_fixed_count] == low_fixed_count) {
+            low_fixed_count++;
+        }
+        int stride = 1 << low_fixed_count;
+        int subspace_size = _qubit_states.size() >> fixed_count;
+        // Long runs are split, so there is something to share between the threads also when few or no bits are fixed
+        int run_length = std::min(subspace_size, 1 << 12);
+        if(low_fixed_count < fixed_count) {
+            run_length = std::min(run_length, 1 << (fixed_bits[low_fixed_count] - low_fixed_count));
+        }
+        int run_count = subspace_size / run_length;
+        int64_t min_chunk_size = std::max((int64_t)1, vicmil::default_parallel_min_chunk_size / run_length);
+        vicmil::parallel_for(0, run_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            for(int run_num = chunk_begin; run_num < chunk_end; run_num++) {
+                int state_index = run_num * run_length;
+                for(int k = 0; k < fixed_count; k++) {
+                    state_index = _insert_zero_bit(state_index, fixed_bits[k]);
+                }
+                func(state_index | fixed_value, run_length, stride, chunk_num);
+            }
+        }, min_chunk_size);
+    }
+
+
     void cnot(int control_qubit_num, int target_qubit_num) {
-        for (int n = 0; n < _qubit_states.size(); n++) {
-            if (is_qubit_enabled_in_state(n, control_qubit_num)) {
-                if (!is_qubit_enabled_in_state(n, target_qubit_num)) {
-                    double n2 = n + get_qubit_mask(target_qubit_num); // Calculate the other state index;
-                    QubitsState tmp_n = _qubit_states[n];
-                    _qubit_states[n] = _qubit_states[n2];
-                    _qubit_states[n2] = tmp_n;
+        multi_controlled_x(get_qubit_mask(control_qubit_num), target_qubit_num);
+    }
+
+
+    void controlled_phase_shift(int control_qubit_num, int target_qubit_num, double phase) {
+        multi_controlled_phase_shift(get_qubit_mask(control_qubit_num), target_qubit_num, phase);
+    }
+
+
+    void controlled_z(int control_qubit_num, int target_qubit_num) {
+        controlled_phase_shift(control_qubit_num, target_qubit_num, vicmil::PI);
+    }
+
+
+    /**
+     * Flip the target qubit if all qubits in control_mask are 1, e.g. cnot or toffoli
+     *   Only the 2^(N-k-1) states with all controls 1 and target 0 are visited
+    */
+    void multi_controlled_x(int control_mask, int target_qubit_num) {
+        int target_mask = get_qubit_mask(target_qubit_num);
+        QubitsState* states = _qubit_states.data();
+        // Swap with the state where target is 1
+        _for_each_subspace_run(control_mask | target_mask, control_mask, [&](int first_state_index, int run_length, int stride, int chunk_num) {
+            for(int i = first_state_index; i < first_state_index + run_length * stride; i += stride) {
+                std::swap(states[i], states[i + target_mask]);
+            }
+        });
+    }
+
+
+    /**
+     * Apply the matrix [[m00, m01], [m10, m11]] to the qubit
+    */
+    void single_qubit_gate(int qubit_num, std::complex<double> m00, std::complex<double> m01, std::complex<double> m10, std::complex<double> m11) {
+        int target_mask = get_qubit_mask(qubit_num);
+        QubitsState* states = _qubit_states.data();
+        _for_each_subspace_run(target_mask, 0, [&](int first_state_index, int run_length, int stride, int chunk_num) {
+            for(int i = first_state_index; i < first_state_index + run_length * stride; i += stride) {
+                std::complex<double> value_0 = states[i].v;
+                std::complex<double> value_1 = states[i + target_mask].v;
+                states[i].v = multiply_complex(m00, value_0) + multiply_complex(m01, value_1);
+                states[i + target_mask].v = multiply_complex(m10, value_0) + multiply_complex(m11, value_1);
+            }
+        });
+    }
+    /**
+     * Get the matrix of a rotation of angle radians around the x(axis 0), y(axis 1) or z(axis 2) axis,
+     *   exp(-i * angle/2 * pauli), as matrix[row * 2 + column]
+    */
+    static void get_rotation_matrix(int axis, double angle, std::complex<double>* matrix) {
+        double c = std::cos(angle / 2);
+        double s = std::sin(angle / 2);
+        if(axis == 0) {
+            matrix[0] = c; matrix[1] = std::complex<double>(0, -s);
+            matrix[2] = std::complex<double>(0, -s); matrix[3] = c;
+        }
+        else if(axis == 1) {
+            matrix[0] = c; matrix[1] = -s;
+            matrix[2] = s; matrix[3] = c;
+        }
+        else {
+            matrix[0] = std::complex<double>(c, -s); matrix[1] = 0;
+            matrix[2] = 0; matrix[3] = std::complex<double>(c, s);
+        }
+    }
+    void rotation(int axis, int qubit_num, double angle) {
+        std::complex<double> matrix[4];
+        get_rotation_matrix(axis, angle, matrix);
+        single_qubit_gate(qubit_num, matrix[0], matrix[1], matrix[2], matrix[3]);
+    }
+    /**
+     * Phase shift of the target qubit if all qubits in control_mask are 1
+     *   Only the 2^(N-k-1) states with all controls and the target 1 are visited
+    */
+    void multi_controlled_phase_shift(int control_mask, int target_qubit_num, double phase) {
+        int mask = control_mask | get_qubit_mask(target_qubit_num);
+        _multiply_subspace(mask, mask, vicmil::exp_form_to_complex(1, phase));
+    }
+
+
+    void multi_controlled_z(int control_mask, int target_qubit_num) {
+        multi_controlled_phase_shift(control_mask, target_qubit_num, vicmil::PI);
+    }
+
+
+    void toffoli(int control_qubit_num1, int control_qubit_num2, int target_qubit_num) {
+        multi_controlled_x(get_qubit_mask(control_qubit_num1) | get_qubit_mask(control_qubit_num2), target_qubit_num);
+    }
+
+
+    /**
+     * Quantum fourier transform of the qubits [first_qubit_num, first_qubit_num + qubit_count), read as the number x
+     *   with first_qubit_num as the lowest bit: |x> -> 1/sqrt(M) * sum_y e^(2*pi*i * x*y/M)|y>, M = 2^qubit_count
+     * The same as the hadamar and controlled phase circuit followed by the swaps that reverse the qubit order,
+     *   but done as an FFT with O(qubit_count) passes over the state instead of O(qubit_count^2) gates
+    */
+    void qft(int first_qubit_num, int qubit_count) {
+        _fourier_transform(first_qubit_num, qubit_count, 1);
+    }
+    void inverse_qft(int first_qubit_num, int qubit_count) {
+        _fourier_transform(first_qubit_num, qubit_count, -1);
+    }
+    /**
+     * In place radix-2 decimation in frequency FFT, with two stages at a time(radix-4) where possible
+     *   The stages between amplitudes far apart are passes over the whole state, and once the remaining stages only
+     *   mix amplitudes within blocks that fit in the cache each block is finished on one thread. The output comes
+     *   in bit reversed order, which is undone in a last pass together with the 1/sqrt(M) scaling
+    */
+    void _fourier_transform(int first_qubit_num, int qubit_count, int sign) {
+        if(qubit_count == 0) {
+            return;
+        }
+        int transform_size = 1 << qubit_count;
+        FourierTwiddles twiddles = FourierTwiddles(qubit_count, sign);
+        QubitsState* states = _qubit_states.data();
+        int64_t state_count = _qubit_states.size();
+        int64_t column_count = (int64_t)1 << first_qubit_num; // States between x and x + 1
+        int span = transform_size / 2;
+        while(span >= 1 && 2 * span * column_count > ((int64_t)1 << fft_block_qubit_count)) {
+            bool radix4 = span >= 2;
+            int64_t butterfly_count = state_count / (radix4 ? 4 : 2);
+            vicmil::parallel_for(0, butterfly_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+                _fft_butterflies(states, chunk_begin, chunk_end, span, radix4, first_qubit_num, twiddles);
+            });
+            span /= radix4 ? 4 : 2;
+        }
+        if(span >= 1) {
+            int64_t block_size = 2 * span * column_count;
+            vicmil::parallel_for(0, state_count / block_size, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+                for(int64_t block_num = chunk_begin; block_num < chunk_end; block_num++) {
+                    for(int block_span = span; block_span >= 1; block_span /= block_span >= 2 ? 4 : 2) {
+                        bool radix4 = block_span >= 2;
+                        _fft_butterflies(states + block_num * block_size, 0, block_size / (radix4 ? 4 : 2), block_span, radix4,
+                            first_qubit_num, twiddles);
+                    }
                 }
+            }, 1);
+        }
+        // Done in tiles of x = (a, middle, c) with a and c of tile_bit_count bits, that swap with the tile (reversed c, reversed middle, reversed a)
+        //   so both sides of the swaps stay in the cache. Each pair is swapped from the tile with the smaller middle
+        int tile_bit_count = std::min(qubit_count / 2, 5);
+        int tile_size = 1 << tile_bit_count;
+        int tile_reversed[32];
+        for(int a = 0; a < tile_size; a++) {
+            tile_reversed[a] = _reverse_bits(a, tile_bit_count);
+        }
+        int middle_count = transform_size >> (2 * tile_bit_count);
+        int64_t tile_state_count = (int64_t)tile_size * tile_size << first_qubit_num;
+        double scale = 1.0 / std::sqrt((double)transform_size);
+        vicmil::parallel_for(0, (state_count >> qubit_count >> first_qubit_num) * middle_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            for(int64_t t = chunk_begin; t < chunk_end; t++) {
+                QubitsState* transform_states = states + ((t / middle_count) << qubit_count << first_qubit_num);
+                int middle = (t % middle_count) << tile_bit_count;
+                int reversed_middle = _reverse_bits(middle, qubit_count);
+                if(middle > reversed_middle) {
+                    continue;
+                }
+                for(int a = 0; a < tile_size; a++) {
+                    for(int c = 0; c < tile_size; c++) {
+                        int x = (a << (qubit_count - tile_bit_count)) | middle | c;
+                        int reversed_x = (tile_reversed[c] << (qubit_count - tile_bit_count)) | reversed_middle | tile_reversed[a];
+                        if(x > reversed_x && middle == reversed_middle) {
+                            continue;
+                        }
+                        QubitsState* x_states = transform_states + ((int64_t)x << first_qubit_num);
+                        QubitsState* reversed_x_states = transform_states + ((int64_t)reversed_x << first_qubit_num);
+                        for(int64_t column = 0; column < column_count; column++) {
+                            std::complex<double> value = x_states[column].v;
+                            x_states[column].v = reversed_x_states[column].v * scale;
+                            reversed_x_states[column].v = value * scale;
+                        }
+                    }
+                }
+            }
+        }, std::max((int64_t)1, vicmil::default_parallel_min_chunk_size / tile_state_count));
+    }
+    static int _reverse_bits(int value, int bit_count) {
+        int reversed = 0;
+        for(int k = 0; k < bit_count; k++) {
+            reversed |= ((value >> k) & 1) << (bit_count - 1 - k);
+        }
+        return reversed;
+    }
+    /**
+     * Butterflies [butterfly_begin, butterfly_end) of the FFT stage between x and x + span, and if radix4 also the next stage
+     *   between x and x + span/2. Butterfly b works on x = j and x = j + span(+ span/2 and + 3*span/2 for radix4)
+     *   where j is the low bits of b above the column bits, so the columns next to each other are handled together
+    */
+    static void _fft_butterflies(QubitsState* states, int64_t butterfly_begin, int64_t butterfly_end, int span, bool radix4,
+        int first_qubit_num, const FourierTwiddles& twiddles) {
+        int64_t column_mask = ((int64_t)1 << first_qubit_num) - 1;
+        int j_count = radix4 ? span / 2 : span;
+        int j_bit_count = 0;
+        while((1 << j_bit_count) < j_count) {
+            j_bit_count++;
+        }
+        int64_t group_size = (int64_t)2 * span << first_qubit_num;
+        int64_t distance = (int64_t)j_count << first_qubit_num;
+        for(int64_t b = butterfly_begin; b < butterfly_end; b++) {
+            int64_t column = b & column_mask;
+            int64_t j = (b >> first_qubit_num) & (j_count - 1);
+            int64_t group_num = b >> (first_qubit_num + j_bit_count);
+            QubitsState* x = states + group_num * group_size + (j << first_qubit_num) + column;
+            if(!radix4) {
+                std::complex<double> a = x[0].v;
+                std::complex<double> c = x[distance].v;
+                x[0].v = a + c;
+                x[distance].v = multiply_complex(a - c, twiddles.get(span, j));
+                continue;
+            }
+            std::complex<double> x0 = x[0].v;
+            std::complex<double> x1 = x[distance].v;
+            std::complex<double> x2 = x[2 * distance].v;
+            std::complex<double> x3 = x[3 * distance].v;
+            std::complex<double> y0 = x0 + x2;
+            std::complex<double> y2 = multiply_complex(x0 - x2, twiddles.get(span, j));
+            std::complex<double> y1 = x1 + x3;
+            std::complex<double> y3 = multiply_complex(x1 - x3, twiddles.get(span, j + j_count));
+            std::complex<double> twiddle = twiddles.get(span / 2, j);
+            x[0].v = y0 + y1;
+            x[distance].v = multiply_complex(y0 - y1, twiddle);
+            x[2 * distance].v = y2 + y3;
+            x[3 * distance].v = multiply_complex(y2 - y3, twiddle);
+        }
+    }
+
+
+    // Multiply the states where the qubits in fixed_mask have the values in fixed_value with a factor
+    void _multiply_subspace(int fixed_mask, int fixed_value, std::complex<double> factor) {
+        QubitsState* states = _qubit_states.data();
+        double factor_real = factor.real();
+        double factor_imag = factor.imag();
+        _for_each_subspace_run(fixed_mask, fixed_value, [&](int first_state_index, int run_length, int stride, int chunk_num) {
+            // Written out by hand, std::complex multiplication has extra checks that prevent vectorization
+            for(int i = first_state_index; i < first_state_index + run_length * stride; i += stride) {
+                double real = states[i].v.real();
+                double imag = states[i].v.imag();
+                states[i].v = std::complex<double>(real * factor_real - imag * factor_imag, real * factor_imag + imag * factor_real);
+            }
+        });
+    }
+
+
+    /**
+     * Get the sum of the probabilities of the states where the qubits in fixed_mask have the values in fixed_value, without the norm scale
+     *   The sums are compensated(Kahan), so the rounding errors do not grow with the number of states
+    */
+    double _get_subspace_probability(int fixed_mask, int fixed_value) {
+        const QubitsState* states = _qubit_states.data();
+        int thread_count = vicmil::get_thread_pool().get_thread_count();
+        std::vector<double> partial_sums = std::vector<double>(thread_count, 0);
+        std::vector<double> partial_compensations = std::vector<double>(thread_count, 0);
+        _for_each_subspace_run(fixed_mask, fixed_value, [&](int first_state_index, int run_length, int stride, int chunk_num) {
+            double sum = partial_sums[chunk_num];
+            double compensation = partial_compensations[chunk_num];
+            for(int i = first_state_index; i < first_state_index + run_length * stride; i += stride) {
+                double term = std::norm(states[i].v) - compensation;
+                double new_sum = sum + term;
+                compensation = (new_sum - sum) - term;
+                sum = new_sum;
             }
+            partial_sums[chunk_num] = sum;
+            partial_compensations[chunk_num] = compensation;
+        });
+        double total_sum = 0;
+        for(int i = 0; i < partial_sums.size(); i++) {
+            total_sum += partial_sums[i] - partial_compensations[i];
+        }
+        return total_sum;
+    }
+
+
+    /**
+     * Apply all gates in the layer in one pass over the state
+     *   The gates act on different qubits, so they commute, and the result is P * D * H
+     *   where H are the hadamar gates, D the phase gates and P the permutation from the cnots
+     *   The state is processed in groups of 2^h states that only differ in the hadamar qubits,
+     *   D is then the same phase for the whole group, and P moves the whole group to another group
+    */
+    void apply_layer(const GateLayer& layer) {
+        if(layer.get_gate_count() == 0) {
+            return;
+        }
+        if(layer.get_gate_count() == 1) {
+            // No need to combine anything
+            if(layer.hadamar_qubits.size() == 1) {
+                hadamar(layer.hadamar_qubits[0]);
+            }
+            else if(layer.phase_masks.size() == 1) {
+                _multiply_subspace(layer.phase_masks[0], layer.phase_masks[0], vicmil::exp_form_to_complex(1, layer.phases[0]));
+            }
+            else {
+                multi_controlled_x(layer.x_control_masks[0], layer.x_targets[0]);
+            }
+            return;
+        }
+
+        // Gates that do not fit in the combined pass get their own pass, they commute with the rest anyway
+        int hadamar_count = std::min((int)layer.hadamar_qubits.size(), max_layer_hadamar_count);
+        int phase_count = std::min((int)layer.phase_masks.size(), max_layer_phase_count);
+        for(int i = hadamar_count; i < layer.hadamar_qubits.size(); i++) {
+            hadamar(layer.hadamar_qubits[i]);
+        }
+        for(int i = phase_count; i < layer.phase_masks.size(); i++) {
+            _multiply_subspace(layer.phase_masks[i], layer.phase_masks[i], vicmil::exp_form_to_complex(1, layer.phases[i]));
+        }
+
+        // The hadamar qubits sorted, so that the zero bits can be inserted in order
+        //   Insertion sort by hand, std::sort on the small array gives false -Warray-bounds warnings
+        int hadamar_bits[max_layer_hadamar_count];
+        for(int i = 0; i < hadamar_count; i++) {
+            int bit = layer.hadamar_qubits[i];
+            int j = i;
+            while(j > 0 && hadamar_bits[j - 1] > bit) {
+                hadamar_bits[j] = hadamar_bits[j - 1];
+                j--;
+            }
+            hadamar_bits[j] = bit;
+        }
+        int group_size = 1 << hadamar_count;
+        int group_offsets[1 << max_layer_hadamar_count]; // The state index offset of each state in group
+        for(int j = 0; j < group_size; j++) {
+            group_offsets[j] = 0;
+            for(int k = 0; k < hadamar_count; k++) {
+                group_offsets[j] |= ((j >> k) & 1) << hadamar_bits[k];
+            }
+        }
+
+        // The phase of each combination of the phase gates being on or off
+        std::vector<std::complex<double>> phase_table = std::vector<std::complex<double>>(1 << phase_count);
+        for(int j = 0; j < phase_table.size(); j++) {
+            double phase = 0;
+            for(int k = 0; k < phase_count; k++) {
+                phase += ((j >> k) & 1) * layer.phases[k];
+            }
+            phase_table[j] = vicmil::exp_form_to_complex(std::pow(std::sqrt(0.5), hadamar_count), phase);
+        }
+
+        int group_count = _qubit_states.size() >> hadamar_count;
+        // A pair of groups is handled by the thread that has the lower one, so threads never write to the same state
+        vicmil::parallel_for(0, group_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            std::complex<double> group1[1 << max_layer_hadamar_count];
+            std::complex<double> group2[1 << max_layer_hadamar_count];
+            for(int group_num = chunk_begin; group_num < chunk_end; group_num++) {
+                int base = group_num;
+                for(int k = 0; k < hadamar_count; k++) {
+                    base = _insert_zero_bit(base, hadamar_bits[k]);
+                }
+                int partner_base = _layer_cnot_permutation(layer, base);
+                if(partner_base < base) {
+                    continue; // Already handled together with the partner
+                }
+                _layer_transform_group(layer, base, hadamar_count, group_offsets, phase_table, group1);
+                if(partner_base == base) {
+                    for(int j = 0; j < group_size; j++) {
+                        _qubit_states[base + group_offsets[j]].v = group1[j];
+                    }
+                    continue;
+                }
+                _layer_transform_group(layer, partner_base, hadamar_count, group_offsets, phase_table, group2);
+                for(int j = 0; j < group_size; j++) {
+                    _qubit_states[partner_base + group_offsets[j]].v = group1[j];
+                    _qubit_states[base + group_offsets[j]].v = group2[j];
+                }
+            }
+        }, std::max(1, (int)vicmil::default_parallel_min_chunk_size >> hadamar_count));
+    }
+    // Insert a zero bit at position bit_num, the higher bits are moved up one step
+    static int _insert_zero_bit(int value, int bit_num) {
+        int low_mask = (1 << bit_num) - 1;
+        return ((value & ~low_mask) << 1) | (value & low_mask);
+    }
+    static int _layer_cnot_permutation(const GateLayer& layer, int state_index) {
+        int flip_mask = 0;
+        for(int i = 0; i < layer.x_targets.size(); i++) {
+            int control_mask = layer.x_control_masks[i];
+            flip_mask |= (int)((state_index & control_mask) == control_mask) << layer.x_targets[i];
+        }
+        return state_index ^ flip_mask;
+    }
+    // Apply the hadamar and phase gates to a group, the result is written to group_out
+    void _layer_transform_group(const GateLayer& layer, int base, int hadamar_count, const int* group_offsets, 
+            const std::vector<std::complex<double>>& phase_table, std::complex<double>* group_out) {
+        int group_size = 1 << hadamar_count;
+        for(int j = 0; j < group_size; j++) {
+            group_out[j] = _qubit_states[base + group_offsets[j]].v;
+        }
+        // Walsh-Hadamard transform over the group, the normalization is in the phase table
+        for(int half = 1; half < group_size; half *= 2) {
+            for(int j = 0; j < group_size; j += 2 * half) {
+                for(int k = j; k < j + half; k++) {
+                    std::complex<double> a = group_out[k];
+                    std::complex<double> b = group_out[k + half];
+                    group_out[k] = a + b;
+                    group_out[k + half] = a - b;
+                }
+            }
+        }
+        int phase_index = 0;
+        for(int k = 0; (1 << k) < phase_table.size(); k++) {
+            phase_index |= (int)((base & layer.phase_masks[k]) == layer.phase_masks[k]) << k;
+        }
+        std::complex<double> phase = phase_table[phase_index];
+        for(int j = 0; j < group_size; j++) {
+            group_out[j] *= phase;
         }
     }
 
@@ -187,7 +1244,9 @@ class QubitSystem {
             return_str += "|  ";
             double prob;
             double phase;
-            _qubit_states[state_].get_prob_and_phase(&prob, &phase);
+            QubitsState state;
+            state.v = get_amplitude(state_);
+            state.get_prob_and_phase(&prob, &phase);
             return_str += "prob: " + std::to_string(prob*100.0) + "%     ";
             return_str += "phase: " + std::to_string(vicmil::radians_to_degrees(phase)) + "deg";
             return_str += "\n";
@@ -205,10 +1264,265 @@ class QubitSystem {
                 return_str += std::to_string((int)is_qubit_enabled_in_state(state_, _qubit_count - n - 1)) + "  ";
             }
             return_str += "|  ";
-            return_str += "real: " + std::to_string(_qubit_states[state_].v.real()) + "    ";
-            return_str += "imag: " + std::to_string(_qubit_states[state_].v.imag());
+            return_str += "real: " + std::to_string(get_amplitude(state_).real()) + "    ";
+            return_str += "imag: " + std::to_string(get_amplitude(state_).imag());
             return_str += "\n";
         }
         return return_str;
     }
-};
\ No newline at end of file
+};
+
+void TEST_QubitSystem_reset() {
+    QubitSystem system = QubitSystem(5);
+    system.hadamar(0);
+    system.cnot(0, 3);
+    system._classical_bits = 3;
+    const QubitsState* states = system._qubit_states.data();
+    system.reset(5);
+    assert(system._qubit_states.data() == states); // Same memory, reset in place
+    assert(system._classical_bits == 0);
+    assert(std::abs(system._qubit_states[0].v - std::complex<double>(1, 0)) < 0.000001);
+    assert(std::abs(system.get_total_probability() - 1) < 0.000001);
+
+    // A destroyed system gives its buffer back to the pool, and the next one of the same size reuses it
+    QubitSystem moved_system = std::move(system);
+    assert(moved_system._qubit_states.data() == states);
+    moved_system.hadamar(2);
+    moved_system = QubitSystem(3);
+    QubitSystem reused_system = QubitSystem(5);
+    assert(reused_system._qubit_states.data() == states);
+    assert(std::abs(reused_system.get_total_probability() - 1) < 0.000001);
+}
+AddTest(TEST_QubitSystem_reset);
+
+void TEST_QubitSystem_qft() {
+    // Compared with the circuit, on ranges that use both the passes over the whole state and the blocks
+    vicmil::RandomNumberGenerator rand_gen;
+    rand_gen.set_seed(3);
+    QubitSystem input = QubitSystem(16);
+    for(int i = 0; i < 16; i++) {
+        input.rotation(1, i, rand_gen.rand_between_0_and_1() * 3);
+        input.rotation(2, i, rand_gen.rand_between_0_and_1() * 3);
+    }
+    input.cnot(3, 9);
+    const int ranges[4][2] = {{0, 16}, {3, 12}, {15, 1}, {13, 3}};
+    for(int r = 0; r < 4; r++) {
+        int first = ranges[r][0];
+        int count = ranges[r][1];
+        QubitSystem system = input;
+        system.qft(first, count);
+        QubitSystem expected = input;
+        for(int k = first + count - 1; k >= first; k--) {
+            expected.hadamar(k);
+            for(int j = first; j < k; j++) {
+                expected.controlled_phase_shift(j, k, vicmil::PI / (1 << (k - j)));
+            }
+        }
+        for(int k = 0; k < count / 2; k++) {
+            expected.cnot(first + k, first + count - 1 - k);
+            expected.cnot(first + count - 1 - k, first + k);
+            expected.cnot(first + k, first + count - 1 - k);
+        }
+        for(int i = 0; i < system._qubit_states.size(); i++) {
+            assert(std::abs(system._qubit_states[i].v - expected._qubit_states[i].v) < 0.000001);
+        }
+        system.inverse_qft(first, count);
+        for(int i = 0; i < system._qubit_states.size(); i++) {
+            assert(std::abs(system._qubit_states[i].v - input._qubit_states[i].v) < 0.000001);
+        }
+    }
+}
+AddTest(TEST_QubitSystem_qft);
+
+void TEST_QubitSystem_initializers() {
+    QubitSystem system = QubitSystem(14);
+    system.set_basis_state(37);
+    assert(std::abs(system._qubit_states[37].v - 1.0) < 0.000001);
+    assert(std::abs(system.get_total_probability() - 1) < 0.000001);
+
+    // The same product state as from gates, with more qubits than the expanded table
+    vicmil::RandomNumberGenerator rand_gen;
+    rand_gen.set_seed(4);
+    std::vector<std::complex<double>> qubit_amplitudes;
+    QubitSystem expected = QubitSystem(14);
+    for(int i = 0; i < 14; i++) {
+        double theta = rand_gen.rand_between_0_and_1() * 3;
+        double phi = rand_gen.rand_between_0_and_1() * 6;
+        qubit_amplitudes.push_back(2 * std::cos(theta / 2)); // Normalized by set_product_state
+        qubit_amplitudes.push_back(std::polar(2 * std::sin(theta / 2), phi));
+        expected.rotation(1, i, theta);
+        expected.phase_shift(i, phi);
+    }
+    assert(system.set_product_state(qubit_amplitudes) == 0);
+    for(int i = 0; i < system._qubit_states.size(); i++) {
+        assert(std::abs(system._qubit_states[i].v - expected._qubit_states[i].v) < 0.000001);
+    }
+    assert(system.set_product_state({1, 0}) == -1);
+
+    std::vector<std::complex<double>> amplitudes = std::vector<std::complex<double>>(system._qubit_states.size());
+    for(int i = 0; i < amplitudes.size(); i++) {
+        amplitudes[i] = std::complex<double>(i % 7, -(i % 3));
+    }
+    assert(system.set_amplitudes(amplitudes) == 0);
+    assert(std::abs(system.get_total_probability() - 1) < 0.000001);
+    assert(std::abs(system._qubit_states[9].v / system._qubit_states[1].v - amplitudes[9] / amplitudes[1]) < 0.000001);
+    assert(system.set_amplitudes({1, 0}) == -1);
+}
+AddTest(TEST_QubitSystem_initializers);
+
+void TEST_QubitSystem_reduced_density_matrix() {
+    // A bell pair of qubit 0 and 2, and qubit 1 in a product state
+    QubitSystem system = QubitSystem(3);
+    system.hadamar(0);
+    system.cnot(0, 2);
+    system.rotation(0, 1, 0.8);
+    std::vector<std::complex<double>> matrix;
+    assert(system.get_reduced_density_matrix({2}, &matrix) == 0);
+    assert(matrix.size() == 4);
+    assert(std::abs(matrix[0] - 0.5) < 0.000001 && std::abs(matrix[1]) < 0.000001 && std::abs(matrix[3] - 0.5) < 0.000001);
+    double purity = 0;
+    assert(system.get_purity({2}, &purity) == 0 && std::abs(purity - 0.5) < 0.000001);
+    assert(system.get_purity({2, 0}, &purity) == 0 && std::abs(purity - 1) < 0.000001);
+    assert(system.get_purity({1}, &purity) == 0 && std::abs(purity - 1) < 0.000001);
+    assert(system.get_reduced_density_matrix({0, 0}, &matrix) == -1);
+    assert(system.get_reduced_density_matrix({3}, &matrix) == -1);
+
+    // Compared with the sum over all states, with the qubits in another order than in the state
+    vicmil::RandomNumberGenerator rand_gen;
+    rand_gen.set_seed(6);
+    QubitSystem random_system = QubitSystem(6);
+    std::vector<std::complex<double>> amplitudes;
+    for(int i = 0; i < 64; i++) {
+        amplitudes.push_back(std::complex<double>(rand_gen.rand_between_0_and_1() - 0.5, rand_gen.rand_between_0_and_1() - 0.5));
+    }
+    assert(random_system.set_amplitudes(amplitudes) == 0);
+    std::vector<int> qubits = {4, 1};
+    assert(random_system.get_reduced_density_matrix(qubits, &matrix) == 0);
+    for(int row = 0; row < 4; row++) {
+        for(int column = 0; column < 4; column++) {
+            std::complex<double> expected = 0;
+            for(int i = 0; i < 64; i++) {
+                for(int j = 0; j < 64; j++) {
+                    int row_i = ((i >> 4) & 1) | (((i >> 1) & 1) << 1);
+                    int column_j = ((j >> 4) & 1) | (((j >> 1) & 1) << 1);
+                    if(row_i == row && column_j == column && (i & ~0b10010) == (j & ~0b10010)) {
+                        expected += random_system._qubit_states[i].v * std::conj(random_system._qubit_states[j].v);
+                    }
+                }
+            }
+            assert(std::abs(matrix[row * 4 + column] - expected) < 0.000001);
+        }
+    }
+
+    // The bloch vectors of a product state
+    QubitSystem product_system = QubitSystem(3);
+    assert(product_system.set_product_state({1, 0, 1, 1, 1, std::complex<double>(0, 1)}) == 0); // |0>, |+>, |+i>
+    std::vector<BlochVector> bloch_vectors = product_system.get_bloch_vectors();
+    assert(std::abs(bloch_vectors[0].z - 1) < 0.000001);
+    assert(std::abs(bloch_vectors[1].x - 1) < 0.000001);
+    assert(std::abs(bloch_vectors[2].y - 1) < 0.000001 && std::abs(bloch_vectors[2].x) < 0.000001);
+    bloch_vectors = system.get_bloch_vectors();
+    assert(std::abs(bloch_vectors[0].x) + std::abs(bloch_vectors[0].y) + std::abs(bloch_vectors[0].z) < 0.000001); // Entangled
+    assert(std::abs(bloch_vectors[1].z - std::cos(0.8)) < 0.000001 && std::abs(bloch_vectors[1].y + std::sin(0.8)) < 0.000001);
+}
+AddTest(TEST_QubitSystem_reduced_density_matrix);
+
+void TEST_QubitSystem_measure_qubits() {
+    // Qubits 1 and 3 are a bell pair, qubit 0 is 1 and qubit 2 is |+>
+    QubitSystem system = QubitSystem(4);
+    system._rand_gen->set_seed(2);
+    int counts[4] = {0, 0, 0, 0};
+    for(int shot = 0; shot < 400; shot++) {
+        system.reset(4);
+        system.multi_controlled_x(0, 0);
+        system.hadamar(1);
+        system.cnot(1, 3);
+        system.hadamar(2);
+        int outcome = system.measure_qubits(0b1011); // Bit 0 is qubit 0, bit 1 qubit 1 and bit 2 qubit 3
+        assert((outcome & 1) == 1);
+        assert(((outcome >> 1) & 1) == ((outcome >> 2) & 1));
+        counts[outcome >> 1]++;
+        // The measured qubits are collapsed, qubit 2 is left as it was
+        assert(std::abs(system.get_total_probability() - 1) < 0.000001);
+        assert(std::abs(system.get_qubit_probability(2) - 0.5) < 0.000001);
+        assert(system.measure_qubits(0b1011) == outcome);
+    }
+    assert(counts[0] > 150 && counts[3] > 150 && counts[0] + counts[3] == 400);
+
+    // More qubits than are summed per outcome
+    QubitSystem large_system = QubitSystem(18);
+    for(int i = 0; i < 17; i++) {
+        large_system.hadamar(i);
+    }
+    large_system.cnot(0, 17); // Qubit 17 is the same as qubit 0
+    int outcome = large_system.measure_qubits((1 << 17) - 1);
+    assert(std::abs(large_system.get_qubit_probability(17) - (outcome & 1)) < 0.000001);
+    assert(std::abs(large_system.get_total_probability() - 1) < 0.000001);
+
+    // A copy has its own random stream, and a moved system keeps the stream of the original
+    QubitSystem uniform_system = QubitSystem(20);
+    for(int i = 0; i < 20; i++) {
+        uniform_system.hadamar(i);
+    }
+    QubitSystem copied_system = uniform_system;
+    assert(copied_system.measure_qubits((1 << 20) - 1) != uniform_system.measure_qubits((1 << 20) - 1));
+    vicmil::RandomNumberGenerator* rand_gen = copied_system._rand_gen.get();
+    QubitSystem moved_system = std::move(copied_system);
+    assert(moved_system._rand_gen.get() == rand_gen);
+}
+AddTest(TEST_QubitSystem_measure_qubits);
+
+void TEST_QubitSystem_lazy_normalization() {
+    // Measuring qubits of |+>^n one at a time halves the kept probability each time, only the norm scale is changed
+    QubitSystem system = QubitSystem(10);
+    for(int i = 0; i < 10; i++) {
+        system.hadamar(i);
+    }
+    int outcome = 0;
+    for(int i = 0; i < 6; i++) {
+        outcome |= system.measure(i) << i;
+        assert(std::abs(system.get_total_probability() - 1) < 0.000001);
+    }
+    assert(std::abs(system._norm_scale - 8) < 0.000001);
+    assert(std::abs(std::norm(system._qubit_states[outcome].v) - 1.0 / 1024) < 0.000001);
+    assert(std::abs(std::norm(system.get_amplitude(outcome)) - 1.0 / 16) < 0.000001);
+    QubitSystem copied_system = system;
+    copied_system.apply_norm_scale();
+    assert(copied_system._norm_scale == 1);
+    for(int i = 0; i < 1024; i++) {
+        assert(std::abs(copied_system._qubit_states[i].v - system.get_amplitude(i)) < 0.000001);
+    }
+
+    // A scale that grows too large is multiplied into the states
+    QubitSystem collapsed_system = QubitSystem(20);
+    for(int i = 0; i < 20; i++) {
+        collapsed_system.hadamar(i);
+    }
+    collapsed_system.collapse(0, 1, 1e-40);
+    assert(collapsed_system._norm_scale == 1);
+    collapsed_system.normalize();
+    assert(std::abs(collapsed_system.get_total_probability() - 1) < 0.000001);
+    assert(std::abs(std::norm(collapsed_system.get_amplitude(1)) - 1.0 / (1 << 19)) < 1e-12);
+    assert(std::abs(collapsed_system.get_qubit_probability(0) - 1) < 0.000001);
+}
+AddTest(TEST_QubitSystem_lazy_normalization);
+
+void TEST_QubitSystem_subspace_runs() {
+    // Each state in the subspace is visited once, also when the lowest qubits are fixed and the runs have a stride
+    QubitSystem system = QubitSystem(14);
+    int fixed_masks[4] = {0, 0b1, 0b1011, 0b10000000000110};
+    for(int m = 0; m < 4; m++) {
+        int fixed_mask = fixed_masks[m];
+        int fixed_value = fixed_mask & 0b1010101010101;
+        std::vector<int> visit_counts = std::vector<int>(system._qubit_states.size(), 0);
+        system._for_each_subspace_run(fixed_mask, fixed_value, [&](int first_state_index, int run_length, int stride, int chunk_num) {
+            for(int i = first_state_index; i < first_state_index + run_length * stride; i += stride) {
+                visit_counts[i]++;
+            }
+        });
+        for(int i = 0; i < visit_counts.size(); i++) {
+            assert(visit_counts[i] == ((i & fixed_mask) == fixed_value ? 1 : 0));
+        }
+    }
+}
+AddTest(TEST_QubitSystem_subspace_runs);
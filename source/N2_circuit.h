@@ -5,7 +5,10 @@ namespace qubit_circuit {
 const int standard_gate_index = 0;
 const int hadamar_gate_index = 1;
 const int phase_shift_gate_index = 2;
-const int cnot_gate_index = 3;
+const int cnot_gate_index = 3; // Controlled gates, index_in_gate is 0 for controls, 1 for x target and 2 for z target
+                                //   and 3 for classical controls(the last measurement of the qubit)
+const int measure_gate_index = 4; // The result is stored in the classical bit with the same number as the qubit
+const int reset_gate_index = 5;
 
 const int MAX_QUBIT_COUNT = 10;
 
@@ -16,97 +19,599 @@ struct QubitGateSetting {
     std::string op_str = ".."; // How the operation will be presented
     int gate_index = standard_gate_index;
     int index_in_gate = 0; // eg. control or target qubit
-    QubitGateSetting(std::string op_str_, int gate_index_, int index_in_gate_) {
+    int gate_group = 0; // Qubits with the same gate and group in an operation belong to the same gate
+    QubitGateSetting(std::string op_str_, int gate_index_, int index_in_gate_, int gate_group_ = 0) {
         op_str = op_str_;
         gate_index = gate_index_;
         index_in_gate = index_in_gate_;
+        gate_group = gate_group_;
     }
 };
 std::vector<QubitGateSetting> gate_settings = std::vector<QubitGateSetting>({
     QubitGateSetting("..", standard_gate_index, 0),
     QubitGateSetting("H_", hadamar_gate_index, 0),
     QubitGateSetting("T_", phase_shift_gate_index, 0),
-    QubitGateSetting("CC", cnot_gate_index, 0),
-    QubitGateSetting("CT", cnot_gate_index, 1),
+    QubitGateSetting("M_", measure_gate_index, 0),
+    QubitGateSetting("R_", reset_gate_index, 0),
+    QubitGateSetting("CC", cnot_gate_index, 0, 0),
+    QubitGateSetting("CT", cnot_gate_index, 1, 0),
+    QubitGateSetting("CZ", cnot_gate_index, 2, 0),
+    QubitGateSetting("CM", cnot_gate_index, 3, 0),
+    QubitGateSetting("DC", cnot_gate_index, 0, 1),
+    QubitGateSetting("DT", cnot_gate_index, 1, 1),
+    QubitGateSetting("DZ", cnot_gate_index, 2, 1),
+    QubitGateSetting("DM", cnot_gate_index, 3, 1),
+    QubitGateSetting("EC", cnot_gate_index, 0, 2),
+    QubitGateSetting("ET", cnot_gate_index, 1, 2),
+    QubitGateSetting("EZ", cnot_gate_index, 2, 2),
+    QubitGateSetting("EM", cnot_gate_index, 3, 2),
 });
+const int MAX_GATE_GROUP_COUNT = 3; // How many controlled gates there can be in one operation
 
-// Returns -1 in case of error
-int run_hadamar(QubitSystem& qubit_system, std::vector<int> qubit_settings) {
-    for(int i = 0; i < qubit_settings.size(); i++) {
-        int gate_index = gate_settings[qubit_settings[i]].gate_index;
-        if(gate_index == hadamar_gate_index) {
-            qubit_system.hadamar(i);
+// Get the index in gate_settings of a gate/role combination, returns -1 if there is none
+int find_gate_setting(int gate_index, int index_in_gate, int gate_group = 0) {
+    for(int i = 0; i < gate_settings.size(); i++) {
+        const QubitGateSetting& setting = gate_settings[i];
+        if(setting.gate_index == gate_index && setting.index_in_gate == index_in_gate && setting.gate_group == gate_group) {
+            return i;
         }
     }
-    return 0;
+    return -1;
 }
-int run_phase_shift(QubitSystem& qubit_system, std::vector<int> qubit_settings) {
-    for(int i = 0; i < qubit_settings.size(); i++) {
-        int gate_index = gate_settings[qubit_settings[i]].gate_index;
-        if(gate_index == phase_shift_gate_index) {
-            qubit_system.phase_shift_pi_over_4(i);
-        }
+
+// Opcodes of the instructions in a compiled circuit
+const int op_hadamar = 0;
+const int op_phase_shift = 1; // Phase shift of pi/4, the T gate
+const int op_cnot = 2;
+const int op_phase = 3; // Phase shift of param radians, e.g. from merged T gates
+// Gates with any number of controls in control_mask, e.g. toffoli. With no controls they are the X and Z gates
+const int op_multi_controlled_x = 4;
+const int op_multi_controlled_z = 5;
+const int op_multi_controlled_phase = 6; // Phase shift of param radians
+const int op_measure = 7; // Measure target, the result is stored in classical_bit
+const int op_reset = 8; // Measure target and flip it to 0
+// Rotations of param radians around the x, y and z axis, exp(-i * param/2 * X) etc. They have no controls
+const int op_rx = 9;
+const int op_ry = 10;
+const int op_rz = 11;
+
+bool is_measurement_op(int op) {
+    return op == op_measure || op == op_reset;
+}
+bool is_rotation_op(int op) {
+    return op == op_rx || op == op_ry || op == op_rz;
+}
+
+/**
+ * A single gate in a compiled circuit
+*/
+struct GateInstruction {
+    int op = op_hadamar;
+    int target = 0; // The qubit the gate acts on
+    int control = -1; // Control qubit, only used by cnot
+    uint64_t control_mask = 0; // Control qubits of multi controlled gates, one bit per qubit
+    double param = 0; // Gate parameter, e.g. an angle
+    int classical_bit = -1; // Where a measurement is stored
+    // The gate is only applied if (classical bits & condition_mask) == condition_value
+    int condition_mask = 0;
+    int condition_value = 0;
+    // If set, the angle of a rotation is the parameter with this index in the circuit, bound when the circuit is run
+    int parameter_num = -1;
+};
+
+/**
+ * Get the matrix that the gate applies to its target when all controls are 1, matrix[row * 2 + column]
+ *   Measurements have no matrix and are left as the identity
+*/
+void get_single_qubit_matrix(const GateInstruction& instruction, std::complex<double>* matrix) {
+    matrix[0] = 1;
+    matrix[1] = 0;
+    matrix[2] = 0;
+    matrix[3] = 1;
+    switch(instruction.op) {
+        case op_hadamar:
+            matrix[0] = matrix[1] = matrix[2] = std::sqrt(0.5);
+            matrix[3] = -std::sqrt(0.5);
+            break;
+        case op_phase_shift:
+            matrix[3] = vicmil::exp_form_to_complex(1, vicmil::PI / 4);
+            break;
+        case op_cnot:
+        case op_multi_controlled_x:
+            matrix[0] = matrix[3] = 0;
+            matrix[1] = matrix[2] = 1;
+            break;
+        case op_multi_controlled_z:
+            matrix[3] = -1;
+            break;
+        case op_phase:
+        case op_multi_controlled_phase:
+            matrix[3] = vicmil::exp_form_to_complex(1, instruction.param);
+            break;
+        case op_rx:
+        case op_ry:
+        case op_rz:
+            QubitSystem::get_rotation_matrix(instruction.op - op_rx, instruction.param, matrix);
+            break;
+    }
+}
+
+/**
+ * Get the gate that undoes the gate, measurements can not be undone and are returned as they are
+*/
+GateInstruction get_inverse_instruction(GateInstruction instruction) {
+    if(instruction.op == op_phase_shift) {
+        instruction.op = op_phase;
+        instruction.param = -vicmil::PI / 4;
+    }
+    else if(instruction.op == op_phase || instruction.op == op_multi_controlled_phase || is_rotation_op(instruction.op)) {
+        instruction.param = -instruction.param;
+    }
+    return instruction; // The rest are their own inverse
+}
+
+bool is_condition_met(const QubitSystem& qubit_system, const GateInstruction& instruction) {
+    return (qubit_system._classical_bits & instruction.condition_mask) == instruction.condition_value;
+}
+
+// Run a measure or reset instruction, measurements are stored in the classical bits of the system
+void run_measurement(QubitSystem& qubit_system, const GateInstruction& instruction) {
+    if(!is_condition_met(qubit_system, instruction)) {
+        return;
+    }
+    if(instruction.op == op_reset) {
+        qubit_system.reset_qubit(instruction.target);
+        return;
+    }
+    int bit_mask = 1 << instruction.classical_bit;
+    if(qubit_system.measure(instruction.target)) {
+        qubit_system._classical_bits |= bit_mask;
+    }
+    else {
+        qubit_system._classical_bits &= ~bit_mask;
+    }
+}
+
+// Get a mask with a bit set for each qubit the gate uses
+uint64_t get_instruction_qubit_mask(const GateInstruction& instruction) {
+    uint64_t mask = ((uint64_t)1 << instruction.target) | instruction.control_mask;
+    if(instruction.control != -1) {
+        mask |= (uint64_t)1 << instruction.control;
+    }
+    return mask;
+}
+
+/**
+ * Add the gate to a layer of gates that are applied together, the condition of the gate is not checked
+ * Returns -1 if the gate uses a qubit that is already used in the layer, or is a measurement or rotation,
+ *   or uses qubit 31 or higher(the layer masks are int)
+*/
+int add_instruction_to_layer(GateLayer& layer, const GateInstruction& instruction) {
+    uint64_t qubit_mask = get_instruction_qubit_mask(instruction);
+    if((qubit_mask >> 31) != 0) {
+        return -1;
+    }
+    if(layer.qubits_used((int)qubit_mask) || is_measurement_op(instruction.op) || is_rotation_op(instruction.op)) {
+        return -1;
+    }
+    switch(instruction.op) {
+        case op_hadamar:
+            layer.add_hadamar(instruction.target);
+            break;
+        case op_phase_shift:
+            layer.add_phase_shift(instruction.target, vicmil::PI / 4);
+            break;
+        case op_cnot:
+            layer.add_cnot(instruction.control, instruction.target);
+            break;
+        case op_phase:
+            layer.add_phase_shift(instruction.target, instruction.param);
+            break;
+        case op_multi_controlled_x:
+            layer.add_multi_controlled_x(instruction.control_mask, instruction.target);
+            break;
+        case op_multi_controlled_z:
+            layer.add_multi_controlled_phase_shift(instruction.control_mask, instruction.target, vicmil::PI);
+            break;
+        case op_multi_controlled_phase:
+            layer.add_multi_controlled_phase_shift(instruction.control_mask, instruction.target, instruction.param);
+            break;
     }
     return 0;
 }
-int run_cnot(QubitSystem& qubit_system, std::vector<int> qubit_settings) {
-    // Find the control and target qubits!
-    std::vector<int> control_qubits = {};
-    std::vector<int> target_qubits = {};
+
+/**
+ * Get the gates in an operation(column), any combination of gates on different qubits is allowed
+ *   The qubits of a controlled gate are paired by their gate group, e.g. CC with CT and DC with DT
+ *   A controlled gate can have any number of controls, e.g. two CC and one CT is a toffoli gate
+ *   Classical controls(e.g. CM) make the gate depend on the last measurement of their qubits instead
+ * Returns -1 if a controlled gate is missing its controls or target, or has more than one target,
+ *   or a classical control is on a qubit without a classical bit(31 or higher)
+*/
+int get_operation_instructions(const std::vector<int>& qubit_settings, std::vector<GateInstruction>* instructions) {
+    uint64_t control_masks[MAX_GATE_GROUP_COUNT];
+    int condition_masks[MAX_GATE_GROUP_COUNT];
+    int target_qubits[MAX_GATE_GROUP_COUNT];
+    int target_index_in_gate[MAX_GATE_GROUP_COUNT];
+    for(int i = 0; i < MAX_GATE_GROUP_COUNT; i++) {
+        control_masks[i] = 0;
+        condition_masks[i] = 0;
+        target_qubits[i] = -1;
+    }
     for(int i = 0; i < qubit_settings.size(); i++) {
-        int gate_index = gate_settings[qubit_settings[i]].gate_index;
-        int index_in_gate = gate_settings[qubit_settings[i]].index_in_gate;
-        if(gate_index == cnot_gate_index && index_in_gate == 0) {
-            control_qubits.push_back(i);
+        const QubitGateSetting& setting = gate_settings[qubit_settings[i]];
+        GateInstruction instruction;
+        instruction.target = i;
+        if(setting.gate_index == hadamar_gate_index) {
+            instruction.op = op_hadamar;
+            instructions->push_back(instruction);
+        }
+        else if(setting.gate_index == phase_shift_gate_index) {
+            instruction.op = op_phase_shift;
+            instructions->push_back(instruction);
+        }
+        else if(setting.gate_index == measure_gate_index) {
+            instruction.op = op_measure;
+            instruction.classical_bit = i;
+            instructions->push_back(instruction);
+        }
+        else if(setting.gate_index == reset_gate_index) {
+            instruction.op = op_reset;
+            instructions->push_back(instruction);
         }
-        else if(gate_index == cnot_gate_index && index_in_gate == 1) {
-            target_qubits.push_back(i);
+        else if(setting.gate_index == cnot_gate_index && setting.index_in_gate == 0) {
+            control_masks[setting.gate_group] |= (uint64_t)1 << i;
+        }
+        else if(setting.gate_index == cnot_gate_index && setting.index_in_gate == 3) {
+            if(i >= 31) {
+                return -1; // There are only 31 classical bits
+            }
+            condition_masks[setting.gate_group] |= 1 << i;
+        }
+        else if(setting.gate_index == cnot_gate_index) {
+            if(target_qubits[setting.gate_group] != -1) {
+                return -1; // More than one target in gate
+            }
+            target_qubits[setting.gate_group] = i;
+            target_index_in_gate[setting.gate_group] = setting.index_in_gate;
         }
     }
-    if(control_qubits.size() != 1 || target_qubits.size() != 1) {
-        return -1; // Not the right amount of qubits in gate
+    for(int i = 0; i < MAX_GATE_GROUP_COUNT; i++) {
+        bool has_controls = control_masks[i] != 0 || condition_masks[i] != 0;
+        if(!has_controls && target_qubits[i] == -1) {
+            continue;
+        }
+        if(!has_controls || target_qubits[i] == -1) {
+            return -1; // Not the right amount of qubits in gate
+        }
+        GateInstruction instruction;
+        instruction.target = target_qubits[i];
+        instruction.condition_mask = condition_masks[i];
+        instruction.condition_value = condition_masks[i];
+        if(target_index_in_gate[i] == 2) {
+            instruction.op = op_multi_controlled_z;
+            instruction.control_mask = control_masks[i];
+        }
+        else if(vicmil::is_power_of_two(control_masks[i])) {
+            instruction.op = op_cnot;
+            instruction.control = std::log2(control_masks[i]);
+        }
+        else {
+            instruction.op = op_multi_controlled_x;
+            instruction.control_mask = control_masks[i];
+        }
+        instructions->push_back(instruction);
     }
-    qubit_system.cnot(control_qubits[0], target_qubits[0]);
     return 0;
 }
 
-// Get the op index from a list of qubits, returns -1 in case of conflict
-int get_gate_index(std::vector<int> qubit_settings) {
-    for(int i = 0; i < qubit_settings.size(); i++) {
-        int check_gate_index = gate_settings[qubit_settings[i]].gate_index;
-        if(check_gate_index != standard_gate_index) {
-            // Assert all other qubits are either that op index or standard
-            for(int j = 0; j < qubit_settings.size(); j++) {
-                int gate_index = gate_settings[qubit_settings[j]].gate_index;
-                if(gate_index != standard_gate_index && gate_index != check_gate_index) {
-                   return -1; // Conflict!
-                }
-            }
-            return check_gate_index;
+/**
+ * Apply all gates in the operation in one pass over the state, measurements are done after that
+ *   (They are on other qubits, so the order does not matter)
+ * Returns -1 in case of error
+*/
+int perform_operation(QubitSystem& qubit_system, std::vector<int> qubit_settings) {
+    std::vector<GateInstruction> instructions = {};
+    if(get_operation_instructions(qubit_settings, &instructions) != 0) {
+        return -1;
+    }
+    GateLayer layer;
+    for(int i = 0; i < instructions.size(); i++) {
+        if(is_condition_met(qubit_system, instructions[i])) {
+            add_instruction_to_layer(layer, instructions[i]);
+        }
+    }
+    qubit_system.apply_layer(layer);
+    for(int i = 0; i < instructions.size(); i++) {
+        if(is_measurement_op(instructions[i].op)) {
+            run_measurement(qubit_system, instructions[i]);
         }
     }
-    return standard_gate_index;
+    return 0;
 }
 
-int perform_operation(QubitSystem& qubit_system, std::vector<int> qubit_settings) {
-    int gate_index = get_gate_index(qubit_settings);
-    if(gate_index == -1) {
-        return -1; // Conflicting operation
+/**
+ * The circuit as a flat list of gates, the form used when running a circuit
+ *   Memory scales with the number of gates instead of qubits * operations, 
+ *   and each gate is dispatched directly without looking through the operation again
+*/
+class CompiledCircuit {
+public:
+    int qubit_count = 0;
+    int classical_bit_count = 0;
+    std::vector<GateInstruction> instructions = {};
+    std::vector<std::string> parameter_names = {}; // The parameters the rotation angles can be bound to
+
+    void add_instruction(int op, int target, int control = -1, double param = 0) {
+        GateInstruction instruction;
+        instruction.op = op;
+        instruction.target = target;
+        instruction.control = control;
+        instruction.param = param;
+        instructions.push_back(instruction);
+        qubit_count = std::max(qubit_count, std::max(target, control) + 1);
     }
-    if(gate_index == standard_gate_index) {
-        return 0; // No operations necessary!
+    void add_hadamar(int qubit_num) {
+        add_instruction(op_hadamar, qubit_num);
     }
-    if(gate_index == hadamar_gate_index) {
-        return run_hadamar(qubit_system, qubit_settings);
+    void add_phase_shift(int qubit_num) {
+        add_instruction(op_phase_shift, qubit_num);
     }
-    if(gate_index == phase_shift_gate_index) {
-        return run_phase_shift(qubit_system, qubit_settings);
+    void add_cnot(int control_qubit_num, int target_qubit_num) {
+        add_instruction(op_cnot, target_qubit_num, control_qubit_num);
     }
-    if(gate_index == cnot_gate_index) {
-        return run_cnot(qubit_system, qubit_settings);
+    void add_phase(int qubit_num, double phase) {
+        add_instruction(op_phase, qubit_num, -1, phase);
     }
-    return -1; // Unknown gate!
-}
+    void add_multi_controlled_gate(int op, const int* control_qubits, int control_count, int target_qubit_num, double param = 0) {
+        add_instruction(op, target_qubit_num, -1, param);
+        for(int i = 0; i < control_count; i++) {
+            instructions.back().control_mask |= (uint64_t)1 << control_qubits[i];
+            qubit_count = std::max(qubit_count, control_qubits[i] + 1);
+        }
+    }
+    void add_multi_controlled_gate(int op, const std::vector<int>& control_qubits, int target_qubit_num, double param = 0) {
+        add_multi_controlled_gate(op, control_qubits.data(), control_qubits.size(), target_qubit_num, param);
+    }
+    void add_multi_controlled_x(const std::vector<int>& control_qubits, int target_qubit_num) {
+        add_multi_controlled_gate(op_multi_controlled_x, control_qubits, target_qubit_num);
+    }
+    void add_multi_controlled_z(const std::vector<int>& control_qubits, int target_qubit_num) {
+        add_multi_controlled_gate(op_multi_controlled_z, control_qubits, target_qubit_num);
+    }
+    void add_multi_controlled_phase(const std::vector<int>& control_qubits, int target_qubit_num, double phase) {
+        add_multi_controlled_gate(op_multi_controlled_phase, control_qubits, target_qubit_num, phase);
+    }
+    void add_toffoli(int control_qubit_num1, int control_qubit_num2, int target_qubit_num) {
+        add_multi_controlled_x({control_qubit_num1, control_qubit_num2}, target_qubit_num);
+    }
+    /**
+     * Get the index of the parameter, it is added if the circuit does not have it yet
+    */
+    int get_parameter_num(const std::string& parameter_name) {
+        for(int i = 0; i < parameter_names.size(); i++) {
+            if(parameter_names[i] == parameter_name) {
+                return i;
+            }
+        }
+        parameter_names.push_back(parameter_name);
+        return parameter_names.size() - 1;
+    }
+    void add_rotation(int op, int qubit_num, double angle) {
+        add_instruction(op, qubit_num, -1, angle);
+    }
+    // A rotation with the angle bound to the parameter when the circuit is run
+    void add_rotation(int op, int qubit_num, const std::string& parameter_name) {
+        add_instruction(op, qubit_num);
+        instructions.back().parameter_num = get_parameter_num(parameter_name);
+    }
+    void add_rx(int qubit_num, double angle) {
+        add_rotation(op_rx, qubit_num, angle);
+    }
+    void add_rx(int qubit_num, const std::string& parameter_name) {
+        add_rotation(op_rx, qubit_num, parameter_name);
+    }
+    void add_ry(int qubit_num, double angle) {
+        add_rotation(op_ry, qubit_num, angle);
+    }
+    void add_ry(int qubit_num, const std::string& parameter_name) {
+        add_rotation(op_ry, qubit_num, parameter_name);
+    }
+    void add_rz(int qubit_num, double angle) {
+        add_rotation(op_rz, qubit_num, angle);
+    }
+    void add_rz(int qubit_num, const std::string& parameter_name) {
+        add_rotation(op_rz, qubit_num, parameter_name);
+    }
+    void add_measure(int qubit_num, int classical_bit_num) {
+        add_instruction(op_measure, qubit_num);
+        instructions.back().classical_bit = classical_bit_num;
+        classical_bit_count = std::max(classical_bit_count, classical_bit_num + 1);
+    }
+    void add_reset(int qubit_num) {
+        add_instruction(op_reset, qubit_num);
+    }
+    /**
+     * Make the last added gate only apply if the classical bits in condition_mask are equal to condition_value
+     *   e.g. set_condition(1 << 2, 1 << 2) to only apply it if classical bit 2 was measured as 1
+    */
+    void set_condition(int condition_mask, int condition_value) {
+        instructions.back().condition_mask = condition_mask;
+        instructions.back().condition_value = condition_value;
+        while((condition_mask >> classical_bit_count) != 0) {
+            classical_bit_count++;
+        }
+    }
+    int get_gate_count() const {
+        return instructions.size();
+    }
+    /**
+     * Get the circuit with the parameter values(by parameter index) put in as the rotation angles
+     * Returns -1 if there are too few values
+    */
+    int bind_parameters(const std::vector<double>& parameter_values, CompiledCircuit* bound_circuit) const {
+        if(parameter_values.size() < parameter_names.size()) {
+            return -1;
+        }
+        *bound_circuit = *this;
+        bound_circuit->parameter_names.clear();
+        for(int i = 0; i < bound_circuit->instructions.size(); i++) {
+            GateInstruction& instruction = bound_circuit->instructions[i];
+            if(instruction.parameter_num != -1) {
+                instruction.param = parameter_values[instruction.parameter_num];
+                instruction.parameter_num = -1;
+            }
+        }
+        return 0;
+    }
+    /**
+     * Get the parameter values by index from values by parameter name
+     * Returns -1 if a parameter of the circuit is missing
+    */
+    int get_parameter_values(const std::map<std::string, double>& parameters, std::vector<double>* parameter_values) const {
+        parameter_values->resize(parameter_names.size());
+        for(int i = 0; i < parameter_names.size(); i++) {
+            std::map<std::string, double>::const_iterator it = parameters.find(parameter_names[i]);
+            if(it == parameters.end()) {
+                return -1;
+            }
+            (*parameter_values)[i] = it->second;
+        }
+        return 0;
+    }
+    /**
+     * Check that all instructions are valid, so they can be run without any further checks
+     * Returns the index of the first invalid instruction, or -1 if all are valid
+    */
+    int find_invalid_instruction() const {
+        for(int i = 0; i < instructions.size(); i++) {
+            const GateInstruction& instruction = instructions[i];
+            if(instruction.target < 0 || instruction.target >= std::min(qubit_count, 64)) {
+                return i; // Qubit masks are 64 bit
+            }
+            if((instruction.condition_value & ~instruction.condition_mask) != 0 || (instruction.condition_mask >> classical_bit_count) != 0) {
+                return i;
+            }
+            if(instruction.parameter_num < -1 || instruction.parameter_num >= (int)parameter_names.size()) {
+                return i;
+            }
+            if(instruction.op == op_cnot) {
+                if(instruction.control < 0 || instruction.control >= std::min(qubit_count, 64) || instruction.control == instruction.target) {
+                    return i;
+                }
+            }
+            else if(instruction.op == op_multi_controlled_x || instruction.op == op_multi_controlled_z || instruction.op == op_multi_controlled_phase) {
+                bool outside_circuit = qubit_count < 64 && (instruction.control_mask >> qubit_count) != 0; // Shifting by 64 is undefined
+                if(outside_circuit || ((instruction.control_mask >> instruction.target) & 1)) {
+                    return i;
+                }
+            }
+            else if(instruction.op == op_measure) {
+                if(instruction.classical_bit < 0 || instruction.classical_bit >= std::min(classical_bit_count, 31)) {
+                    return i;
+                }
+            }
+            else if(is_rotation_op(instruction.op)) {
+                if(instruction.control != -1 || instruction.control_mask != 0) {
+                    return i;
+                }
+            }
+            else if(instruction.op != op_hadamar && instruction.op != op_phase_shift && instruction.op != op_phase && instruction.op != op_reset) {
+                return i; // Unknown gate!
+            }
+        }
+        return -1;
+    }
+    static void run_instruction(QubitSystem& qubit_system, const GateInstruction& instruction) {
+        if(!is_condition_met(qubit_system, instruction)) {
+            return;
+        }
+        switch(instruction.op) {
+            case op_hadamar:
+                qubit_system.hadamar(instruction.target);
+                break;
+            case op_phase_shift:
+                qubit_system.phase_shift_pi_over_4(instruction.target);
+                break;
+            case op_cnot:
+                qubit_system.cnot(instruction.control, instruction.target);
+                break;
+            case op_phase:
+                qubit_system.phase_shift(instruction.target, instruction.param);
+                break;
+            case op_multi_controlled_x:
+                qubit_system.multi_controlled_x(instruction.control_mask, instruction.target);
+                break;
+            case op_multi_controlled_z:
+                qubit_system.multi_controlled_z(instruction.control_mask, instruction.target);
+                break;
+            case op_multi_controlled_phase:
+                qubit_system.multi_controlled_phase_shift(instruction.control_mask, instruction.target, instruction.param);
+                break;
+            case op_rx:
+            case op_ry:
+            case op_rz:
+                qubit_system.rotation(instruction.op - op_rx, instruction.target, instruction.param);
+                break;
+            case op_measure:
+            case op_reset:
+                run_measurement(qubit_system, instruction);
+                break;
+        }
+    }
+    /**
+     * Run the gates from first_instruction_num up to the next measurement, consecutive gates on different qubits
+     *   are applied together in one pass over the state
+     * Returns the index of the measurement, or the number of instructions if there is none
+    */
+    int run_until_measurement(QubitSystem& qubit_system, int first_instruction_num) const {
+        GateLayer layer;
+        int i = first_instruction_num;
+        for(; i < instructions.size() && !is_measurement_op(instructions[i].op); i++) {
+            if(!is_condition_met(qubit_system, instructions[i])) {
+                continue;
+            }
+            if(add_instruction_to_layer(layer, instructions[i]) != 0) {
+                qubit_system.apply_layer(layer);
+                layer.clear();
+                if(add_instruction_to_layer(layer, instructions[i]) != 0) {
+                    run_instruction(qubit_system, instructions[i]); // Rotations are not combined with other gates
+                }
+            }
+        }
+        qubit_system.apply_layer(layer);
+        return i;
+    }
+    /**
+     * Run the circuit, consecutive gates on different qubits are applied together in one pass over the state
+     *   Measurements end the current layer, so the conditions of later gates can be checked when they are reached
+     *   Rotations that are bound to parameters use param, see bind_parameters
+     * Returns -1 in case of error
+    */
+    int run(QubitSystem& qubit_system) const {
+        if(qubit_count > qubit_system._qubit_count) {
+            return -1; // Not enough qubits in system
+        }
+        int i = run_until_measurement(qubit_system, 0);
+        while(i < instructions.size()) {
+            run_measurement(qubit_system, instructions[i]);
+            i = run_until_measurement(qubit_system, i + 1);
+        }
+        return 0;
+    }
+    /**
+     * Run the circuit with the rotation angles bound to the parameters by name
+     * Returns -1 in case of error, e.g. a missing parameter
+    */
+    int run(QubitSystem& qubit_system, const std::map<std::string, double>& parameters) const {
+        std::vector<double> parameter_values;
+        CompiledCircuit bound_circuit;
+        if(get_parameter_values(parameters, &parameter_values) != 0 || bind_parameters(parameter_values, &bound_circuit) != 0) {
+            return -1;
+        }
+        return bound_circuit.run(qubit_system);
+    }
+};
 
 class QuantumCircuit {
     std::vector<std::vector<int>> qubit_settings = {}; // qubit_settings[operation_num][qubit_num]
@@ -120,6 +625,16 @@ public:
         }
         qubit_settings[operation_num][qubit_num] = setting;
     }
+    /**
+     * Append a whole operation(column) at the end of the circuit, 
+     *   much faster than setting the qubits one by one when building large circuits
+    */
+    void push_operation(const std::vector<int>& operation_qubit_settings) {
+        qubit_settings.push_back(operation_qubit_settings);
+        while(qubit_settings.back().size() > 0 && qubit_settings.back().back() == 0) {
+            qubit_settings.back().pop_back();
+        }
+    }
     int get_qubit_setting(int qubit_num, int operation_num) {
         if(operation_num >= qubit_settings.size()) {
             return 0;
@@ -175,5 +690,243 @@ public:
         return perform_operation(qubit_system, get_operation_qubit_settings(operation_num));
         // return 0; 
     }
+    /**
+     * Convert the circuit to a flat list of gates, each operation is validated once here
+     * Returns -1 in case of error, failed_operation_num is then set to the operation with the error
+    */
+    int compile(CompiledCircuit* compiled_circuit, int* failed_operation_num = nullptr) {
+        compiled_circuit->instructions.clear();
+        compiled_circuit->qubit_count = get_qubit_count();
+        compiled_circuit->classical_bit_count = get_qubit_count(); // Each qubit has its own classical bit
+        for(int operation_num = 0; operation_num < qubit_settings.size(); operation_num++) {
+            if(get_operation_instructions(qubit_settings[operation_num], &compiled_circuit->instructions) != 0) {
+                if(failed_operation_num != nullptr) {
+                    *failed_operation_num = operation_num;
+                }
+                return -1;
+            }
+        }
+        return 0;
+    }
+    /**
+     * Create a circuit from a compiled one, the gates are packed into as few operations as possible
+     *   a new operation is started when a gate can not share the operation with the gates already there
+     * Phase gates become T gates, so they should be multiples of pi/4
+     * Returns -1 if a gate can not be shown in a circuit, e.g. a controlled gate without controls
+     *   or a measurement that is not stored in the classical bit of its qubit
+    */
+    static int from_compiled(const CompiledCircuit& compiled_circuit, QuantumCircuit* circuit) {
+        *circuit = QuantumCircuit();
+        std::vector<int> operation = std::vector<int>(compiled_circuit.qubit_count, 0);
+        bool operation_empty = true;
+        int controlled_gate_count = 0;
+        for(int i = 0; i < compiled_circuit.instructions.size(); i++) {
+            GateInstruction instruction = compiled_circuit.instructions[i];
+            int repeat_count = 1;
+            if(instruction.op == op_phase) {
+                repeat_count = (int)std::round(vicmil::modulo(instruction.param, 2 * vicmil::PI) / (vicmil::PI / 4)) % 8;
+                instruction.op = op_phase_shift;
+            }
+            if(instruction.op == op_cnot) {
+                instruction.op = op_multi_controlled_x;
+                instruction.control_mask = (uint64_t)1 << instruction.control;
+            }
+            if(instruction.op == op_multi_controlled_phase && std::abs(vicmil::modulo(instruction.param, 2 * vicmil::PI) - vicmil::PI) < 0.000000001) {
+                instruction.op = op_multi_controlled_z;
+            }
+            bool controlled = instruction.op == op_multi_controlled_x || instruction.op == op_multi_controlled_z;
+            if(instruction.op == op_multi_controlled_phase || is_rotation_op(instruction.op) || (controlled && instruction.control_mask == 0 && instruction.condition_mask == 0)) {
+                return -1;
+            }
+            if(instruction.condition_mask != 0) {
+                // Classical controls are only shown for the classical bit of a qubit, that is set to 1
+                uint64_t used_mask = get_instruction_qubit_mask(instruction);
+                bool shown = controlled && instruction.condition_value == instruction.condition_mask;
+                if(!shown || (instruction.condition_mask & used_mask) != 0 || (instruction.condition_mask >> compiled_circuit.qubit_count) != 0) {
+                    return -1;
+                }
+            }
+            if(instruction.op == op_measure && instruction.classical_bit != instruction.target) {
+                return -1;
+            }
+            uint64_t cell_mask = get_instruction_qubit_mask(instruction) | (uint32_t)instruction.condition_mask; // Classical controls also use a cell
+            for(int j = 0; j < repeat_count; j++) {
+                bool conflict = false;
+                for(int k = 0; k < operation.size(); k++) {
+                    if(((cell_mask >> k) & 1) && operation[k] != 0) {
+                        conflict = true;
+                    }
+                }
+                if(controlled && controlled_gate_count == MAX_GATE_GROUP_COUNT) {
+                    conflict = true;
+                }
+                if(conflict) {
+                    circuit->push_operation(operation);
+                    std::fill(operation.begin(), operation.end(), 0);
+                    controlled_gate_count = 0;
+                }
+                if(controlled) {
+                    for(int k = 0; k < operation.size(); k++) {
+                        if((instruction.control_mask >> k) & 1) {
+                            operation[k] = find_gate_setting(cnot_gate_index, 0, controlled_gate_count);
+                        }
+                        if((instruction.condition_mask >> k) & 1) {
+                            operation[k] = find_gate_setting(cnot_gate_index, 3, controlled_gate_count);
+                        }
+                    }
+                    int index_in_gate = instruction.op == op_multi_controlled_z ? 2 : 1;
+                    operation[instruction.target] = find_gate_setting(cnot_gate_index, index_in_gate, controlled_gate_count);
+                    controlled_gate_count++;
+                }
+                else if(instruction.op == op_hadamar) {
+                    operation[instruction.target] = find_gate_setting(hadamar_gate_index, 0);
+                }
+                else if(instruction.op == op_measure) {
+                    operation[instruction.target] = find_gate_setting(measure_gate_index, 0);
+                }
+                else if(instruction.op == op_reset) {
+                    operation[instruction.target] = find_gate_setting(reset_gate_index, 0);
+                }
+                else {
+                    operation[instruction.target] = find_gate_setting(phase_shift_gate_index, 0);
+                }
+                operation_empty = false;
+            }
+        }
+        if(!operation_empty) {
+            circuit->push_operation(operation);
+        }
+        return 0;
+    }
 };
+
+void TEST_perform_operation() {
+    // Gates of all kinds in the same operation should give the same result as applying them one by one
+    std::vector<int> operation = {
+        find_gate_setting(hadamar_gate_index, 0),
+        find_gate_setting(cnot_gate_index, 1, 1),
+        find_gate_setting(phase_shift_gate_index, 0),
+        find_gate_setting(cnot_gate_index, 0, 0),
+        find_gate_setting(hadamar_gate_index, 0),
+        find_gate_setting(cnot_gate_index, 0, 1),
+        find_gate_setting(cnot_gate_index, 1, 0),
+    };
+    QubitSystem system1 = QubitSystem(7);
+    for(int i = 0; i < 7; i++) {
+        system1.hadamar(i);
+        system1.phase_shift(i, i * 0.3);
+    }
+    QubitSystem system2 = system1;
+    assert(perform_operation(system1, operation) == 0);
+    system2.hadamar(0);
+    system2.cnot(5, 1);
+    system2.phase_shift_pi_over_4(2);
+    system2.cnot(3, 6);
+    system2.hadamar(4);
+    for(int i = 0; i < system1._qubit_states.size(); i++) {
+        assert(std::abs(system1._qubit_states[i].v - system2._qubit_states[i].v) < 0.000001);
+    }
+
+    // A cnot without its target is an error
+    operation[1] = 0;
+    assert(perform_operation(system1, operation) == -1);
+}
+AddTest(TEST_perform_operation);
+
+void TEST_multi_controlled_gates() {
+    // A toffoli(CC, CC, CT) and a controlled z with two controls(DC, DC, DZ) in the same operation
+    std::vector<int> operation = {
+        find_gate_setting(cnot_gate_index, 0, 0),
+        find_gate_setting(cnot_gate_index, 0, 1),
+        find_gate_setting(cnot_gate_index, 1, 0),
+        find_gate_setting(cnot_gate_index, 0, 0),
+        find_gate_setting(cnot_gate_index, 2, 1),
+        find_gate_setting(cnot_gate_index, 0, 1),
+    };
+    QubitSystem system = QubitSystem(6);
+    for(int i = 0; i < 6; i++) {
+        system.hadamar(i);
+        system.phase_shift(i, i * 0.3); // Make the states different
+    }
+    std::vector<std::complex<double>> expected_states = std::vector<std::complex<double>>(system._qubit_states.size());
+    for(int i = 0; i < expected_states.size(); i++) {
+        int toffoli_controls = (1 << 0) | (1 << 3);
+        int z_controls = (1 << 1) | (1 << 5);
+        int flipped_i = (i & toffoli_controls) == toffoli_controls ? i ^ (1 << 2) : i;
+        expected_states[flipped_i] = system._qubit_states[i].v;
+        if((flipped_i & z_controls) == z_controls && (flipped_i & (1 << 4))) {
+            expected_states[flipped_i] *= -1;
+        }
+    }
+    assert(perform_operation(system, operation) == 0);
+    for(int i = 0; i < expected_states.size(); i++) {
+        assert(std::abs(system._qubit_states[i].v - expected_states[i]) < 0.000001);
+    }
+
+    // A target without controls, or two targets in the same gate, is an error
+    std::vector<GateInstruction> instructions;
+    assert(get_operation_instructions({find_gate_setting(cnot_gate_index, 2, 2)}, &instructions) == -1);
+    assert(get_operation_instructions({
+        find_gate_setting(cnot_gate_index, 1, 0),
+        find_gate_setting(cnot_gate_index, 0, 0),
+        find_gate_setting(cnot_gate_index, 2, 0)}, &instructions) == -1);
+
+    // Controls above qubit 31 keep their own bit
+    CompiledCircuit wide_circuit;
+    wide_circuit.add_multi_controlled_z({40}, 1);
+    assert(wide_circuit.instructions[0].control_mask == (uint64_t)1 << 40);
+    assert(wide_circuit.find_invalid_instruction() == -1);
+    wide_circuit.qubit_count = 40;
+    assert(wide_circuit.find_invalid_instruction() == 0);
+    GateLayer wide_layer; // The layer masks only have room for 31 qubits
+    assert(add_instruction_to_layer(wide_layer, wide_circuit.instructions[0]) == -1);
+    assert(wide_layer.get_gate_count() == 0);
+}
+AddTest(TEST_multi_controlled_gates);
+
+void TEST_teleportation() {
+    // Teleport the state H*T*H|0> from qubit 0 to qubit 2, using mid circuit measurements and classical controls
+    int H = find_gate_setting(hadamar_gate_index, 0);
+    int T = find_gate_setting(phase_shift_gate_index, 0);
+    int M = find_gate_setting(measure_gate_index, 0);
+    int R = find_gate_setting(reset_gate_index, 0);
+    int CC = find_gate_setting(cnot_gate_index, 0);
+    int CT = find_gate_setting(cnot_gate_index, 1);
+    int CZ = find_gate_setting(cnot_gate_index, 2);
+    int CM = find_gate_setting(cnot_gate_index, 3);
+    QuantumCircuit circuit;
+    circuit.push_operation({H, H});
+    circuit.push_operation({T, CC, CT});
+    circuit.push_operation({H, 0, 0});
+    circuit.push_operation({CC, CT, 0});
+    circuit.push_operation({H, 0, 0});
+    circuit.push_operation({M, M, 0});
+    circuit.push_operation({0, CM, CT}); // X if qubit 1 was measured as 1
+    circuit.push_operation({CM, 0, CZ}); // Z if qubit 0 was measured as 1
+    circuit.push_operation({R, R, 0});
+    CompiledCircuit compiled_circuit;
+    assert(circuit.compile(&compiled_circuit) == 0);
+
+    std::complex<double> w = vicmil::exp_form_to_complex(1, vicmil::PI / 4);
+    std::complex<double> expected_0 = (1.0 + w) / 2.0;
+    std::complex<double> expected_1 = (1.0 - w) / 2.0;
+    for(int i = 0; i < 20; i++) {
+        QubitSystem system1 = QubitSystem(3);
+        QubitSystem system2 = QubitSystem(3);
+        assert(compiled_circuit.run(system1) == 0);
+        for(int j = 0; j < circuit.get_operations_count(); j++) {
+            assert(circuit.run_operation(system2, j) == 0);
+        }
+        QubitSystem* systems[2] = {&system1, &system2};
+        for(int j = 0; j < 2; j++) {
+            // Qubits 0 and 1 are reset, qubit 2 has the state
+            std::complex<double> state_0 = systems[j]->get_amplitude(0);
+            std::complex<double> state_1 = systems[j]->get_amplitude(4);
+            assert(std::abs(std::abs(state_0) - std::abs(expected_0)) < 0.000001);
+            assert(std::abs(state_0 * expected_1 - state_1 * expected_0) < 0.000001);
+            assert(std::abs(systems[j]->get_total_probability() - 1) < 0.000001);
+        }
+    }
+}
+AddTest(TEST_teleportation);
 }
\ No newline at end of file
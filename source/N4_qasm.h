@@ -0,0 +1,916 @@
+#pragma once
+#include "N3_interface.h"
+#include <cstring>
+#include <cstdio>
+
+namespace qubit_circuit {
+
+/**
+ * Reading and writing circuits as OpenQASM 2
+ *
+ * Only a subset of the language is supported:
+ *   OPENQASM, include, qreg, creg, h, t, tdg, s, sdg, x, z, rx, ry, rz, cx, cz, ccx, measure, reset, if, barrier
+ *   The angle of a rotation is an expression of numbers and pi, or a single name of a parameter
+ *   that is bound when the circuit is run, e.g. rx(theta) q[0];
+ *
+ * The parser is streaming, it can be fed the file in chunks of any size and only keeps the
+ *   statement it is currently reading in memory, so even huge generated files are read in a single pass.
+ *   No regex is used, statements are tokenized by hand. Gates are added directly to a CompiledCircuit
+*/
+
+struct QasmRegister {
+    std::string name;
+    int offset = 0; // Where the register starts in the flat qubit/bit numbering
+    int size = 0;
+};
+
+struct QasmMeasurement {
+    int qubit = 0;
+    int classical_bit = 0;
+};
+
+class QasmParser {
+    // Parse state that has to survive between chunks
+    std::string _statement = ""; // The statement read so far(without comments)
+    bool _in_comment = false;
+    bool _pending_slash = false; // Last char of previous chunk was a '/'
+    int _line_num = 1;
+    int _statement_line_num = 1;
+    std::vector<bool> _measured = {}; // The qubit has a measurement in measurements
+    int _condition_mask = 0; // Condition of the if statement that is being parsed
+    int _condition_value = 0;
+
+public:
+    CompiledCircuit circuit = CompiledCircuit();
+    std::vector<QasmRegister> quantum_registers = {};
+    std::vector<QasmRegister> classical_registers = {};
+    // Measurements at the end of the circuit, measurements that later gates depend on are moved into the circuit
+    std::vector<QasmMeasurement> measurements = {};
+    int qubit_count = 0;
+    int classical_bit_count = 0;
+    std::string error_str = "";
+
+    /**
+     * Feed the next chunk of the file to the parser
+     * Returns -1 in case of error, see error_str for what went wrong
+    */
+    int feed(const char* data, size_t size) {
+        for(size_t i = 0; i < size; i++) {
+            char c = data[i];
+            if(c == '\n') {
+                _line_num++;
+            }
+            if(_in_comment) {
+                if(c == '\n') {
+                    _in_comment = false;
+                }
+                continue;
+            }
+            if(_pending_slash) {
+                _pending_slash = false;
+                if(c == '/') {
+                    _in_comment = true;
+                    continue;
+                }
+                _statement.push_back('/');
+            }
+            if(c == '/') {
+                _pending_slash = true;
+                continue;
+            }
+            if(c == ';') {
+                if(_parse_statement(_statement.data(), _statement.data() + _statement.size()) != 0) {
+                    return -1;
+                }
+                _statement.clear();
+                continue;
+            }
+            if(_statement.size() == 0) {
+                if(_is_space(c)) {
+                    continue; // Skip leading whitespace
+                }
+                _statement_line_num = _line_num;
+            }
+            _statement.push_back(c);
+        }
+        return 0;
+    }
+    /**
+     * Call when there is no more data
+     * Returns -1 in case of error
+    */
+    int finish() {
+        if(_pending_slash) {
+            _pending_slash = false;
+            _statement.push_back('/');
+        }
+        for(int i = 0; i < _statement.size(); i++) {
+            if(!_is_space(_statement[i])) {
+                return _error("Missing ';' at end of file");
+            }
+        }
+        return 0;
+    }
+
+private:
+    static bool _is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+    static bool _is_identifier_char(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+    }
+    static const char* _skip_space(const char* p, const char* end) {
+        while(p < end && _is_space(*p)) {
+            p++;
+        }
+        return p;
+    }
+    int _error(std::string message) {
+        error_str = "line " + std::to_string(_statement_line_num) + ": " + message;
+        return -1;
+    }
+    // Read an identifier, returns nullptr if there is none
+    static const char* _read_identifier(const char* p, const char* end, const char** id_start) {
+        p = _skip_space(p, end);
+        *id_start = p;
+        while(p < end && _is_identifier_char(*p)) {
+            p++;
+        }
+        if(p == *id_start) {
+            return nullptr;
+        }
+        return p;
+    }
+    static const char* _read_int(const char* p, const char* end, int* value) {
+        p = _skip_space(p, end);
+        if(p == end || *p < '0' || *p > '9') {
+            return nullptr;
+        }
+        int64_t v = 0;
+        while(p < end && *p >= '0' && *p <= '9') {
+            v = v * 10 + (*p - '0');
+            if(v > (1 << 30)) {
+                return nullptr;
+            }
+            p++;
+        }
+        *value = v;
+        return p;
+    }
+    static const char* _expect_char(const char* p, const char* end, char c) {
+        p = _skip_space(p, end);
+        if(p == end || *p != c) {
+            return nullptr;
+        }
+        return p + 1;
+    }
+    static bool _equals(const char* begin, const char* end, const char* str) {
+        size_t len = end - begin;
+        return std::strlen(str) == len && std::memcmp(begin, str, len) == 0;
+    }
+    static int _find_register(const std::vector<QasmRegister>& registers, const char* begin, const char* end) {
+        for(int i = 0; i < registers.size(); i++) {
+            if(registers[i].name.size() == end - begin && std::memcmp(registers[i].name.data(), begin, end - begin) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * Read a register argument, either "name[index]" or "name" for the whole register
+     * first and count is set to the range of flat indices it refers to
+    */
+    const char* _read_argument(const char* p, const char* end, const std::vector<QasmRegister>& registers, int* first, int* count) {
+        const char* id_start;
+        p = _read_identifier(p, end, &id_start);
+        if(p == nullptr) {
+            return nullptr;
+        }
+        int register_index = _find_register(registers, id_start, p);
+        if(register_index == -1) {
+            _error("Unknown register '" + std::string(id_start, p) + "'");
+            return nullptr;
+        }
+        const QasmRegister& reg = registers[register_index];
+        const char* bracket = _expect_char(p, end, '[');
+        if(bracket == nullptr) {
+            *first = reg.offset;
+            *count = reg.size;
+            return p;
+        }
+        int index;
+        p = _read_int(bracket, end, &index);
+        if(p == nullptr) {
+            return nullptr;
+        }
+        p = _expect_char(p, end, ']');
+        if(p == nullptr) {
+            return nullptr;
+        }
+        if(index >= reg.size) {
+            _error("Index out of range for register '" + reg.name + "'");
+            return nullptr;
+        }
+        *first = reg.offset + index;
+        *count = 1;
+        return p;
+    }
+    int _expect_end(const char* p, const char* end) {
+        p = _skip_space(p, end);
+        if(p != end) {
+            return _error("Unexpected '" + std::string(p, end) + "'");
+        }
+        return 0;
+    }
+
+    int _add_register(const char* p, const char* end, std::vector<QasmRegister>& registers, int* total_size) {
+        const char* id_start;
+        p = _read_identifier(p, end, &id_start);
+        if(p == nullptr) {
+            return _error("Expected register name");
+        }
+        QasmRegister reg;
+        reg.name = std::string(id_start, p);
+        if(_find_register(registers, id_start, p) != -1) {
+            return _error("Register '" + reg.name + "' is already declared");
+        }
+        p = _expect_char(p, end, '[');
+        if(p != nullptr) {
+            p = _read_int(p, end, &reg.size);
+        }
+        if(p != nullptr) {
+            p = _expect_char(p, end, ']');
+        }
+        if(p == nullptr) {
+            return _error("Expected register size");
+        }
+        reg.offset = *total_size;
+        *total_size += reg.size;
+        registers.push_back(reg);
+        return _expect_end(p, end);
+    }
+
+    static bool _find_single_qubit_gate(const char* begin, const char* end, int* op, double* param) {
+        *param = 0;
+        if(_equals(begin, end, "h")) {
+            *op = op_hadamar;
+            return true;
+        }
+        if(_equals(begin, end, "t")) {
+            *op = op_phase_shift;
+            return true;
+        }
+        if(_equals(begin, end, "x")) {
+            *op = op_multi_controlled_x; // Without controls
+            return true;
+        }
+        // The other phase gates are multiples of T
+        *op = op_phase;
+        if(_equals(begin, end, "tdg")) {
+            *param = -vicmil::PI / 4;
+            return true;
+        }
+        if(_equals(begin, end, "s")) {
+            *param = vicmil::PI / 2;
+            return true;
+        }
+        if(_equals(begin, end, "sdg")) {
+            *param = -vicmil::PI / 2;
+            return true;
+        }
+        if(_equals(begin, end, "z")) {
+            *param = vicmil::PI;
+            return true;
+        }
+        return false;
+    }
+    static int _find_rotation_gate(const char* begin, const char* end) {
+        if(_equals(begin, end, "rx")) {
+            return op_rx;
+        }
+        if(_equals(begin, end, "ry")) {
+            return op_ry;
+        }
+        if(_equals(begin, end, "rz")) {
+            return op_rz;
+        }
+        return -1;
+    }
+    // Read a number, pi, a negated factor or an expression in parentheses
+    static const char* _read_factor(const char* p, const char* end, double* value) {
+        p = _skip_space(p, end);
+        if(p == end) {
+            return nullptr;
+        }
+        if(*p == '-') {
+            p = _read_factor(p + 1, end, value);
+            *value = -*value;
+            return p;
+        }
+        if(*p == '(') {
+            p = _read_expression(p + 1, end, value);
+            return p == nullptr ? nullptr : _expect_char(p, end, ')');
+        }
+        const char* id_start;
+        const char* id_end = _read_identifier(p, end, &id_start);
+        if(id_end != nullptr && _equals(id_start, id_end, "pi")) {
+            *value = vicmil::PI;
+            return id_end;
+        }
+        // A number, e.g. 1.5 or 2e-3
+        const char* number_start = p;
+        while(p < end && ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E' ||
+            ((*p == '-' || *p == '+') && p > number_start && (p[-1] == 'e' || p[-1] == 'E')))) {
+            p++;
+        }
+        std::string number_str = std::string(number_start, p);
+        char* number_end = nullptr;
+        *value = std::strtod(number_str.c_str(), &number_end);
+        if(number_str.size() == 0 || number_end != number_str.c_str() + number_str.size()) {
+            return nullptr;
+        }
+        return p;
+    }
+    static const char* _read_term(const char* p, const char* end, double* value) {
+        p = _read_factor(p, end, value);
+        while(p != nullptr) {
+            const char* operator_p = _skip_space(p, end);
+            if(operator_p == end || (*operator_p != '*' && *operator_p != '/')) {
+                break;
+            }
+            double factor;
+            p = _read_factor(operator_p + 1, end, &factor);
+            *value = *operator_p == '*' ? *value * factor : *value / factor;
+        }
+        return p;
+    }
+    // Read an angle expression of numbers, pi, + - * / and parentheses, returns nullptr if it is not valid
+    static const char* _read_expression(const char* p, const char* end, double* value) {
+        p = _read_term(p, end, value);
+        while(p != nullptr) {
+            const char* operator_p = _skip_space(p, end);
+            if(operator_p == end || (*operator_p != '+' && *operator_p != '-')) {
+                break;
+            }
+            double term;
+            p = _read_term(operator_p + 1, end, &term);
+            *value = *operator_p == '+' ? *value + term : *value - term;
+        }
+        return p;
+    }
+    int _parse_rotation(int op, const char* p, const char* end) {
+        p = _expect_char(p, end, '(');
+        if(p == nullptr) {
+            return _error("Expected '(' after rotation gate");
+        }
+        // A single name other than pi is a parameter
+        std::string parameter_name = "";
+        double angle = 0;
+        const char* id_start;
+        const char* id_end = _read_identifier(p, end, &id_start);
+        const char* parameter_p = id_end == nullptr ? nullptr : _expect_char(id_end, end, ')');
+        if(parameter_p != nullptr && !_equals(id_start, id_end, "pi") && !(*id_start >= '0' && *id_start <= '9')) {
+            parameter_name = std::string(id_start, id_end);
+            p = parameter_p;
+        }
+        else {
+            p = _read_expression(p, end, &angle);
+            if(p != nullptr) {
+                p = _expect_char(p, end, ')');
+            }
+            if(p == nullptr) {
+                return _error("Expected angle expression");
+            }
+        }
+        int first, count;
+        p = _read_argument(p, end, quantum_registers, &first, &count);
+        if(p == nullptr) {
+            return error_str.size() ? -1 : _error("Expected qubit argument");
+        }
+        if(_expect_end(p, end) != 0) {
+            return -1;
+        }
+        for(int i = first; i < first + count; i++) {
+            _before_gate(&i, 1);
+            if(parameter_name.size() > 0) {
+                circuit.add_rotation(op, i, parameter_name);
+            }
+            else {
+                circuit.add_rotation(op, i, angle);
+            }
+            _after_gate();
+        }
+        return 0;
+    }
+    /**
+     * Move the measurements so far into the circuit, so they are done before the next gate
+     *   They commute with the gates in between since those are on other qubits
+    */
+    void _move_measurements_to_circuit() {
+        for(int i = 0; i < measurements.size(); i++) {
+            circuit.add_measure(measurements[i].qubit, measurements[i].classical_bit);
+            _measured[measurements[i].qubit] = false;
+        }
+        measurements.clear();
+    }
+    // Call before adding a gate on the qubits, to make sure measurements it depends on are in the circuit
+    void _before_gate(const int* qubits, int gate_qubit_count) {
+        bool depends_on_measurement = _condition_mask != 0 && measurements.size() > 0;
+        for(int i = 0; i < gate_qubit_count; i++) {
+            depends_on_measurement = depends_on_measurement || _measured[qubits[i]];
+        }
+        if(depends_on_measurement) {
+            _move_measurements_to_circuit();
+        }
+    }
+    void _after_gate() {
+        if(_condition_mask != 0) {
+            circuit.set_condition(_condition_mask, _condition_value);
+        }
+    }
+    int _add_single_qubit_gate(int qubit, int op, double param) {
+        _before_gate(&qubit, 1);
+        if(op == op_reset) {
+            circuit.add_reset(qubit);
+        }
+        else {
+            circuit.add_instruction(op, qubit, -1, param);
+        }
+        _after_gate();
+        return 0;
+    }
+    static bool _find_controlled_gate(const char* begin, const char* end, int* op, int* control_count) {
+        *control_count = 1;
+        if(_equals(begin, end, "cx") || _equals(begin, end, "CX")) {
+            *op = op_cnot;
+            return true;
+        }
+        if(_equals(begin, end, "cz")) {
+            *op = op_multi_controlled_z;
+            return true;
+        }
+        *control_count = 2;
+        if(_equals(begin, end, "ccx")) {
+            *op = op_multi_controlled_x;
+            return true;
+        }
+        return false;
+    }
+    // The last of the qubits is the target, the rest are controls
+    int _add_controlled_gate(int op, const int* qubits, int gate_qubit_count) {
+        int target_qubit = qubits[gate_qubit_count - 1];
+        for(int i = 0; i < gate_qubit_count; i++) {
+            for(int j = 0; j < i; j++) {
+                if(qubits[i] == qubits[j]) {
+                    return _error("Qubits of a controlled gate must differ");
+                }
+            }
+        }
+        _before_gate(qubits, gate_qubit_count);
+        if(op == op_cnot) {
+            circuit.add_cnot(qubits[0], target_qubit);
+        }
+        else {
+            circuit.add_multi_controlled_gate(op, qubits, gate_qubit_count - 1, target_qubit);
+        }
+        _after_gate();
+        return 0;
+    }
+
+    int _parse_statement(const char* p, const char* end) {
+        const char* id_start;
+        p = _read_identifier(p, end, &id_start);
+        if(p == nullptr) {
+            if(_skip_space(id_start, end) == end) {
+                return 0; // Empty statement
+            }
+            return _error("Expected statement");
+        }
+        if(_equals(id_start, p, "OPENQASM")) {
+            p = _skip_space(p, end);
+            if(p == end || *p != '2') {
+                return _error("Only OPENQASM 2 is supported");
+            }
+            return 0;
+        }
+        if(_equals(id_start, p, "include")) {
+            return 0; // The gates we support are all in qelib1.inc
+        }
+        if(_equals(id_start, p, "qreg")) {
+            if(_add_register(p, end, quantum_registers, &qubit_count) != 0) {
+                return -1;
+            }
+            if(qubit_count > 64) {
+                return _error("At most 64 qubits are supported");
+            }
+            circuit.qubit_count = qubit_count;
+            _measured.resize(qubit_count, false);
+            return 0;
+        }
+        if(_equals(id_start, p, "creg")) {
+            if(_add_register(p, end, classical_registers, &classical_bit_count) != 0) {
+                return -1;
+            }
+            if(classical_bit_count > 31) {
+                return _error("At most 31 classical bits are supported");
+            }
+            circuit.classical_bit_count = classical_bit_count;
+            return 0;
+        }
+        if(_equals(id_start, p, "if")) {
+            return _parse_if_statement(p, end);
+        }
+        if(_equals(id_start, p, "barrier")) {
+            return 0;
+        }
+        int rotation_op = _find_rotation_gate(id_start, p);
+        if(rotation_op != -1) {
+            return _parse_rotation(rotation_op, p, end);
+        }
+        int single_qubit_op;
+        double single_qubit_param = 0;
+        bool is_reset = _equals(id_start, p, "reset");
+        if(is_reset) {
+            single_qubit_op = op_reset;
+        }
+        if(is_reset || _find_single_qubit_gate(id_start, p, &single_qubit_op, &single_qubit_param)) {
+            int first, count;
+            p = _read_argument(p, end, quantum_registers, &first, &count);
+            if(p == nullptr) {
+                return error_str.size() ? -1 : _error("Expected qubit argument");
+            }
+            if(_expect_end(p, end) != 0) {
+                return -1;
+            }
+            for(int i = first; i < first + count; i++) {
+                if(_add_single_qubit_gate(i, single_qubit_op, single_qubit_param) != 0) {
+                    return -1;
+                }
+            }
+            return 0;
+        }
+        int controlled_op, control_count;
+        if(_find_controlled_gate(id_start, p, &controlled_op, &control_count)) {
+            std::string gate_name = std::string(id_start, p);
+            // Arguments are the controls followed by the target, whole registers are applied element wise
+            int argument_count = control_count + 1;
+            int firsts[3]; // At most ccx
+            int counts[3];
+            int count = 1;
+            for(int i = 0; i < argument_count && p != nullptr; i++) {
+                if(i != 0) {
+                    p = _expect_char(p, end, ',');
+                }
+                if(p != nullptr) {
+                    p = _read_argument(p, end, quantum_registers, &firsts[i], &counts[i]);
+                }
+                if(p != nullptr && counts[i] != 1) {
+                    if(count != 1 && counts[i] != count) {
+                        return _error("Register sizes of " + gate_name + " do not match");
+                    }
+                    count = counts[i];
+                }
+            }
+            if(p == nullptr) {
+                return error_str.size() ? -1 : _error("Expected " + std::to_string(control_count + 1) + " qubit arguments");
+            }
+            if(_expect_end(p, end) != 0) {
+                return -1;
+            }
+            int qubits[3];
+            for(int i = 0; i < count; i++) {
+                for(int j = 0; j < argument_count; j++) {
+                    qubits[j] = firsts[j] + (counts[j] == 1 ? 0 : i);
+                }
+                if(_add_controlled_gate(controlled_op, qubits, argument_count) != 0) {
+                    return -1;
+                }
+            }
+            return 0;
+        }
+        if(_equals(id_start, p, "measure")) {
+            int qubit_first, qubit_count_, bit_first, bit_count;
+            p = _read_argument(p, end, quantum_registers, &qubit_first, &qubit_count_);
+            if(p != nullptr) {
+                p = _skip_space(p, end);
+                p = (end - p >= 2 && p[0] == '-' && p[1] == '>') ? p + 2 : nullptr;
+            }
+            if(p != nullptr) {
+                p = _read_argument(p, end, classical_registers, &bit_first, &bit_count);
+            }
+            if(p == nullptr) {
+                return error_str.size() ? -1 : _error("Expected 'measure qubit -> bit'");
+            }
+            if(_expect_end(p, end) != 0) {
+                return -1;
+            }
+            if(qubit_count_ != bit_count) {
+                return _error("Register sizes of measure do not match");
+            }
+            if(_condition_mask != 0) {
+                return _error("Conditional measure is not supported");
+            }
+            for(int i = 0; i < qubit_count_; i++) {
+                for(int j = 0; j < measurements.size(); j++) {
+                    if(measurements[j].classical_bit == bit_first + i || measurements[j].qubit == qubit_first + i) {
+                        _move_measurements_to_circuit(); // Keep the order of the measurements
+                        break;
+                    }
+                }
+                QasmMeasurement measurement;
+                measurement.qubit = qubit_first + i;
+                measurement.classical_bit = bit_first + i;
+                measurements.push_back(measurement);
+                _measured[measurement.qubit] = true;
+            }
+            return 0;
+        }
+        return _error("Unsupported statement '" + std::string(id_start, p) + "'");
+    }
+    // Parse "if(creg==value) gate", the gate is only applied if the classical register has the value
+    int _parse_if_statement(const char* p, const char* end) {
+        if(_condition_mask != 0) {
+            return _error("Nested if is not supported");
+        }
+        const char* id_start;
+        int value;
+        p = _expect_char(p, end, '(');
+        if(p != nullptr) {
+            p = _read_identifier(p, end, &id_start);
+        }
+        int register_index = p == nullptr ? -1 : _find_register(classical_registers, id_start, p);
+        if(p != nullptr) {
+            p = _expect_char(p, end, '=');
+        }
+        if(p != nullptr) {
+            p = _expect_char(p, end, '=');
+        }
+        if(p != nullptr) {
+            p = _read_int(p, end, &value);
+        }
+        if(p != nullptr) {
+            p = _expect_char(p, end, ')');
+        }
+        if(p == nullptr || register_index == -1) {
+            return _error("Expected 'if(creg==value)'");
+        }
+        const QasmRegister& reg = classical_registers[register_index];
+        if(value >= ((int64_t)1 << reg.size)) { // 64 bit, the register can have 31 bits
+            return _error("Value out of range for register '" + reg.name + "'");
+        }
+        _condition_mask = (int)((((int64_t)1 << reg.size) - 1) << reg.offset);
+        _condition_value = value << reg.offset;
+        int result = _parse_statement(p, end);
+        _condition_mask = 0;
+        _condition_value = 0;
+        return result;
+    }
+};
+
+/**
+ * Parse a circuit from a string with OpenQASM 2 code
+ * Returns -1 in case of error, see parser.error_str for what went wrong
+*/
+int parse_qasm_string(const std::string& qasm_str, QasmParser& parser) {
+    if(parser.feed(qasm_str.data(), qasm_str.size()) != 0) {
+        return -1;
+    }
+    return parser.finish();
+}
+
+/**
+ * Parse a circuit from an OpenQASM 2 file, the file is read in chunks
+ * Returns -1 in case of error, see parser.error_str for what went wrong
+*/
+int parse_qasm_file(const std::string& filename, QasmParser& parser) {
+    std::ifstream file(filename, std::ios::binary);
+    if(!file.is_open()) {
+        parser.error_str = "Unable to open file " + filename;
+        return -1;
+    }
+    std::vector<char> buffer = std::vector<char>(1 << 16);
+    while(file) {
+        file.read(buffer.data(), buffer.size());
+        if(parser.feed(buffer.data(), file.gcount()) != 0) {
+            return -1;
+        }
+    }
+    return parser.finish();
+}
+
+/**
+ * Convert a circuit to OpenQASM 2 code, appended to output
+ * Returns -1 in case the circuit contains a gate that can not be converted
+*/
+int circuit_to_qasm(const CompiledCircuit& circuit, std::string* output, const std::vector<QasmMeasurement>& measurements = {}) {
+    int qubit_count = circuit.qubit_count;
+    int classical_bit_count = circuit.classical_bit_count;
+    for(int i = 0; i < measurements.size(); i++) {
+        classical_bit_count = std::max(classical_bit_count, measurements[i].classical_bit + 1);
+        qubit_count = std::max(qubit_count, measurements[i].qubit + 1);
+    }
+
+    std::string& out = *output;
+    out.reserve(out.size() + circuit.instructions.size() * 16);
+    out += "OPENQASM 2.0;\n";
+    out += "include \"qelib1.inc\";\n";
+    out += "qreg q[" + std::to_string(qubit_count) + "];\n";
+    if(classical_bit_count > 0) {
+        out += "creg c[" + std::to_string(classical_bit_count) + "];\n";
+    }
+    for(int i = 0; i < circuit.instructions.size(); i++) {
+        const GateInstruction& instruction = circuit.instructions[i];
+        std::string condition_str = "";
+        if(instruction.condition_mask != 0) {
+            // Conditions are on the whole classical register in OpenQASM 2
+            if(instruction.condition_mask != ((int64_t)1 << classical_bit_count) - 1) {
+                return -1;
+            }
+            condition_str = "if(c==" + std::to_string(instruction.condition_value) + ") ";
+        }
+        if(instruction.op != op_phase) {
+            out += condition_str;
+        }
+        if(instruction.op == op_hadamar) {
+            out += "h q[";
+        }
+        else if(instruction.op == op_measure) {
+            out += "measure q[" + std::to_string(instruction.target) + "] -> c[" + std::to_string(instruction.classical_bit) + "];\n";
+            continue;
+        }
+        else if(instruction.op == op_reset) {
+            out += "reset q[";
+        }
+        else if(instruction.op == op_phase_shift) {
+            out += "t q[";
+        }
+        else if(instruction.op == op_cnot) {
+            out += "cx q[";
+            out += std::to_string(instruction.control);
+            out += "],q[";
+        }
+        else if(instruction.op == op_multi_controlled_x || instruction.op == op_multi_controlled_z) {
+            // Controls are written in order from the lowest qubit
+            const char* x_gate_strs[3] = {"x", "cx", "ccx"};
+            const char* z_gate_strs[2] = {"z", "cz"};
+            int control_count = vicmil::count_bits(instruction.control_mask);
+            if(control_count > (instruction.op == op_multi_controlled_x ? 2 : 1)) {
+                return -1; // Not supported in OpenQASM 2 without defining the gate
+            }
+            out += instruction.op == op_multi_controlled_x ? x_gate_strs[control_count] : z_gate_strs[control_count];
+            out += " ";
+            for(int j = 0; j < circuit.qubit_count; j++) {
+                if((instruction.control_mask >> j) & 1) {
+                    out += "q[" + std::to_string(j) + "],";
+                }
+            }
+            out += "q[";
+        }
+        else if(is_rotation_op(instruction.op)) {
+            const char* rotation_strs[3] = {"rx", "ry", "rz"};
+            out += rotation_strs[instruction.op - op_rx];
+            out += "(";
+            if(instruction.parameter_num != -1) {
+                out += circuit.parameter_names[instruction.parameter_num];
+            }
+            else {
+                char angle_str[32];
+                std::snprintf(angle_str, sizeof(angle_str), "%.17g", instruction.param);
+                out += angle_str;
+            }
+            out += ") q[";
+        }
+        else if(instruction.op == op_phase) {
+            // Write it as the phase gates that are multiples of T
+            double t_count_exact = vicmil::modulo(instruction.param, 2 * vicmil::PI) / (vicmil::PI / 4);
+            int t_count = (int)std::round(t_count_exact) % 8;
+            if(std::abs(t_count_exact - std::round(t_count_exact)) > 0.000001) {
+                return -1; // Not a multiple of pi/4
+            }
+            const char* gate_strs[8] = {"", "t", "s", "s", "z", "z", "sdg", "tdg"};
+            if(t_count == 0) {
+                continue;
+            }
+            out += condition_str;
+            out += gate_strs[t_count];
+            out += " q[";
+            if(t_count == 3 || t_count == 5) {
+                // Needs an extra T gate
+                out += std::to_string(instruction.target);
+                out += "];\n" + condition_str + "t q[";
+            }
+        }
+        else {
+            return -1; // Unknown gate!
+        }
+        out += std::to_string(instruction.target);
+        out += "];\n";
+    }
+    for(int i = 0; i < measurements.size(); i++) {
+        out += "measure q[" + std::to_string(measurements[i].qubit) + "] -> c[" + std::to_string(measurements[i].classical_bit) + "];\n";
+    }
+    return 0;
+}
+
+/**
+ * Write a circuit to an OpenQASM 2 file
+ * Returns -1 in case of error
+*/
+int write_qasm_file(const std::string& filename, const CompiledCircuit& circuit, const std::vector<QasmMeasurement>& measurements = {}) {
+    std::string qasm_str = "";
+    if(circuit_to_qasm(circuit, &qasm_str, measurements) != 0) {
+        return -1;
+    }
+    std::ofstream file(filename, std::ios::binary);
+    if(!file.is_open()) {
+        return -1;
+    }
+    file.write(qasm_str.data(), qasm_str.size());
+    return 0;
+}
+
+void TEST_qasm_round_trip() {
+    std::string qasm_str =
+        "OPENQASM 2.0;\n"
+        "include \"qelib1.inc\"; // standard gates\n"
+        "qreg q[3];\n"
+        "creg c[3];\n"
+        "h q;\n"
+        "t q[1];\n"
+        "cx q[0],q[2];\n"
+        "ccx q[0],q[1],q[2];\n"
+        "cz q[2],q[0];\n"
+        "measure q -> c;\n";
+
+    // Feed it in small chunks to exercise statements split between chunks
+    QasmParser parser;
+    for(int i = 0; i < qasm_str.size(); i += 5) {
+        assert(parser.feed(qasm_str.data() + i, std::min<size_t>(5, qasm_str.size() - i)) == 0);
+    }
+    assert(parser.finish() == 0);
+    assert(parser.qubit_count == 3);
+    assert(parser.measurements.size() == 3);
+    assert(parser.circuit.get_gate_count() == 7);
+    QuantumCircuit quantum_circuit;
+    assert(QuantumCircuit::from_compiled(parser.circuit, &quantum_circuit) == 0);
+    assert(quantum_circuit.get_operations_count() == 4);
+
+    std::string written_str = "";
+    assert(circuit_to_qasm(parser.circuit, &written_str, parser.measurements) == 0);
+    QasmParser parser2;
+    assert(parse_qasm_string(written_str, parser2) == 0);
+    std::string written_str2 = "";
+    assert(circuit_to_qasm(parser2.circuit, &written_str2, parser2.measurements) == 0);
+    assert(written_str == written_str2);
+
+    // Running the compiled circuit should give the same state as running the operations one by one
+    CompiledCircuit compiled_circuit;
+    assert(quantum_circuit.compile(&compiled_circuit) == 0);
+    QubitSystem system1 = QubitSystem(3);
+    QubitSystem system2 = QubitSystem(3);
+    assert(compiled_circuit.run(system1) == 0);
+    for(int i = 0; i < quantum_circuit.get_operations_count(); i++) {
+        assert(quantum_circuit.run_operation(system2, i) == 0);
+    }
+    for(int i = 0; i < system1._qubit_states.size(); i++) {
+        assert(std::abs(system1._qubit_states[i].v - system2._qubit_states[i].v) < 0.000001);
+    }
+
+    // A gate after a measurement of its qubit moves the measurement into the circuit
+    QasmParser parser3;
+    assert(parse_qasm_string("qreg q[2];\ncreg c[1];\nh q[0];\nmeasure q[0] -> c[0];\nif(c==1) x q[1];\nreset q[0];\n", parser3) == 0);
+    assert(parser3.measurements.size() == 0);
+    assert(parser3.circuit.get_gate_count() == 4);
+    assert(parser3.circuit.instructions[1].op == op_measure);
+    assert(parser3.circuit.instructions[2].condition_mask == 1 && parser3.circuit.instructions[2].condition_value == 1);
+    assert(parser3.circuit.instructions[3].op == op_reset);
+    QasmParser wide_creg_parser; // All 31 classical bits in one register
+    assert(parse_qasm_string("qreg q[1];\ncreg c[31];\nif(c==5) x q[0];\n", wide_creg_parser) == 0);
+    assert(wide_creg_parser.circuit.instructions[0].condition_mask == 0x7FFFFFFF && wide_creg_parser.circuit.instructions[0].condition_value == 5);
+    std::string wide_creg_str = "";
+    assert(circuit_to_qasm(wide_creg_parser.circuit, &wide_creg_str) == 0);
+    assert(wide_creg_str.find("if(c==5) x q[0];") != std::string::npos);
+    QasmParser wide_qreg_parser; // 70 qubits over two registers
+    assert(parse_qasm_string("qreg a[40];\nqreg b[30];\n", wide_qreg_parser) == -1);
+
+    // Rotation angles are expressions or parameter names
+    QasmParser parser4;
+    assert(parse_qasm_string("qreg q[2];\nrx(pi/2) q[0];\nry(-(1.5e-1 + 2*pi)) q;\nrz(theta) q[1];\n", parser4) == 0);
+    assert(parser4.circuit.get_gate_count() == 4);
+    assert(std::abs(parser4.circuit.instructions[0].param - vicmil::PI / 2) < 0.000001);
+    assert(std::abs(parser4.circuit.instructions[2].param + 0.15 + 2 * vicmil::PI) < 0.000001);
+    assert(parser4.circuit.instructions[3].op == op_rz && parser4.circuit.parameter_names[parser4.circuit.instructions[3].parameter_num] == "theta");
+    std::string rotation_str = "";
+    assert(circuit_to_qasm(parser4.circuit, &rotation_str) == 0);
+    QasmParser parser5;
+    assert(parse_qasm_string(rotation_str, parser5) == 0);
+    assert(parser5.circuit.instructions[2].param == parser4.circuit.instructions[2].param);
+    assert(parser5.circuit.parameter_names.size() == 1);
+
+    QasmParser bad_parser;
+    assert(parse_qasm_string("qreg q[2];\nswap q[0],q[1];\n", bad_parser) == -1);
+    assert(bad_parser.error_str.find("line 2") == 0);
+}
+AddTest(TEST_qasm_round_trip);
+}
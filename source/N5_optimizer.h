@@ -0,0 +1,335 @@
+#pragma once
+#include "N4_qasm.h"
+
+namespace qubit_circuit {
+
+/**
+ * Peephole optimization of compiled circuits, run before the simulation
+ *   Every removed gate saves a full pass over the 2^N state vector
+ *
+ * Each pass walks the circuit once, keeping a stack of the gates on each qubit(wire).
+ *   A new gate looks back along its wires, past gates it commutes with, for a gate to cancel or merge with
+*/
+
+const int max_peephole_look_back = 64; // How far back along a wire to look for a partner gate
+
+struct OptimizerPassReport {
+    std::string pass_name;
+    int removed_gate_count = 0;
+};
+
+bool is_phase_gate(const GateInstruction& instruction) {
+    return instruction.op == op_phase_shift || instruction.op == op_phase;
+}
+
+double get_phase_gate_angle(const GateInstruction& instruction) {
+    if(instruction.op == op_phase_shift) {
+        return vicmil::PI / 4;
+    }
+    return instruction.param;
+}
+
+// Gates that only change the phase of states, they are diagonal matrices
+bool is_diagonal_gate(const GateInstruction& instruction) {
+    return is_phase_gate(instruction) || instruction.op == op_multi_controlled_z || instruction.op == op_multi_controlled_phase || instruction.op == op_rz;
+}
+
+// Gates that flip the target if all controls are set
+bool is_controlled_x_gate(const GateInstruction& instruction) {
+    return instruction.op == op_cnot || instruction.op == op_multi_controlled_x;
+}
+
+bool gate_uses_qubit(const GateInstruction& instruction, int qubit_num) {
+    return (get_instruction_qubit_mask(instruction) >> qubit_num) & 1;
+}
+
+/**
+ * Conservative check if two gates commute, false means they might not commute
+*/
+bool gates_commute(const GateInstruction& a, const GateInstruction& b) {
+    uint64_t a_mask = get_instruction_qubit_mask(a);
+    uint64_t b_mask = get_instruction_qubit_mask(b);
+    if((a_mask & b_mask) == 0) {
+        return true;
+    }
+    if(is_measurement_op(a.op) || is_measurement_op(b.op) || a.condition_mask != 0 || b.condition_mask != 0) {
+        return false; // Measurements and the gates that depend on them are never moved
+    }
+    if(is_diagonal_gate(a) && is_diagonal_gate(b)) {
+        return true; // Diagonal gates always commute
+    }
+    // Diagonal gates commute with the controls of a controlled x
+    if(is_diagonal_gate(a) && is_controlled_x_gate(b)) {
+        return !gate_uses_qubit(a, b.target);
+    }
+    if(is_diagonal_gate(b) && is_controlled_x_gate(a)) {
+        return !gate_uses_qubit(b, a.target);
+    }
+    // Two controlled x commute unless the target of one is a control of the other
+    if(is_controlled_x_gate(a) && is_controlled_x_gate(b)) {
+        uint64_t a_control_mask = a_mask & ~((uint64_t)1 << a.target);
+        uint64_t b_control_mask = b_mask & ~((uint64_t)1 << b.target);
+        return !((b_control_mask >> a.target) & 1) && !((a_control_mask >> b.target) & 1);
+    }
+    return false;
+}
+
+/**
+ * Keeps track of what gates are on each wire while a pass walks through the circuit
+*/
+class _WireTracker {
+public:
+    std::vector<std::vector<int>> wires; // wires[qubit_num] = instruction indices on that qubit, in order
+    _WireTracker(int qubit_count) {
+        wires.resize(qubit_count);
+    }
+    void push(const GateInstruction& instruction, int instruction_num) {
+        for(int i = 0; i < wires.size(); i++) {
+            if(gate_uses_qubit(instruction, i)) {
+                wires[i].push_back(instruction_num);
+            }
+        }
+    }
+    void remove(const GateInstruction& instruction, int instruction_num) {
+        for(int i = 0; i < wires.size(); i++) {
+            if(gate_uses_qubit(instruction, i)) {
+                _remove_from_wire(i, instruction_num);
+            }
+        }
+    }
+    void _remove_from_wire(int qubit_num, int instruction_num) {
+        std::vector<int>& wire = wires[qubit_num];
+        for(int i = wire.size() - 1; i >= 0; i--) {
+            if(wire[i] == instruction_num) {
+                wire.erase(wire.begin() + i);
+                return;
+            }
+        }
+    }
+    /**
+     * Look back along one wire for the first gate that either matches, or blocks(does not commute)
+     * Returns -1 if none is found
+    */
+    template<class MatchFunc>
+    int _look_back_wire(const std::vector<GateInstruction>& instructions, const GateInstruction& instruction, int qubit_num, MatchFunc matches) {
+        const std::vector<int>& wire = wires[qubit_num];
+        int stop = std::max(0, (int)wire.size() - max_peephole_look_back);
+        for(int i = wire.size() - 1; i >= stop; i--) {
+            const GateInstruction& other = instructions[wire[i]];
+            if(matches(other)) {
+                return wire[i];
+            }
+            if(!gates_commute(other, instruction)) {
+                return -1;
+            }
+        }
+        return -1;
+    }
+    /**
+     * Find an earlier gate that instruction can be moved next to, along all of its wires, and that matches
+     * Returns -1 if none is found
+    */
+    template<class MatchFunc>
+    int find_partner(const std::vector<GateInstruction>& instructions, const GateInstruction& instruction, MatchFunc matches) {
+        int partner = _look_back_wire(instructions, instruction, instruction.target, matches);
+        if(partner == -1) {
+            return partner;
+        }
+        for(int i = 0; i < wires.size(); i++) {
+            if(i != instruction.target && gate_uses_qubit(instruction, i) && _look_back_wire(instructions, instruction, i, matches) != partner) {
+                return -1;
+            }
+        }
+        return partner;
+    }
+};
+
+/**
+ * Remove the instructions marked as removed, returns how many were removed
+*/
+int _remove_marked_instructions(CompiledCircuit& circuit, const std::vector<bool>& removed) {
+    int kept_count = 0;
+    for(int i = 0; i < circuit.instructions.size(); i++) {
+        if(!removed[i]) {
+            circuit.instructions[kept_count] = circuit.instructions[i];
+            kept_count++;
+        }
+    }
+    int removed_count = circuit.instructions.size() - kept_count;
+    circuit.instructions.resize(kept_count);
+    return removed_count;
+}
+
+/**
+ * Cancel pairs of self inverse gates with the specified op, e.g. H*H = I, CNOT*CNOT = I and CCX*CCX = I
+ * Returns the number of removed gates
+*/
+int cancel_self_inverse_pairs(CompiledCircuit& circuit, int op) {
+    _WireTracker tracker = _WireTracker(circuit.qubit_count);
+    std::vector<bool> removed = std::vector<bool>(circuit.instructions.size(), false);
+    for(int i = 0; i < circuit.instructions.size(); i++) {
+        const GateInstruction& instruction = circuit.instructions[i];
+        if(instruction.op == op && instruction.condition_mask == 0) {
+            int partner = tracker.find_partner(circuit.instructions, instruction, [&](const GateInstruction& other) {
+                return other.op == op && other.target == instruction.target && other.control == instruction.control &&
+                    other.control_mask == instruction.control_mask && other.condition_mask == 0;
+            });
+            if(partner != -1) {
+                tracker.remove(circuit.instructions[partner], partner);
+                removed[partner] = true;
+                removed[i] = true;
+                continue;
+            }
+        }
+        tracker.push(instruction, i);
+    }
+    return _remove_marked_instructions(circuit, removed);
+}
+
+int cancel_hadamar_pairs(CompiledCircuit& circuit) {
+    return cancel_self_inverse_pairs(circuit, op_hadamar);
+}
+
+int cancel_cnot_pairs(CompiledCircuit& circuit) {
+    return cancel_self_inverse_pairs(circuit, op_cnot);
+}
+
+int cancel_multi_controlled_pairs(CompiledCircuit& circuit) {
+    return cancel_self_inverse_pairs(circuit, op_multi_controlled_x) + cancel_self_inverse_pairs(circuit, op_multi_controlled_z);
+}
+
+/**
+ * Merge phase gates on the same qubit into one, also past cnot controls since they commute
+ *   T^8 = I, so merged gates that add up to a multiple of 2PI are removed
+ * Returns the number of removed gates
+*/
+int merge_phase_gates(CompiledCircuit& circuit) {
+    _WireTracker tracker = _WireTracker(circuit.qubit_count);
+    std::vector<bool> removed = std::vector<bool>(circuit.instructions.size(), false);
+    std::vector<GateInstruction>& instructions = circuit.instructions;
+    for(int i = 0; i < instructions.size(); i++) {
+        const GateInstruction& instruction = instructions[i];
+        if(is_phase_gate(instruction) && instruction.condition_mask == 0) {
+            int partner = tracker.find_partner(instructions, instruction, [&](const GateInstruction& other) {
+                return is_phase_gate(other) && other.target == instruction.target && other.condition_mask == 0;
+            });
+            if(partner != -1) {
+                instructions[partner].param = get_phase_gate_angle(instructions[partner]) + get_phase_gate_angle(instruction);
+                instructions[partner].op = op_phase;
+                removed[i] = true;
+                continue;
+            }
+        }
+        tracker.push(instruction, i);
+    }
+
+    // Turn merged gates back into T gates where possible, and remove the ones that are identity
+    for(int i = 0; i < instructions.size(); i++) {
+        if(removed[i] || instructions[i].op != op_phase) {
+            continue;
+        }
+        double angle = vicmil::modulo(instructions[i].param, 2 * vicmil::PI);
+        if(angle < 0.000000001 || angle > 2 * vicmil::PI - 0.000000001) {
+            removed[i] = true;
+        }
+        else if(std::abs(angle - vicmil::PI / 4) < 0.000000001) {
+            instructions[i].op = op_phase_shift;
+            instructions[i].param = 0;
+        }
+    }
+    return _remove_marked_instructions(circuit, removed);
+}
+
+/**
+ * Runs the optimization passes over and over until no more gates can be removed
+ *   One pass can make new opportunities for the others, e.g. H T^8 H -> H H -> I
+*/
+class CircuitOptimizer {
+public:
+    int max_rounds = 10;
+    std::vector<OptimizerPassReport> reports = {};
+
+    /**
+     * Returns the total number of removed gates, see reports for how many each pass removed
+    */
+    int optimize(CompiledCircuit& circuit) {
+        reports = {};
+        reports.push_back({"merge_phase_gates", 0});
+        reports.push_back({"cancel_hadamar_pairs", 0});
+        reports.push_back({"cancel_cnot_pairs", 0});
+        reports.push_back({"cancel_multi_controlled_pairs", 0});
+        int total_removed_count = 0;
+        for(int round = 0; round < max_rounds; round++) {
+            int round_removed_count = 0;
+            for(int i = 0; i < reports.size(); i++) {
+                int removed_count = _run_pass(circuit, i);
+                reports[i].removed_gate_count += removed_count;
+                round_removed_count += removed_count;
+            }
+            total_removed_count += round_removed_count;
+            if(round_removed_count == 0) {
+                break;
+            }
+        }
+        return total_removed_count;
+    }
+    std::string report_to_str() {
+        std::string return_str = "";
+        for(int i = 0; i < reports.size(); i++) {
+            return_str += reports[i].pass_name + ": removed " + std::to_string(reports[i].removed_gate_count) + " gates\n";
+        }
+        return return_str;
+    }
+private:
+    int _run_pass(CompiledCircuit& circuit, int pass_num) {
+        switch(pass_num) {
+            case 0: return merge_phase_gates(circuit);
+            case 1: return cancel_hadamar_pairs(circuit);
+            case 2: return cancel_cnot_pairs(circuit);
+            case 3: return cancel_multi_controlled_pairs(circuit);
+        }
+        return 0;
+    }
+};
+
+void TEST_CircuitOptimizer() {
+    CompiledCircuit circuit;
+    circuit.qubit_count = 3;
+    circuit.add_hadamar(0);
+    circuit.add_phase_shift(1);
+    circuit.add_cnot(1, 2);
+    circuit.add_phase_shift(1); // Merges with the first T through the cnot control
+    circuit.add_hadamar(0); // Cancels with the first H
+    circuit.add_cnot(0, 2); // Commutes with the other cnots(same target)
+    circuit.add_cnot(1, 2); // Cancels with the first cnot
+    for(int i = 0; i < 6; i++) {
+        circuit.add_phase_shift(1); // Adds up to T^8 with the two earlier ones
+    }
+    circuit.add_hadamar(2);
+    circuit.add_hadamar(2);
+    circuit.add_toffoli(0, 1, 2);
+    circuit.add_multi_controlled_z({2}, 0); // Commutes with the toffoli controls
+    circuit.add_multi_controlled_z({2}, 0);
+    circuit.add_toffoli(1, 0, 2); // Cancels with the first toffoli
+
+    CompiledCircuit original_circuit = circuit;
+    CircuitOptimizer optimizer;
+    int removed_count = optimizer.optimize(circuit);
+    assert(circuit.get_gate_count() == 1);
+    assert(circuit.instructions[0].op == op_cnot);
+    assert(removed_count == original_circuit.get_gate_count() - 1);
+
+    // The optimized circuit should give the same state
+    QubitSystem system1 = QubitSystem(3);
+    QubitSystem system2 = QubitSystem(3);
+    system1.hadamar(0);
+    system1.hadamar(1);
+    system2 = system1;
+    original_circuit.run(system1);
+    circuit.run(system2);
+    for(int i = 0; i < system1._qubit_states.size(); i++) {
+        assert(std::abs(system1._qubit_states[i].v - system2._qubit_states[i].v) < 0.000001);
+    }
+}
+AddTest(TEST_CircuitOptimizer);
+}
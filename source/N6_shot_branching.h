@@ -0,0 +1,172 @@
+#pragma once
+#include "N5_optimizer.h"
+
+namespace qubit_circuit {
+
+/**
+ * Running many shots of a circuit with mid circuit measurements
+ *
+ * Re-running the whole circuit for every shot repeats the same work, the state only starts to differ
+ *   between shots at the first measurement. Instead the shots are run together as a tree of branches:
+ *   the part before a measurement is run once, and at the measurement the shots are split between the
+ *   two outcomes(binomially, with the probability of the outcome). The state is only copied if both
+ *   outcomes get shots, and branches are run depth first so a copy is freed as soon as its shots are done
+ *
+ * Measurements at the end of the circuit do not change what happens after them, so they are sampled
+ *   directly from the final state instead of branching
+*/
+
+class ShotBranchingExecutor {
+public:
+    vicmil::RandomNumberGenerator rand_gen;
+    // Statistics from the last run
+    int64_t instruction_run_count = 0; // Instructions run over all branches, compare with shots * instructions
+    int state_copy_count = 0;
+    int max_live_state_count = 0; // The most states that were in memory at the same time
+
+    /**
+     * Run the circuit shot_count times, counts is set to how many shots ended with each value of the classical bits
+     * Returns -1 in case of error
+    */
+    int run(const CompiledCircuit& circuit, int shot_count, std::map<int, int>* counts) {
+        counts->clear();
+        instruction_run_count = 0;
+        state_copy_count = 0;
+        max_live_state_count = 1;
+        if(circuit.find_invalid_instruction() != -1) {
+            return -1;
+        }
+        // Where the measurements at the end of the circuit start
+        _final_measurements_start = circuit.instructions.size();
+        while(_final_measurements_start > 0) {
+            const GateInstruction& instruction = circuit.instructions[_final_measurements_start - 1];
+            if(instruction.op != op_measure || instruction.condition_mask != 0) {
+                break;
+            }
+            _final_measurements_start--;
+        }
+        QubitSystem qubit_system = QubitSystem(std::max(circuit.qubit_count, 1));
+        if(shot_count > 0) {
+            _run_branch(circuit, qubit_system, 0, shot_count, 1, counts);
+        }
+        return 0;
+    }
+
+private:
+    int _final_measurements_start = 0;
+
+    void _run_branch(const CompiledCircuit& circuit, QubitSystem& qubit_system, int instruction_num, int shot_count, int live_state_count, std::map<int, int>* counts) {
+        while(true) {
+            int measurement_num = circuit.run_until_measurement(qubit_system, instruction_num);
+            instruction_run_count += measurement_num - instruction_num;
+            if(measurement_num >= _final_measurements_start) {
+                _sample_final_measurements(circuit, qubit_system, shot_count, counts);
+                return;
+            }
+            const GateInstruction& measurement = circuit.instructions[measurement_num];
+            instruction_num = measurement_num + 1;
+            instruction_run_count++;
+            if(!is_condition_met(qubit_system, measurement)) {
+                continue;
+            }
+            double prob_1 = qubit_system.get_qubit_probability(measurement.target);
+            std::binomial_distribution<int> shot_distribution(shot_count, std::min(1.0, std::max(0.0, prob_1)));
+            int shot_count_1 = shot_distribution(rand_gen._gen);
+            if(shot_count_1 == 0 || shot_count_1 == shot_count) {
+                // All shots get the same outcome, no need to branch
+                bool value = shot_count_1 != 0;
+                _apply_outcome(qubit_system, measurement, value, value ? prob_1 : 1 - prob_1);
+                continue;
+            }
+            {
+                QubitSystem branch_system = qubit_system;
+                state_copy_count++;
+                max_live_state_count = std::max(max_live_state_count, live_state_count + 1);
+                _apply_outcome(branch_system, measurement, true, prob_1);
+                _run_branch(circuit, branch_system, instruction_num, shot_count_1, live_state_count + 1, counts);
+            }
+            shot_count -= shot_count_1;
+            _apply_outcome(qubit_system, measurement, false, 1 - prob_1);
+        }
+    }
+    static void _apply_outcome(QubitSystem& qubit_system, const GateInstruction& measurement, bool value, double probability) {
+        qubit_system.collapse(measurement.target, value, probability);
+        if(measurement.op == op_reset) {
+            if(value) {
+                qubit_system.multi_controlled_x(0, measurement.target);
+            }
+            return;
+        }
+        int bit_mask = 1 << measurement.classical_bit;
+        qubit_system._classical_bits = value ? (qubit_system._classical_bits | bit_mask) : (qubit_system._classical_bits & ~bit_mask);
+    }
+    /**
+     * Sample the measurements at the end of the circuit for each shot, from the cumulative probabilities of the states
+    */
+    void _sample_final_measurements(const CompiledCircuit& circuit, const QubitSystem& qubit_system, int shot_count, std::map<int, int>* counts) {
+        if(_final_measurements_start == circuit.instructions.size()) {
+            (*counts)[qubit_system._classical_bits] += shot_count;
+            return;
+        }
+        std::vector<double> cumulative_probabilities = std::vector<double>(qubit_system._qubit_states.size());
+        double sum = 0;
+        for(int i = 0; i < qubit_system._qubit_states.size(); i++) {
+            sum += std::norm(qubit_system._qubit_states[i].v);
+            cumulative_probabilities[i] = sum;
+        }
+        for(int shot = 0; shot < shot_count; shot++) {
+            double r = rand_gen.rand_between_0_and_1() * sum;
+            int state_index = std::upper_bound(cumulative_probabilities.begin(), cumulative_probabilities.end(), r) - cumulative_probabilities.begin();
+            state_index = std::min(state_index, (int)cumulative_probabilities.size() - 1);
+            int classical_bits = qubit_system._classical_bits;
+            for(int i = _final_measurements_start; i < circuit.instructions.size(); i++) {
+                const GateInstruction& measurement = circuit.instructions[i];
+                int bit_mask = 1 << measurement.classical_bit;
+                classical_bits = ((state_index >> measurement.target) & 1) ? (classical_bits | bit_mask) : (classical_bits & ~bit_mask);
+            }
+            (*counts)[classical_bits]++;
+        }
+        instruction_run_count += circuit.instructions.size() - _final_measurements_start;
+    }
+};
+
+void TEST_ShotBranchingExecutor() {
+    // Teleportation of H*T*H|0> from qubit 0 to qubit 2, then qubit 2 is measured to classical bit 2
+    CompiledCircuit circuit;
+    circuit.add_hadamar(0);
+    circuit.add_phase_shift(0);
+    circuit.add_hadamar(0);
+    circuit.add_hadamar(1);
+    circuit.add_cnot(1, 2);
+    circuit.add_cnot(0, 1);
+    circuit.add_hadamar(0);
+    circuit.add_measure(0, 0);
+    circuit.add_measure(1, 1);
+    circuit.add_multi_controlled_x({}, 2);
+    circuit.set_condition(1 << 1, 1 << 1);
+    circuit.add_multi_controlled_z({}, 2);
+    circuit.set_condition(1 << 0, 1 << 0);
+    circuit.add_measure(2, 2);
+
+    int shot_count = 10000;
+    ShotBranchingExecutor executor;
+    std::map<int, int> counts;
+    assert(executor.run(circuit, shot_count, &counts) == 0);
+    int total_count = 0;
+    int bit_2_count = 0;
+    for(std::map<int, int>::iterator it = counts.begin(); it != counts.end(); it++) {
+        total_count += it->second;
+        if((it->first >> 2) & 1) {
+            bit_2_count += it->second;
+        }
+    }
+    assert(total_count == shot_count);
+    double expected_prob = (1 - std::cos(vicmil::PI / 4)) / 2; // |<1|H*T*H|0>|^2
+    assert(std::abs((double)bit_2_count / shot_count - expected_prob) < 0.03);
+    // Two measurements give at most 3 copies, and the gates are run once per branch instead of once per shot
+    assert(executor.state_copy_count <= 3);
+    assert(executor.max_live_state_count <= 3);
+    assert(executor.instruction_run_count < 4 * circuit.get_gate_count());
+}
+AddTest(TEST_ShotBranchingExecutor);
+}
@@ -0,0 +1,189 @@
+#pragma once
+#include "N6_shot_branching.h"
+
+namespace qubit_circuit {
+
+/**
+ * Getting single amplitudes <x|C|0> as a sum over paths, without storing the 2^N state vector
+ *
+ * On a basis state every gate except hadamar is deterministic: it maps the basis state to one other
+ *   basis state times a phase. A hadamar splits the path in two, so a circuit with h hadamar gates
+ *   has 2^h paths, and the amplitude is the sum of the paths that end in x.
+ *   The paths are walked depth first, so memory is O(N + h) while time is O(2^h * gates)
+ *
+ * The first hadamar choices(the path prefixes) are split between threads
+*/
+
+const int max_feynman_qubit_count = 63; // A basis state is stored in a 64 bit integer
+
+class _FeynmanPathSum {
+public:
+    const std::vector<GateInstruction>* instructions;
+    std::vector<std::complex<double>> phase_factors = {}; // The phase of each instruction, if it is a phase gate
+    uint64_t output_state = 0;
+
+    /**
+     * Sum the amplitudes of all paths from instruction_num and state, that end in output_state
+     *   The first prefix_length hadamar gates do not branch, they take the choice in prefix_choices instead
+    */
+    std::complex<double> sum_paths(int instruction_num, uint64_t state, std::complex<double> amplitude, uint64_t prefix_choices, int prefix_length) const {
+        const std::vector<GateInstruction>& instructions_ = *instructions;
+        for(int i = instruction_num; i < instructions_.size(); i++) {
+            const GateInstruction& instruction = instructions_[i];
+            uint64_t target_mask = (uint64_t)1 << instruction.target;
+            bool target_set = (state & target_mask) != 0;
+            uint64_t control_mask = instruction.control_mask;
+            switch(instruction.op) {
+                case op_hadamar:
+                    amplitude *= std::sqrt(0.5);
+                    if(prefix_length > 0) {
+                        bool choice = prefix_choices & 1;
+                        prefix_choices >>= 1;
+                        prefix_length--;
+                        state = choice ? (state | target_mask) : (state & ~target_mask);
+                        if(choice && target_set) {
+                            amplitude = -amplitude;
+                        }
+                        break;
+                    }
+                    // |0> -> |0> + |1>,  |1> -> |0> - |1>
+                    return sum_paths(i + 1, state & ~target_mask, amplitude, 0, 0) +
+                        sum_paths(i + 1, state | target_mask, target_set ? -amplitude : amplitude, 0, 0);
+                case op_phase_shift:
+                case op_phase:
+                    if(target_set) {
+                        amplitude *= phase_factors[i];
+                    }
+                    break;
+                case op_cnot:
+                    if((state >> instruction.control) & 1) {
+                        state ^= target_mask;
+                    }
+                    break;
+                case op_multi_controlled_x:
+                    if((state & control_mask) == control_mask) {
+                        state ^= target_mask;
+                    }
+                    break;
+                case op_multi_controlled_z:
+                case op_multi_controlled_phase:
+                    if(target_set && (state & control_mask) == control_mask) {
+                        amplitude *= phase_factors[i];
+                    }
+                    break;
+                case op_rz:
+                    amplitude *= target_set ? phase_factors[i] : std::conj(phase_factors[i]);
+                    break;
+            }
+        }
+        if(state != output_state) {
+            return 0;
+        }
+        return amplitude;
+    }
+};
+
+/**
+ * Get the amplitude of output_state(bit i is qubit i) after running the circuit on |0>
+ *   Works for up to 63 qubits, the time is exponential in the number of hadamar gates instead of qubits
+ * Returns -1 if the circuit is invalid, too large, or has measurements or x/y rotations
+*/
+int get_feynman_amplitude(const CompiledCircuit& circuit, uint64_t output_state, std::complex<double>* amplitude) {
+    if(circuit.qubit_count > max_feynman_qubit_count || circuit.find_invalid_instruction() != -1) {
+        return -1;
+    }
+    _FeynmanPathSum path_sum;
+    path_sum.instructions = &circuit.instructions;
+    path_sum.output_state = output_state;
+    path_sum.phase_factors.resize(circuit.instructions.size());
+    int hadamar_count = 0;
+    for(int i = 0; i < circuit.instructions.size(); i++) {
+        const GateInstruction& instruction = circuit.instructions[i];
+        if(is_measurement_op(instruction.op) || instruction.condition_mask != 0) {
+            return -1; // Paths can not be summed over measurements
+        }
+        if(instruction.op == op_rx || instruction.op == op_ry) {
+            return -1; // Only hadamar gates branch
+        }
+        if(instruction.op == op_hadamar) {
+            hadamar_count++;
+        }
+        else if(instruction.op == op_phase_shift) {
+            path_sum.phase_factors[i] = vicmil::exp_form_to_complex(1, vicmil::PI / 4);
+        }
+        else if(instruction.op == op_multi_controlled_z) {
+            path_sum.phase_factors[i] = -1;
+        }
+        else if(instruction.op == op_rz) {
+            path_sum.phase_factors[i] = vicmil::exp_form_to_complex(1, instruction.param / 2); // Of |1>, |0> gets the conjugate
+        }
+        else {
+            path_sum.phase_factors[i] = vicmil::exp_form_to_complex(1, instruction.param);
+        }
+    }
+
+    // Split the paths between threads by the choices of the first hadamar gates, a few prefixes per thread to even out the load
+    int prefix_length = 0;
+    while(prefix_length < hadamar_count && (1 << prefix_length) < vicmil::get_thread_pool().get_thread_count() * 8) {
+        prefix_length++;
+    }
+    std::vector<std::complex<double>> partial_sums = std::vector<std::complex<double>>(vicmil::get_thread_pool().get_thread_count(), 0);
+    vicmil::parallel_for(0, (int64_t)1 << prefix_length, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+        for(int64_t prefix = chunk_begin; prefix < chunk_end; prefix++) {
+            partial_sums[chunk_num] += path_sum.sum_paths(0, 0, 1, prefix, prefix_length);
+        }
+    }, 1);
+    *amplitude = 0;
+    for(int i = 0; i < partial_sums.size(); i++) {
+        *amplitude += partial_sums[i];
+    }
+    return 0;
+}
+
+int get_feynman_amplitude(QuantumCircuit& circuit, uint64_t output_state, std::complex<double>* amplitude) {
+    CompiledCircuit compiled_circuit;
+    if(circuit.compile(&compiled_circuit) != 0) {
+        return -1;
+    }
+    return get_feynman_amplitude(compiled_circuit, output_state, amplitude);
+}
+
+void TEST_get_feynman_amplitude() {
+    // Compare with the state vector for a small circuit
+    CompiledCircuit circuit;
+    circuit.qubit_count = 5;
+    vicmil::RandomNumberGenerator rand_gen;
+    rand_gen.set_seed(3);
+    for(int i = 0; i < 40; i++) {
+        int qubit = rand_gen.rand() % 5;
+        int other_qubit = (qubit + 1 + rand_gen.rand() % 4) % 5;
+        switch(rand_gen.rand() % 5) {
+            case 0: circuit.add_hadamar(qubit); break;
+            case 1: circuit.add_phase_shift(qubit); break;
+            case 2: circuit.add_cnot(qubit, other_qubit); break;
+            case 3: circuit.add_phase(qubit, 0.3 * i); break;
+            case 4: circuit.add_multi_controlled_z({other_qubit}, qubit); break;
+        }
+    }
+    QubitSystem system = QubitSystem(5);
+    assert(circuit.run(system) == 0);
+    for(int i = 0; i < system._qubit_states.size(); i++) {
+        std::complex<double> amplitude;
+        assert(get_feynman_amplitude(circuit, i, &amplitude) == 0);
+        assert(std::abs(amplitude - system._qubit_states[i].v) < 0.000001);
+    }
+
+    // 40 qubit GHZ state, far too large for the state vector
+    CompiledCircuit ghz_circuit;
+    ghz_circuit.add_hadamar(0);
+    for(int i = 1; i < 40; i++) {
+        ghz_circuit.add_cnot(i - 1, i);
+    }
+    std::complex<double> amplitude;
+    assert(get_feynman_amplitude(ghz_circuit, ((uint64_t)1 << 40) - 1, &amplitude) == 0);
+    assert(std::abs(amplitude - std::sqrt(0.5)) < 0.000001);
+    assert(get_feynman_amplitude(ghz_circuit, 1, &amplitude) == 0);
+    assert(std::abs(amplitude) < 0.000001);
+}
+AddTest(TEST_get_feynman_amplitude);
+}
@@ -0,0 +1,464 @@
+#pragma once
+#include "N7_feynman_paths.h"
+
+namespace qubit_circuit {
+
+/**
+ * Simulating circuits as tensor networks, without storing the 2^N state vector
+ *
+ * Each gate is a tensor with one index per input and output qubit, connected along the qubit wires.
+ *   An amplitude <x|C|0> is the network closed with |0> at the start and <x| at the end, contracted
+ *   down to a single number. For shallow but wide circuits the tensors stay small during the contraction,
+ *   so it works far beyond the qubit counts of the state vector.
+ *
+ * How large the tensors get depends on the order the tensors are contracted in, it is chosen by
+ *   ContractionOrderOptimizer with a greedy heuristic and randomized variations of it.
+ *   Each contraction is a complex matrix multiplication, after the indices are permuted into matrix form
+ *
+ * All indices have dimension 2. Bit k of a position in Tensor::data is the value of indices[k]
+*/
+
+struct Tensor {
+    std::vector<int> indices = {};
+    std::vector<std::complex<double>> data = {std::complex<double>(1, 0)};
+};
+
+/**
+ * Get the tensor with the indices in a new order(the same indices), the data is moved to match
+*/
+Tensor permute_tensor(const Tensor& tensor, const std::vector<int>& new_indices) {
+    Tensor new_tensor;
+    new_tensor.indices = new_indices;
+    new_tensor.data.resize(tensor.data.size());
+    // Where each new index was in the old tensor
+    std::vector<int> old_bit_nums = std::vector<int>(new_indices.size());
+    for(int i = 0; i < new_indices.size(); i++) {
+        old_bit_nums[i] = std::find(tensor.indices.begin(), tensor.indices.end(), new_indices[i]) - tensor.indices.begin();
+    }
+    for(int64_t new_position = 0; new_position < new_tensor.data.size(); new_position++) {
+        int64_t old_position = 0;
+        for(int i = 0; i < old_bit_nums.size(); i++) {
+            old_position |= ((new_position >> i) & 1) << old_bit_nums[i];
+        }
+        new_tensor.data[new_position] = tensor.data[old_position];
+    }
+    return new_tensor;
+}
+
+const int gemm_block_size = 64;
+
+/**
+ * c = a * b, where a is m x k, b is k x n and c is m x n, all row major
+ *   Blocked so that the parts of b that are used stay in the cache. The rows of c are split between threads,
+ *   or the columns when there are fewer rows than threads(e.g. a vector times a matrix)
+*/
+void complex_gemm(int64_t m, int64_t n, int64_t k, const std::complex<double>* a, const std::complex<double>* b, std::complex<double>* c) {
+    std::fill(c, c + m * n, std::complex<double>(0, 0));
+    auto multiply_block = [&](int64_t row_begin, int64_t row_end, int64_t column_begin, int64_t column_end) {
+        for(int64_t k_block = 0; k_block < k; k_block += gemm_block_size) {
+            int64_t k_block_end = std::min(k, k_block + gemm_block_size);
+            for(int64_t j_block = column_begin; j_block < column_end; j_block += gemm_block_size) {
+                int64_t j_block_end = std::min(column_end, j_block + gemm_block_size);
+                for(int64_t i = row_begin; i < row_end; i++) {
+                    std::complex<double>* c_row = c + i * n;
+                    for(int64_t l = k_block; l < k_block_end; l++) {
+                        double a_real = a[i * k + l].real();
+                        double a_imag = a[i * k + l].imag();
+                        const std::complex<double>* b_row = b + l * n;
+                        // Written out by hand, std::complex multiplication has extra checks that prevent vectorization
+                        for(int64_t j = j_block; j < j_block_end; j++) {
+                            double b_real = b_row[j].real();
+                            double b_imag = b_row[j].imag();
+                            c_row[j] = std::complex<double>(c_row[j].real() + a_real * b_real - a_imag * b_imag, c_row[j].imag() + a_real * b_imag + a_imag * b_real);
+                        }
+                    }
+                }
+            }
+        }
+    };
+    if(m >= vicmil::get_thread_pool().get_thread_count()) {
+        int64_t min_chunk_size = std::max((int64_t)1, vicmil::default_parallel_min_chunk_size / std::max((int64_t)1, n * k));
+        vicmil::parallel_for(0, m, [&](int64_t row_begin, int64_t row_end, int chunk_num) {
+            multiply_block(row_begin, row_end, 0, n);
+        }, min_chunk_size);
+    }
+    else {
+        int64_t min_chunk_size = std::max((int64_t)1, vicmil::default_parallel_min_chunk_size / std::max((int64_t)1, m * k));
+        vicmil::parallel_for(0, n, [&](int64_t column_begin, int64_t column_end, int chunk_num) {
+            multiply_block(0, m, column_begin, column_end);
+        }, min_chunk_size);
+    }
+}
+
+/**
+ * Contract two tensors over the indices they share, the result has the other indices
+*/
+Tensor contract_tensors(const Tensor& a, const Tensor& b) {
+    std::vector<int> shared_indices = {};
+    std::vector<int> a_indices = {};
+    std::vector<int> b_indices = {};
+    for(int i = 0; i < a.indices.size(); i++) {
+        bool shared = std::find(b.indices.begin(), b.indices.end(), a.indices[i]) != b.indices.end();
+        (shared ? shared_indices : a_indices).push_back(a.indices[i]);
+    }
+    for(int i = 0; i < b.indices.size(); i++) {
+        if(std::find(a.indices.begin(), a.indices.end(), b.indices[i]) == a.indices.end()) {
+            b_indices.push_back(b.indices[i]);
+        }
+    }
+    // a as a matrix with rows a_indices and columns shared_indices(the low bits), b with rows shared_indices and columns b_indices
+    std::vector<int> a_matrix_indices = shared_indices;
+    a_matrix_indices.insert(a_matrix_indices.end(), a_indices.begin(), a_indices.end());
+    std::vector<int> b_matrix_indices = b_indices;
+    b_matrix_indices.insert(b_matrix_indices.end(), shared_indices.begin(), shared_indices.end());
+    Tensor a_matrix = permute_tensor(a, a_matrix_indices);
+    Tensor b_matrix = permute_tensor(b, b_matrix_indices);
+
+    Tensor result;
+    result.indices = b_indices;
+    result.indices.insert(result.indices.end(), a_indices.begin(), a_indices.end());
+    result.data.resize((int64_t)1 << result.indices.size());
+    complex_gemm((int64_t)1 << a_indices.size(), (int64_t)1 << b_indices.size(), (int64_t)1 << shared_indices.size(),
+        a_matrix.data.data(), b_matrix.data.data(), result.data.data());
+    return result;
+}
+
+struct ContractionOrder {
+    std::vector<std::pair<int, int>> steps = {}; // The tensors to contract, the result of step i gets tensor number tensor_count + i
+    double flops = 0; // Complex multiply adds
+    double peak_size = 0; // The largest tensor created, in elements
+};
+
+class TensorNetwork {
+public:
+    std::vector<Tensor> tensors = {};
+    int index_count = 0;
+
+    int new_index() {
+        index_count++;
+        return index_count - 1;
+    }
+    /**
+     * Add the gates of the circuit, qubit_indices is the current open index of each qubit and is updated
+     *   With conjugate the complex conjugate of the gates is added instead, e.g. for <psi| in probabilities
+     * Returns -1 if the circuit has gates that can not be added
+    */
+    int add_circuit(const CompiledCircuit& circuit, std::vector<int>& qubit_indices, bool conjugate = false) {
+        for(int i = 0; i < circuit.instructions.size(); i++) {
+            const GateInstruction& instruction = circuit.instructions[i];
+            if(is_measurement_op(instruction.op) || instruction.condition_mask != 0) {
+                return -1;
+            }
+            std::vector<int> qubits = {};
+            for(int j = 0; j < 64; j++) {
+                if((instruction.control_mask >> j) & 1) {
+                    qubits.push_back(j);
+                }
+            }
+            if(instruction.control != -1) {
+                qubits.push_back(instruction.control);
+            }
+            qubits.push_back(instruction.target); // Target is the last qubit
+            if(qubits.size() > 8) {
+                return -1; // Too large tensor
+            }
+            int qubit_count = qubits.size();
+            Tensor tensor;
+            tensor.data = std::vector<std::complex<double>>((int64_t)1 << (2 * qubit_count), 0);
+            for(int j = 0; j < qubit_count; j++) {
+                tensor.indices.push_back(qubit_indices[qubits[j]]);
+            }
+            for(int j = 0; j < qubit_count; j++) {
+                qubit_indices[qubits[j]] = new_index();
+                tensor.indices.push_back(qubit_indices[qubits[j]]);
+            }
+            // Position is in_bits | out_bits << qubit_count, the target is the highest bit of in_bits and out_bits
+            int target_bit = 1 << (qubit_count - 1);
+            int control_bits = target_bit - 1;
+            std::complex<double> matrix[4];
+            get_single_qubit_matrix(instruction, matrix);
+            for(int in_bits = 0; in_bits < (1 << qubit_count); in_bits++) {
+                if((in_bits & control_bits) != control_bits) {
+                    tensor.data[in_bits | (in_bits << qubit_count)] = 1;
+                    continue;
+                }
+                int in_target = (in_bits & target_bit) != 0;
+                for(int out_target = 0; out_target < 2; out_target++) {
+                    int out_bits = (in_bits & control_bits) | (out_target * target_bit);
+                    std::complex<double> value = matrix[out_target * 2 + in_target];
+                    tensor.data[in_bits | (out_bits << qubit_count)] = conjugate ? std::conj(value) : value;
+                }
+            }
+            tensors.push_back(tensor);
+        }
+        return 0;
+    }
+    // Add a tensor with one index, e.g. |0> at the start of a qubit
+    void add_vector(int index, std::complex<double> value_0, std::complex<double> value_1) {
+        Tensor tensor;
+        tensor.indices = {index};
+        tensor.data = {value_0, value_1};
+        tensors.push_back(tensor);
+    }
+    /**
+     * Contract all tensors in the order, the tensors not in the order are multiplied in at the end
+    */
+    Tensor contract(const ContractionOrder& order) const {
+        std::vector<Tensor> all_tensors = tensors;
+        std::vector<bool> used = std::vector<bool>(tensors.size() + order.steps.size(), false);
+        for(int i = 0; i < order.steps.size(); i++) {
+            int a = order.steps[i].first;
+            int b = order.steps[i].second;
+            all_tensors.push_back(contract_tensors(all_tensors[a], all_tensors[b]));
+            used[a] = true;
+            used[b] = true;
+            all_tensors[a] = Tensor(); // Free the memory
+            all_tensors[b] = Tensor();
+        }
+        Tensor result;
+        for(int i = 0; i < all_tensors.size(); i++) {
+            if(!used[i]) {
+                result = contract_tensors(result, all_tensors[i]);
+            }
+        }
+        return result;
+    }
+};
+
+/**
+ * Finds an order to contract a tensor network in, that keeps the tensors small
+ *
+ * Greedy: always contract the pair of tensors sharing an index that reduces the total size the most.
+ *   The randomized trials sometimes pick the second or third best pair instead, which can avoid a large
+ *   tensor later on. The order with the smallest peak size(then fewest flops) is kept
+*/
+class ContractionOrderOptimizer {
+public:
+    int random_trial_count = 16;
+    double random_choice_probability = 0.3; // Probability to skip the best pair in the randomized trials
+    vicmil::RandomNumberGenerator rand_gen;
+
+    ContractionOrder find_order(const TensorNetwork& network) {
+        ContractionOrder best_order = _find_greedy_order(network, false);
+        for(int i = 0; i < random_trial_count; i++) {
+            ContractionOrder order = _find_greedy_order(network, true);
+            if(order.peak_size < best_order.peak_size || (order.peak_size == best_order.peak_size && order.flops < best_order.flops)) {
+                best_order = order;
+            }
+        }
+        return best_order;
+    }
+
+private:
+    ContractionOrder _find_greedy_order(const TensorNetwork& network, bool randomized) {
+        // Only the indices are needed to find the order
+        std::vector<std::vector<int>> tensor_indices = {};
+        std::vector<std::vector<int>> index_tensors = std::vector<std::vector<int>>(network.index_count); // The live tensors with each index
+        for(int i = 0; i < network.tensors.size(); i++) {
+            tensor_indices.push_back(network.tensors[i].indices);
+            for(int j = 0; j < network.tensors[i].indices.size(); j++) {
+                index_tensors[network.tensors[i].indices[j]].push_back(i);
+            }
+        }
+        // Candidates are the pairs of live tensors that share an index, ordered by cost. Only the pairs with the
+        //   contracted tensors are removed and only the pairs with the new tensor are added in each step
+        std::set<std::pair<double, std::pair<int, int>>> candidates = {};
+        for(int index = 0; index < index_tensors.size(); index++) {
+            const std::vector<int>& holders = index_tensors[index];
+            for(int j = 0; j < holders.size(); j++) {
+                for(int l = j + 1; l < holders.size(); l++) {
+                    if(holders[j] != holders[l]) {
+                        candidates.insert(_get_candidate(tensor_indices, holders[j], holders[l]));
+                    }
+                }
+            }
+        }
+        ContractionOrder order;
+        while(candidates.size() > 0) {
+            auto candidate = candidates.begin();
+            int choice = 0;
+            while(randomized && std::next(candidate) != candidates.end() && choice < 3 && rand_gen.rand_between_0_and_1() < random_choice_probability) {
+                candidate++;
+                choice++;
+            }
+            int a = candidate->second.first;
+            int b = candidate->second.second;
+            std::vector<int> result_indices = _get_result_indices(tensor_indices[a], tensor_indices[b]);
+            // One multiply add for each combination of all the indices, shared indices are in both a and b
+            int all_index_count = (tensor_indices[a].size() + tensor_indices[b].size() + result_indices.size()) / 2;
+            order.flops += std::pow(2.0, all_index_count);
+            order.peak_size = std::max(order.peak_size, std::pow(2.0, result_indices.size()));
+            order.steps.push_back({a, b});
+            // Remove a and b, with all their pairs
+            int contracted[2] = {a, b};
+            for(int t = 0; t < 2; t++) {
+                int tensor = contracted[t];
+                for(int j = 0; j < tensor_indices[tensor].size(); j++) {
+                    std::vector<int>& holders = index_tensors[tensor_indices[tensor][j]];
+                    holders.erase(std::remove(holders.begin(), holders.end(), tensor), holders.end());
+                    for(int l = 0; l < holders.size(); l++) {
+                        candidates.erase(_get_candidate(tensor_indices, std::min(tensor, holders[l]), std::max(tensor, holders[l])));
+                    }
+                }
+            }
+            int new_tensor = tensor_indices.size();
+            tensor_indices.push_back(result_indices);
+            for(int j = 0; j < result_indices.size(); j++) {
+                std::vector<int>& holders = index_tensors[result_indices[j]];
+                for(int l = 0; l < holders.size(); l++) {
+                    candidates.insert(_get_candidate(tensor_indices, holders[l], new_tensor));
+                }
+                holders.push_back(new_tensor);
+            }
+        }
+        return order;
+    }
+    // The pair a < b keyed by how much contracting it changes the total size
+    static std::pair<double, std::pair<int, int>> _get_candidate(const std::vector<std::vector<int>>& tensor_indices, int a, int b) {
+        int result_index_count = _get_result_indices(tensor_indices[a], tensor_indices[b]).size();
+        double cost = std::pow(2.0, result_index_count) - std::pow(2.0, tensor_indices[a].size()) - std::pow(2.0, tensor_indices[b].size());
+        return {cost, {a, b}};
+    }
+    // The indices that are only in one of the tensors
+    static std::vector<int> _get_result_indices(const std::vector<int>& a, const std::vector<int>& b) {
+        std::vector<int> result = {};
+        for(int i = 0; i < a.size(); i++) {
+            if(std::find(b.begin(), b.end(), a[i]) == b.end()) {
+                result.push_back(a[i]);
+            }
+        }
+        for(int i = 0; i < b.size(); i++) {
+            if(std::find(a.begin(), a.end(), b[i]) == a.end()) {
+                result.push_back(b[i]);
+            }
+        }
+        return result;
+    }
+};
+
+/**
+ * Get the amplitude of output_state(bit i is qubit i) after running the circuit on |0>, using a tensor network
+ * Returns -1 if the circuit can not be converted
+*/
+int get_tensor_network_amplitude(const CompiledCircuit& circuit, uint64_t output_state, std::complex<double>* amplitude) {
+    if(circuit.qubit_count > 64) {
+        return -1;
+    }
+    TensorNetwork network;
+    std::vector<int> qubit_indices = std::vector<int>(circuit.qubit_count);
+    for(int i = 0; i < circuit.qubit_count; i++) {
+        qubit_indices[i] = network.new_index();
+        network.add_vector(qubit_indices[i], 1, 0);
+    }
+    if(network.add_circuit(circuit, qubit_indices) != 0) {
+        return -1;
+    }
+    for(int i = 0; i < circuit.qubit_count; i++) {
+        bool value = (output_state >> i) & 1;
+        network.add_vector(qubit_indices[i], value ? 0 : 1, value ? 1 : 0);
+    }
+    ContractionOrderOptimizer optimizer;
+    *amplitude = network.contract(optimizer.find_order(network)).data[0];
+    return 0;
+}
+
+/**
+ * Get the probability that the qubits are measured as the values, after running the circuit on |0>
+ *   The network is the circuit followed by its conjugate, the other qubits are traced out
+ * Returns -1 if the circuit can not be converted, there is not one value per qubit, or a qubit is repeated or out of range
+*/
+int get_tensor_network_marginal_probability(const CompiledCircuit& circuit, const std::vector<int>& qubits, const std::vector<int>& values, double* probability) {
+    if(values.size() != qubits.size()) {
+        return -1;
+    }
+    for(int i = 0; i < qubits.size(); i++) {
+        if(qubits[i] < 0 || qubits[i] >= circuit.qubit_count || std::count(qubits.begin(), qubits.begin() + i, qubits[i]) != 0) {
+            return -1;
+        }
+    }
+    TensorNetwork network;
+    std::vector<int> qubit_indices = std::vector<int>(circuit.qubit_count);
+    std::vector<int> conjugate_qubit_indices = std::vector<int>(circuit.qubit_count);
+    for(int i = 0; i < circuit.qubit_count; i++) {
+        qubit_indices[i] = network.new_index();
+        conjugate_qubit_indices[i] = network.new_index();
+        network.add_vector(qubit_indices[i], 1, 0);
+        network.add_vector(conjugate_qubit_indices[i], 1, 0);
+    }
+    if(network.add_circuit(circuit, qubit_indices) != 0 || network.add_circuit(circuit, conjugate_qubit_indices, true) != 0) {
+        return -1;
+    }
+    for(int i = 0; i < circuit.qubit_count; i++) {
+        int position = std::find(qubits.begin(), qubits.end(), i) - qubits.begin();
+        if(position == qubits.size()) {
+            // Trace out the qubit, the identity connects the circuit with its conjugate
+            Tensor identity;
+            identity.indices = {qubit_indices[i], conjugate_qubit_indices[i]};
+            identity.data = {1, 0, 0, 1};
+            network.tensors.push_back(identity);
+            continue;
+        }
+        bool value = values[position] != 0;
+        network.add_vector(qubit_indices[i], value ? 0 : 1, value ? 1 : 0);
+        network.add_vector(conjugate_qubit_indices[i], value ? 0 : 1, value ? 1 : 0);
+    }
+    ContractionOrderOptimizer optimizer;
+    *probability = network.contract(optimizer.find_order(network)).data[0].real();
+    return 0;
+}
+
+void TEST_TensorNetwork() {
+    CompiledCircuit circuit;
+    circuit.qubit_count = 6;
+    vicmil::RandomNumberGenerator rand_gen;
+    rand_gen.set_seed(5);
+    for(int i = 0; i < 60; i++) {
+        int qubit = rand_gen.rand() % 6;
+        int other_qubit = (qubit + 1 + rand_gen.rand() % 5) % 6;
+        switch(rand_gen.rand() % 6) {
+            case 0: circuit.add_hadamar(qubit); break;
+            case 1: circuit.add_phase_shift(qubit); break;
+            case 2: circuit.add_cnot(qubit, other_qubit); break;
+            case 3: circuit.add_phase(qubit, 0.3 * i); break;
+            case 4: circuit.add_toffoli(qubit, (qubit + 1) % 6, (qubit + 2) % 6); break;
+            case 5: circuit.add_rx(qubit, 0.2 * i); break;
+        }
+    }
+    assert(circuit.find_invalid_instruction() == -1);
+    QubitSystem system = QubitSystem(6);
+    assert(circuit.run(system) == 0);
+    for(int i = 0; i < system._qubit_states.size(); i += 7) {
+        std::complex<double> amplitude;
+        assert(get_tensor_network_amplitude(circuit, i, &amplitude) == 0);
+        assert(std::abs(amplitude - system._qubit_states[i].v) < 0.000001);
+    }
+    double probability;
+    assert(get_tensor_network_marginal_probability(circuit, {2}, {1}, &probability) == 0);
+    assert(std::abs(probability - system.get_qubit_probability(2)) < 0.000001);
+
+    // A shallow circuit on 60 qubits, each qubit is in |+> and then entangled with its neighbour
+    CompiledCircuit wide_circuit;
+    for(int i = 0; i < 60; i++) {
+        wide_circuit.add_hadamar(i);
+    }
+    for(int i = 0; i + 1 < 60; i += 2) {
+        wide_circuit.add_multi_controlled_z({i}, i + 1);
+    }
+    std::complex<double> amplitude;
+    assert(get_tensor_network_amplitude(wide_circuit, 3, &amplitude) == 0); // One pair in |11>, the phase is -1
+    assert(std::abs(amplitude + std::pow(0.5, 30)) < 0.000001 * std::pow(0.5, 30));
+    assert(get_tensor_network_amplitude(wide_circuit, 3ULL << 40, &amplitude) == 0); // The same for a pair above qubit 32
+    assert(std::abs(amplitude + std::pow(0.5, 30)) < 0.000001 * std::pow(0.5, 30));
+    assert(get_tensor_network_amplitude(wide_circuit, 3ULL << 39, &amplitude) == 0); // Qubits 39 and 40 are in different pairs
+    assert(std::abs(amplitude - std::pow(0.5, 30)) < 0.000001 * std::pow(0.5, 30));
+    assert(get_tensor_network_marginal_probability(wide_circuit, {0, 1, 59}, {1, 0, 1}, &probability) == 0);
+    assert(std::abs(probability - 0.125) < 0.000001);
+
+    // One value per qubit, and each qubit once and in the circuit
+    assert(get_tensor_network_marginal_probability(circuit, {2, 3}, {1}, &probability) == -1);
+    assert(get_tensor_network_marginal_probability(circuit, {2, 2}, {1, 1}, &probability) == -1);
+    assert(get_tensor_network_marginal_probability(circuit, {6}, {1}, &probability) == -1);
+    assert(get_tensor_network_marginal_probability(circuit, {-1}, {0}, &probability) == -1);
+}
+AddTest(TEST_TensorNetwork);
+}
@@ -0,0 +1,227 @@
+#pragma once
+#include "N8_tensor_network.h"
+
+namespace qubit_circuit {
+
+/**
+ * Schrödinger–Feynman hybrid simulation, the qubits are split in two halves at cut_qubit
+ *
+ * Each half is simulated as its own state vector of 2^(N/2) states(Schrödinger). A gate that crosses the cut
+ *   is split in a sum of two products, e.g. cnot = |0><0| x I + |1><1| x X, and the sum over all choices
+ *   of terms is done like a path sum(Feynman). With k gates crossing the cut there are 2^k paths,
+ *   so memory is exponential in N/2 while time is exponential in k.
+ *
+ * A controlled gate G with controls C on one side is split as (I - P) x I + P x G', where P projects on
+ *   all controls being 1 and G' is the gate on the other side with the rest of the controls.
+ *   Paths where a projection gives 0 are skipped. The paths are split between threads by their first choices
+*/
+
+struct _HybridSegment {
+    CompiledCircuit half_circuits[2]; // The gates in each half before the cut gate, with qubits numbered from 0 in the half
+    // The cut gate after the gates, if has_cut_gate
+    bool has_cut_gate = false;
+    int projector_half = 0; // The half with the controls that the gate is split on
+    int projector_mask = 0;
+    GateInstruction other_half_gate; // Applied in the other half with the second term
+};
+
+class SchrodingerFeynmanSimulator {
+public:
+    int cut_qubit = -1; // Qubits below it are in the first half, -1 is half of the qubits
+    // Statistics from the last run
+    int cut_gate_count = 0;
+    int64_t path_count = 0;
+    int64_t pruned_path_count = 0;
+
+    /**
+     * Get the amplitudes of the output states(bit i is qubit i) after running the circuit on |0>
+     * Returns -1 if the circuit has measurements, or a half is too large
+    */
+    int get_amplitudes(const CompiledCircuit& circuit, const std::vector<uint64_t>& output_states, std::vector<std::complex<double>>* amplitudes) {
+        _cut = cut_qubit == -1 ? circuit.qubit_count / 2 : cut_qubit;
+        _half_qubit_counts[0] = _cut;
+        _half_qubit_counts[1] = circuit.qubit_count - _cut;
+        if(_cut < 1 || _half_qubit_counts[1] < 1 || _half_qubit_counts[0] >= 24 || _half_qubit_counts[1] >= 24) {
+            return -1;
+        }
+        if(circuit.find_invalid_instruction() != -1 || _split_circuit(circuit) != 0) {
+            return -1;
+        }
+        _output_states = &output_states;
+
+        int prefix_length = 0;
+        while(prefix_length < cut_gate_count && (1 << prefix_length) < vicmil::get_thread_pool().get_thread_count() * 4) {
+            prefix_length++;
+        }
+        int thread_count = vicmil::get_thread_pool().get_thread_count();
+        std::vector<std::vector<std::complex<double>>> partial_amplitudes = std::vector<std::vector<std::complex<double>>>(thread_count,
+            std::vector<std::complex<double>>(output_states.size(), 0));
+        std::vector<int64_t> path_counts = std::vector<int64_t>(thread_count, 0);
+        std::vector<int64_t> pruned_path_counts = std::vector<int64_t>(thread_count, 0);
+        vicmil::parallel_for(0, (int64_t)1 << prefix_length, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+            for(int64_t prefix = chunk_begin; prefix < chunk_end; prefix++) {
+                QubitSystem halves[2] = {QubitSystem(_half_qubit_counts[0]), QubitSystem(_half_qubit_counts[1])};
+                _run_paths(0, halves, prefix, prefix_length, partial_amplitudes[chunk_num], path_counts[chunk_num], pruned_path_counts[chunk_num]);
+            }
+        }, 1);
+
+        amplitudes->assign(output_states.size(), 0);
+        path_count = 0;
+        pruned_path_count = 0;
+        for(int i = 0; i < thread_count; i++) {
+            for(int j = 0; j < output_states.size(); j++) {
+                (*amplitudes)[j] += partial_amplitudes[i][j];
+            }
+            path_count += path_counts[i];
+            pruned_path_count += pruned_path_counts[i];
+        }
+        return 0;
+    }
+
+private:
+    int _cut = 0;
+    int _half_qubit_counts[2] = {0, 0};
+    std::vector<_HybridSegment> _segments = {};
+    const std::vector<uint64_t>* _output_states = nullptr;
+
+    // Get the instruction with the qubits numbered from the start of the half, controls is a mask of all control qubits
+    GateInstruction _to_half(GateInstruction instruction, uint64_t controls, int half) {
+        int offset = half == 0 ? 0 : _cut;
+        instruction.target -= offset;
+        if(instruction.op == op_cnot) {
+            instruction.op = op_multi_controlled_x;
+            instruction.control = -1;
+        }
+        instruction.control_mask = controls >> offset;
+        return instruction;
+    }
+    void _start_segment() {
+        _segments.push_back(_HybridSegment());
+        for(int i = 0; i < 2; i++) {
+            _segments.back().half_circuits[i].qubit_count = _half_qubit_counts[i];
+        }
+    }
+    int _split_circuit(const CompiledCircuit& circuit) {
+        _segments = {};
+        _start_segment();
+        cut_gate_count = 0;
+        uint64_t low_mask = ((uint64_t)1 << _cut) - 1; // 64 bit, there can be more than 32 qubits
+        for(int i = 0; i < circuit.instructions.size(); i++) {
+            const GateInstruction& instruction = circuit.instructions[i];
+            if(is_measurement_op(instruction.op) || instruction.condition_mask != 0) {
+                return -1;
+            }
+            uint64_t controls = instruction.control_mask;
+            if(instruction.control != -1) {
+                controls |= (uint64_t)1 << instruction.control;
+            }
+            uint64_t qubit_mask = controls | ((uint64_t)1 << instruction.target);
+            if((qubit_mask & low_mask) == qubit_mask || (qubit_mask & ~low_mask) == qubit_mask) {
+                // The gate is inside one half
+                int half = (qubit_mask & low_mask) != 0 ? 0 : 1;
+                _segments.back().half_circuits[half].instructions.push_back(_to_half(instruction, controls, half));
+                continue;
+            }
+            // The gate crosses the cut, the controls in the half without the target are projected on
+            _HybridSegment& segment = _segments.back();
+            int target_half = instruction.target < _cut ? 0 : 1;
+            int projector_half = 1 - target_half;
+            uint64_t projector_controls = controls & (projector_half == 0 ? low_mask : ~low_mask);
+            segment.has_cut_gate = true;
+            segment.projector_half = projector_half;
+            segment.projector_mask = (int)(projector_controls >> (projector_half == 0 ? 0 : _cut));
+            segment.other_half_gate = _to_half(instruction, controls & ~projector_controls, target_half);
+            cut_gate_count++;
+            _start_segment();
+        }
+        return 0;
+    }
+    /**
+     * Keep the states where all qubits in the mask are 1(projected) or the rest(not projected)
+     * Returns the total probability that is left
+    */
+    static double _project(QubitSystem& qubit_system, int mask, bool projected) {
+        if(!projected) {
+            qubit_system._multiply_subspace(mask, mask, 0);
+            return qubit_system._get_subspace_probability(0, 0) * qubit_system._norm_scale * qubit_system._norm_scale;
+        }
+        // The states that are not kept have at least one of the qubits 0
+        for(int bit = 0; bit < 32; bit++) {
+            if((mask >> bit) & 1) {
+                qubit_system._multiply_subspace(1 << bit, 0, 0);
+            }
+        }
+        return qubit_system._get_subspace_probability(mask, mask) * qubit_system._norm_scale * qubit_system._norm_scale;
+    }
+    void _run_paths(int segment_num, QubitSystem* halves, uint64_t prefix_choices, int prefix_length,
+        std::vector<std::complex<double>>& amplitudes, int64_t& path_count_, int64_t& pruned_path_count_) {
+        const _HybridSegment& segment = _segments[segment_num];
+        segment.half_circuits[0].run(halves[0]);
+        segment.half_circuits[1].run(halves[1]);
+        if(!segment.has_cut_gate) {
+            path_count_++;
+            const std::vector<uint64_t>& output_states = *_output_states;
+            for(int i = 0; i < output_states.size(); i++) {
+                uint64_t low_state = output_states[i] & (((uint64_t)1 << _cut) - 1);
+                uint64_t high_state = output_states[i] >> _cut;
+                amplitudes[i] += halves[0]._qubit_states[low_state].v * halves[1]._qubit_states[high_state].v;
+            }
+            return;
+        }
+        int branch_count = prefix_length > 0 ? 1 : 2;
+        for(int branch = 0; branch < branch_count; branch++) {
+            bool second_term = prefix_length > 0 ? (prefix_choices & 1) : branch == 0;
+            // Only the first of two branches needs a copy, the last one can use the original
+            std::vector<QubitSystem> branch_halves = {};
+            QubitSystem* term_halves = halves;
+            if(branch < branch_count - 1) {
+                branch_halves.reserve(2);
+                branch_halves.emplace_back(halves[0]);
+                branch_halves.emplace_back(halves[1]);
+                term_halves = branch_halves.data();
+            }
+            if(_project(term_halves[segment.projector_half], segment.projector_mask, second_term) < 1e-30) {
+                pruned_path_count_++;
+                continue;
+            }
+            if(second_term) {
+                CompiledCircuit::run_instruction(term_halves[1 - segment.projector_half], segment.other_half_gate);
+            }
+            _run_paths(segment_num + 1, term_halves, prefix_choices >> 1, std::max(0, prefix_length - 1), amplitudes, path_count_, pruned_path_count_);
+        }
+    }
+};
+
+void TEST_SchrodingerFeynmanSimulator() {
+    CompiledCircuit circuit;
+    circuit.qubit_count = 8;
+    vicmil::RandomNumberGenerator rand_gen;
+    rand_gen.set_seed(7);
+    for(int i = 0; i < 80; i++) {
+        int qubit = rand_gen.rand() % 8;
+        int other_qubit = (qubit + 1 + rand_gen.rand() % 7) % 8;
+        switch(rand_gen.rand() % 6) {
+            case 0: circuit.add_hadamar(qubit); break;
+            case 1: circuit.add_phase_shift(qubit); break;
+            case 2: circuit.add_cnot(qubit, other_qubit); break;
+            case 3: circuit.add_phase(qubit, 0.3 * i); break;
+            case 4: circuit.add_multi_controlled_z({other_qubit}, qubit); break;
+            case 5: circuit.add_toffoli(qubit, (qubit + 1) % 8, (qubit + 4) % 8); break;
+        }
+    }
+    QubitSystem system = QubitSystem(8);
+    assert(circuit.run(system) == 0);
+    std::vector<uint64_t> output_states = {};
+    for(int i = 0; i < system._qubit_states.size(); i++) {
+        output_states.push_back(i);
+    }
+    SchrodingerFeynmanSimulator simulator;
+    std::vector<std::complex<double>> amplitudes;
+    assert(simulator.get_amplitudes(circuit, output_states, &amplitudes) == 0);
+    assert(simulator.cut_gate_count > 0);
+    for(int i = 0; i < amplitudes.size(); i++) {
+        assert(std::abs(amplitudes[i] - system._qubit_states[i].v) < 0.000001);
+    }
+}
+AddTest(TEST_SchrodingerFeynmanSimulator);
+}
@@ -1,2 +1,2 @@
 #pragma once
-#include "N3_interface.h"
\ No newline at end of file
+#include "N16_sampling.h"
\ No newline at end of file
@@ -0,0 +1,187 @@
+#pragma once
+#include "L9_other.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+namespace vicmil {
+/**
+ * A pool of worker threads that are started once and then reused,
+ *  so that a parallel loop does not have to pay for starting new threads every time
+ *
+ * Each job is run once on every thread, with a thread number from 0 to get_thread_count()-1
+ *  The calling thread works as thread 0, so it is not idle while waiting
+*/
+class ThreadPool {
+    std::vector<std::thread> _workers = {};
+    std::mutex _mutex;
+    std::mutex _job_mutex; // Only one job at a time
+    std::condition_variable _work_cv;
+    std::condition_variable _done_cv;
+    const std::function<void(int)>* _job = nullptr;
+    int64_t _job_id = 0;
+    int _remaining_count = 0;
+    bool _stop = false;
+
+    static bool& _inside_pool() {
+        static thread_local bool inside_pool = false;
+        return inside_pool;
+    }
+    void _worker_loop(int thread_num) {
+        _inside_pool() = true;
+        int64_t last_job_id = 0;
+        while(true) {
+            const std::function<void(int)>* job;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _work_cv.wait(lock, [&] { return _stop || _job_id != last_job_id; });
+                if(_stop) {
+                    return;
+                }
+                last_job_id = _job_id;
+                job = _job;
+            }
+            (*job)(thread_num);
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _remaining_count--;
+                if(_remaining_count == 0) {
+                    _done_cv.notify_one();
+                }
+            }
+        }
+    }
+public:
+    ThreadPool(int thread_count) {
+        for(int i = 1; i < thread_count; i++) {
+            _workers.push_back(std::thread(&ThreadPool::_worker_loop, this, i));
+        }
+    }
+    ~ThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _work_cv.notify_all();
+        for(int i = 0; i < _workers.size(); i++) {
+            _workers[i].join();
+        }
+    }
+    int get_thread_count() {
+        return _workers.size() + 1;
+    }
+    /**
+     * Returns true if called from inside a job, nested jobs are run on the calling thread only
+    */
+    static bool inside_pool() {
+        return _inside_pool();
+    }
+    /**
+     * Run all parallel loops on the calling thread from now on, e.g. in a forked child process
+     *   where the worker threads of the pool do not exist
+    */
+    static void run_serially_on_this_thread() {
+        _inside_pool() = true;
+    }
+    /**
+     * Run func(thread_num) once on every thread, returns when all threads are done
+    */
+    void run_on_all_threads(const std::function<void(int)>& func) {
+        if(_workers.size() == 0 || inside_pool()) {
+            for(int i = 0; i < get_thread_count(); i++) {
+                func(i);
+            }
+            return;
+        }
+        std::unique_lock<std::mutex> job_lock(_job_mutex);
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _job = &func;
+            _remaining_count = _workers.size();
+            _job_id++;
+        }
+        _work_cv.notify_all();
+        _inside_pool() = true;
+        func(0);
+        _inside_pool() = false;
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done_cv.wait(lock, [&] { return _remaining_count == 0; });
+    }
+};
+
+/**
+ * Get the thread pool shared by the whole program, it has one thread per core
+ *  (Threads are not used with emscripten, everything then runs on the calling thread)
+*/
+inline ThreadPool& get_thread_pool() {
+#ifdef __EMSCRIPTEN__
+    static ThreadPool thread_pool = ThreadPool(1);
+#else
+    static ThreadPool thread_pool = ThreadPool(std::max(1, (int)std::thread::hardware_concurrency()));
+#endif
+    return thread_pool;
+}
+
+const int64_t default_parallel_min_chunk_size = 1 << 14; // Smaller loops are not worth splitting
+
+/**
+ * Get how many chunks parallel_for will split a loop of the specified size into
+*/
+inline int parallel_chunk_count(int64_t size, int64_t min_chunk_size = default_parallel_min_chunk_size) {
+    if(ThreadPool::inside_pool()) {
+        return 1;
+    }
+    int64_t max_chunk_count = std::max((int64_t)1, size / std::max((int64_t)1, min_chunk_size));
+    return std::min((int64_t)get_thread_pool().get_thread_count(), max_chunk_count);
+}
+
+/**
+ * Split the range [begin, end) in contiguous chunks, one per thread, and call func(chunk_begin, chunk_end, chunk_num)
+ *   The split only depends on the range, so the same range is always handled by the same threads
+ *   which matters for memory that is placed close to the thread that first wrote to it
+*/
+template<class Func>
+void parallel_for(int64_t begin, int64_t end, Func func, int64_t min_chunk_size = default_parallel_min_chunk_size) {
+    int64_t size = end - begin;
+    if(size <= 0) {
+        return;
+    }
+    int chunk_count = parallel_chunk_count(size, min_chunk_size);
+    if(chunk_count == 1) {
+        func(begin, end, 0);
+        return;
+    }
+    std::function<void(int)> job = [&](int thread_num) {
+        if(thread_num >= chunk_count) {
+            return;
+        }
+        int64_t chunk_begin = begin + size * thread_num / chunk_count;
+        int64_t chunk_end = begin + size * (thread_num + 1) / chunk_count;
+        func(chunk_begin, chunk_end, thread_num);
+    };
+    get_thread_pool().run_on_all_threads(job);
+}
+
+void TEST_parallel_for() {
+    std::vector<int> values = std::vector<int>(100000, 0);
+    int chunk_count = parallel_chunk_count(values.size(), 1000);
+    std::vector<int64_t> chunk_sums = std::vector<int64_t>(chunk_count, 0);
+    parallel_for(0, values.size(), [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+        for(int64_t i = chunk_begin; i < chunk_end; i++) {
+            values[i] += 1;
+            chunk_sums[chunk_num] += i;
+        }
+    }, 1000);
+    int64_t sum = 0;
+    for(int i = 0; i < chunk_count; i++) {
+        sum += chunk_sums[i];
+    }
+    assert(sum == (int64_t)values.size() * (values.size() - 1) / 2);
+    for(int i = 0; i < values.size(); i++) {
+        assert(values[i] == 1);
+    }
+}
+AddTest(TEST_parallel_for);
+}
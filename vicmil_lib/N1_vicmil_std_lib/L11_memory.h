@@ -0,0 +1,146 @@
+#pragma once
+#include "L10_threading.h"
+#include <new>
+#include <cstring>
+#include <type_traits>
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+#include <sys/mman.h>
+#endif
+
+namespace vicmil {
+const size_t cache_line_size = 64;
+const size_t huge_page_size = 2 << 20;
+
+/**
+ * Allocate zero filled memory for a large array that is processed with parallel_for
+ *   Large blocks are aligned to 2 MB and backed by huge pages where the system allows it, smaller ones are cache line aligned
+ *
+ * The zeros are written with parallel_for over the elements, so every page is first touched by a pool thread instead of
+ *   all pages by the calling thread. NUMA placement is best effort only: the pool threads are not pinned to cores, and the
+ *   loops over the array later split it in their own ways(e.g. by subspace runs or cache blocks), so a page is not guaranteed
+ *   to be on the socket of the thread that uses it. element_size is the size of the array elements, so no element is split
+*/
+inline void* allocate_parallel_memory(size_t size, size_t element_size) {
+    size = std::max(size, (size_t)1);
+    void* memory = nullptr;
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+    if(size >= huge_page_size) {
+        size_t mapped_size = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+        // Reserved huge pages if there are any, otherwise transparent huge pages on memory aligned to 2 MB
+        memory = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(memory == MAP_FAILED) {
+            char* unaligned = (char*)mmap(nullptr, mapped_size + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(unaligned == (char*)MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            char* aligned = (char*)(((uintptr_t)unaligned + huge_page_size - 1) / huge_page_size * huge_page_size);
+            if(aligned != unaligned) {
+                munmap(unaligned, aligned - unaligned);
+            }
+            munmap(aligned + mapped_size, unaligned + huge_page_size - aligned);
+            madvise(aligned, mapped_size, MADV_HUGEPAGE);
+            memory = aligned;
+        }
+    }
+#endif
+    if(memory == nullptr) {
+        memory = ::operator new(size, std::align_val_t(cache_line_size));
+    }
+    char* bytes = (char*)memory;
+    int64_t element_count = size / element_size;
+    parallel_for(0, element_count, [&](int64_t chunk_begin, int64_t chunk_end, int chunk_num) {
+        std::memset(bytes + chunk_begin * element_size, 0, (chunk_end - chunk_begin) * element_size);
+    });
+    std::memset(bytes + element_count * element_size, 0, size - element_count * element_size);
+    return memory;
+}
+
+/**
+ * Free memory from allocate_parallel_memory, size is the same as when it was allocated
+*/
+inline void free_parallel_memory(void* memory, size_t size) {
+    size = std::max(size, (size_t)1);
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+    if(size >= huge_page_size) {
+        munmap(memory, (size + huge_page_size - 1) / huge_page_size * huge_page_size);
+        return;
+    }
+#endif
+    ::operator delete(memory, std::align_val_t(cache_line_size));
+}
+
+/**
+ * Specialize as std::true_type for types where all zero bytes is the default value, e.g. a wrapper of std::complex
+ *   that is not trivially default constructible. ParallelAllocator then keeps the zeros instead of constructing them
+*/
+template<class T>
+struct is_zero_initializable : std::is_trivially_default_constructible<T> {};
+
+/**
+ * An allocator for std::vector that uses allocate_parallel_memory
+ *
+ * Elements without arguments are not constructed for zero initializable types, so the zeros from allocate_parallel_memory
+ *   are kept instead of writing everything again on one thread.
+ *   As with new T[n], growing a vector of such a type again after shrinking it keeps the old values.
+ *   Other types are constructed as usual
+*/
+template<class T>
+class ParallelAllocator {
+public:
+    typedef T value_type;
+
+    ParallelAllocator() {}
+    template<class U>
+    ParallelAllocator(const ParallelAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return (T*)allocate_parallel_memory(n * sizeof(T), sizeof(T));
+    }
+    void deallocate(T* memory, size_t n) {
+        free_parallel_memory(memory, n * sizeof(T));
+    }
+    template<class U>
+    void construct(U* element) {
+        if(!is_zero_initializable<U>::value) {
+            ::new((void*)element) U();
+        }
+    }
+    template<class U, class... Args>
+    void construct(U* element, Args&&... args) {
+        ::new((void*)element) U(std::forward<Args>(args)...);
+    }
+    template<class U>
+    bool operator==(const ParallelAllocator<U>&) const {
+        return true;
+    }
+    template<class U>
+    bool operator!=(const ParallelAllocator<U>&) const {
+        return false;
+    }
+};
+
+void TEST_ParallelAllocator() {
+    std::vector<std::complex<double>, ParallelAllocator<std::complex<double>>> values;
+    values.resize(huge_page_size / sizeof(std::complex<double>) + 3); // Large enough for huge pages
+    assert((uintptr_t)values.data() % cache_line_size == 0);
+    for(int i = 0; i < values.size(); i++) {
+        assert(values[i] == std::complex<double>(0, 0));
+    }
+    values.push_back(std::complex<double>(1, 2));
+    assert(values.back() == std::complex<double>(1, 2) && values[0] == std::complex<double>(0, 0));
+
+    // A type with a default value that is not zero is still constructed, also when the vector grows in place
+    struct Counter {
+        int count = 7;
+    };
+    std::vector<Counter, ParallelAllocator<Counter>> counters;
+    counters.resize(100);
+    counters[50].count = 3;
+    counters.resize(10);
+    counters.resize(100);
+    for(int i = 0; i < counters.size(); i++) {
+        assert(counters[i].count == 7);
+    }
+}
+AddTest(TEST_ParallelAllocator);
+}
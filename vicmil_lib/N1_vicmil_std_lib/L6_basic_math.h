@@ -26,6 +26,17 @@ inline bool is_power_of_two(unsigned int x) {
 inline bool is_power_of_two(int x) {
     return !(x == 0) && !(x & (x - 1));
 }
+inline bool is_power_of_two(uint64_t x) {
+    return !(x == 0) && !(x & (x - 1));
+}
+inline int count_bits(uint64_t x) {
+    int count = 0;
+    while(x != 0) {
+        x &= x - 1; // Clear lowest set bit
+        count++;
+    }
+    return count;
+}
     
 unsigned int upper_power_of_two(unsigned int x)
 {
@@ -1,2 +1,2 @@
 #pragma once
-#include "L9_other.h"
\ No newline at end of file
+#include "L11_memory.h"
\ No newline at end of file